@@ -0,0 +1,45 @@
+#!/bin/sh
+# Processes created per script: runs a script of echo, printf, test and
+# true lines through each shell and reads the kernel's fork counter (the
+# "processes" line of /proc/stat) around the run. The cost of starting the
+# shell itself is measured with an empty script and subtracted.
+#
+# usage: bench/fork_count.sh [lines] [shell...]   (default: ./version6 ./version7)
+
+lines=${1:-2000}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- ./version6 ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+awk -v n="$lines" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 4 == 0) print "echo line " i
+        else if (i % 4 == 1) print "printf %s-%d\\n item " i
+        else if (i % 4 == 2) print "test " i " -gt 5"
+        else print "true"
+    }
+    print "exit"
+}' > "$dir/script"
+echo exit > "$dir/empty"
+
+forks() {
+    awk '/^processes/ { print $2 }' /proc/stat
+}
+
+# Prints the processes and milliseconds one run of shell on script took
+run() {
+    before=$(forks)
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" "$1" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    after=$(forks)
+    echo $((after - before)) $(((end - start) / 1000000))
+}
+
+for shell in "$@"; do
+    set -- $(run "$shell" "$dir/empty")
+    base_forks=$1 base_ms=$2
+    set -- $(run "$shell" "$dir/script")
+    echo "{\"bench\":\"fork_count\",\"shell\":\"$shell\",\"lines\":$lines,\"processes\":$(($1 - base_forks)),\"ms\":$(($2 - base_ms))}"
+done
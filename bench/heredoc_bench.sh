@@ -0,0 +1,38 @@
+#!/bin/sh
+# Here-document delivery: runs a script of `read line <<EOF` commands in
+# each shell, with a 3-line body (a pipe in version7) and a 200-line body
+# of about 10 KB (a memfd), and reports commands per second. `read` is a
+# builtin everywhere, so no process is started per command.
+#
+# usage: bench/heredoc_bench.sh [commands] [shell...]   (default: 10000 sh ./version7)
+
+count=${1:-10000}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- sh ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+for lines in 3 200; do
+    body=$(seq -f 'template line %g with some filler text here' "$lines")
+    awk -v n="$count" -v body="$body" 'BEGIN {
+        for (i = 0; i < n; i++) printf "read line <<EOF\n%s\nEOF\n", body
+        print "exit"
+    }' > "$dir/script$lines"
+done
+echo exit > "$dir/empty"
+
+# Prints the nanoseconds one run of shell on script took
+run() {
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" "$1" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+for shell in "$@"; do
+    base=$(run "$shell" "$dir/empty")
+    for lines in 3 200; do
+        ns=$(($(run "$shell" "$dir/script$lines") - base))
+        echo "{\"bench\":\"heredoc\",\"shell\":\"$shell\",\"body_lines\":$lines,\"commands\":$count,\"ms\":$((ns / 1000000)),\"commands_per_sec\":$((count * 1000000000 / ns))}"
+    done
+done
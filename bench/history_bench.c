@@ -0,0 +1,103 @@
+// History at scale: writes a history file of N commands, then times the
+// one-off index build, a normal startup against the built index, and the
+// lookups behind !n, !prefix and history -s.
+//
+// usage: history_bench [entries] [file]
+
+#define SHELL_NO_MAIN
+#include "../version7.c"
+#include <time.h>
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Writes entries generated command lines, drawn from a few dozen programs
+// with varying arguments the way a real history looks
+static void write_history(const char* path, long entries) {
+    static const char* forms[] = {
+        "git commit -m 'fix issue %ld'", "git checkout feature_%ld", "ls -la dir_%ld",
+        "make -j8 target_%ld", "grep -rn pattern_%ld src/", "cd /home/user/project_%ld",
+        "vim src/file_%ld.c", "cat log_%ld.txt | sort | uniq -c", "./version7 script_%ld.sh",
+        "gcc -O2 -Wall -o prog_%ld prog_%ld.c", "python3 tool_%ld.py --verbose", "ssh host%ld",
+    };
+    int nforms = sizeof(forms) / sizeof(forms[0]);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (long i = 0; i < entries; i++) {
+        long arg = (i * 2654435761u) % 100000;
+        fprintf(fp, forms[i % nforms], arg, arg);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+static void report(const char* op, const char* arg, double total_us, int calls, long found) {
+    printf("{\"bench\":\"history\",\"op\":\"%s\",\"arg\":\"%s\",\"us_per_op\":%.2f,\"result\":%ld}\n",
+           op, arg, total_us / calls, found);
+}
+
+int main(int argc, char* argv[]) {
+    long entries = argc > 1 ? atol(argv[1]) : 1000000;
+    char* path = argc > 2 ? argv[2] : "/tmp/history_bench";
+    char index_path[PATH_MAX];
+    int calls = 1000;
+    double start;
+
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    unlink(index_path);
+    write_history(path, entries);
+    setenv("HISTFILE", path, 1);
+
+    start = now_us();
+    init_history();
+    report("build_index", "", now_us() - start, 1, history_length());
+    close_history();
+
+    start = now_us();
+    init_history();
+    report("startup", "", now_us() - start, 1, history_length());
+
+    unsigned long sum = 0;
+    start = now_us();
+    for (int i = 0; i < calls; i++) {
+        sum += strlen(get_history_command(1 + (i * 7919u) % entries));
+        arena_reset(&cmd_arena);
+    }
+    report("bang_n", "random", now_us() - start, calls, sum / calls);
+
+    const char* prefixes[] = {"g", "git ch", "gcc -O2 -Wall -o prog_4", "ssh host9999", "nosuch"};
+    for (int p = 0; p < 5; p++) {
+        unsigned n = 0;
+        start = now_us();
+        for (int i = 0; i < calls; i++) n = find_history_prefix(prefixes[p]);
+        report("bang_prefix", prefixes[p], now_us() - start, calls, n);
+    }
+
+    // search_history() prints its matches; time it with stdout discarded
+    const char* patterns[] = {"sort", "issue 4242", "feature_99999", "no such text"};
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    for (int p = 0; p < 4; p++) {
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+        start = now_us();
+        for (int i = 0; i < calls / 10; i++) {
+            search_history(patterns[p], HISTORY_SIZE);
+            arena_reset(&cmd_arena);
+        }
+        double elapsed = now_us() - start;
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        report("search", patterns[p], elapsed, calls / 10, -1);
+    }
+    close_history();
+    unlink(path);
+    unlink(index_path);
+    return 0;
+}
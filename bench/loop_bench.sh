@@ -0,0 +1,48 @@
+#!/bin/sh
+# Loop interpretation: runs the same 3-builtin body 10^digits times, once
+# as a flat script with a line per command, as automation generates
+# today, and once as nested for loops that version7 parses only once.
+# Reports iterations per second for each form.
+#
+# usage: bench/loop_bench.sh [digits] [shell...]   (default: 5 sh ./version7)
+
+digits=${1:-5}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- sh ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+awk -v d="$digits" 'BEGIN {
+    n = 10 ^ d
+    for (i = 0; i < n; i++) {
+        v = sprintf("%0" d "d", i)
+        printf "x=%s\n[ \"$x\" != \"\" ]\n: $x\n", v
+    }
+    print "exit"
+}' > "$dir/flat"
+awk -v d="$digits" 'BEGIN {
+    for (i = 0; i < d; i++) printf "for d%d in 0 1 2 3 4 5 6 7 8 9; do\n", i
+    printf "x="
+    for (i = 0; i < d; i++) printf "$d%d", i
+    printf "\n[ \"$x\" != \"\" ]\n: $x\n"
+    for (i = 0; i < d; i++) print "done"
+    print "exit"
+}' > "$dir/loop"
+echo exit > "$dir/empty"
+
+# Prints the nanoseconds one run of shell on script took
+run() {
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" "$1" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+count=$(awk -v d="$digits" 'BEGIN { print 10 ^ d }')
+for shell in "$@"; do
+    base=$(run "$shell" "$dir/empty")
+    for form in flat loop; do
+        ns=$(($(run "$shell" "$dir/$form") - base))
+        echo "{\"bench\":\"loop\",\"shell\":\"$shell\",\"form\":\"$form\",\"iterations\":$count,\"ms\":$((ns / 1000000)),\"iterations_per_sec\":$((count * 1000000000 / ns))}"
+    done
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Slot refill: runs `parallel -j 2 sleep` over one long item and several
+# short ones. The short ones should all run in the second slot while the
+# long one holds the first, so the whole run takes as long as the longer
+# of the two slots. A slot that is only refilled once a busy worker
+# writes or exits makes the run take about the sum instead. Also checks
+# that a shell function works as the template.
+#
+# usage: bench/parallel_bench.sh [long seconds] [shell]   (default: 2 ./version7)
+
+long=${1:-2}
+shell=${2:-./version7}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+short=$(awk -v l="$long" 'BEGIN { printf "%g", l / 4 }')
+printf 'parallel -j 2 sleep ::: %s %s %s %s\nexit\n' "$long" "$short" "$short" "$short" > "$dir/script"
+printf 'f() { echo item-$1; }\nparallel -k f ::: a b\nexit\n' > "$dir/function"
+
+start=$(date +%s%N)
+HISTFILE="$dir/history" "$shell" < "$dir/script" > /dev/null 2>&1
+end=$(date +%s%N)
+ms=$(((end - start) / 1000000))
+
+HISTFILE="$dir/history" "$shell" < "$dir/function" > "$dir/out" 2>&1
+if [ "$(grep -c 'item-[ab]$' "$dir/out")" = 2 ]; then functions=true; else functions=false; fi
+
+# The long item alone bounds the run; the short ones add up to 3/4 of it
+echo "{\"bench\":\"parallel_refill\",\"shell\":\"$shell\",\"jobs\":2,\"ms\":$ms,\"expected_ms\":$((long * 1000)),\"functions\":$functions}"
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Pipeline throughput: pushes a file of the given size through
+# `cat file | cat | cat > /dev/null` in each shell and reports MB/s.
+# Versions 1-6 cannot run a three-stage pipeline, so /bin/sh is the
+# reference by default.
+#
+# usage: bench/pipeline_bench.sh [megabytes] [shell...]   (default: sh ./version7)
+
+mb=${1:-256}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- sh ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+head -c $((mb * 1024 * 1024)) /dev/urandom > "$dir/data"
+printf 'cat %s | cat | cat > /dev/null\nexit\n' "$dir/data" > "$dir/script"
+echo exit > "$dir/empty"
+
+# Prints the nanoseconds one run of shell on script took
+run() {
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" "$1" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+for shell in "$@"; do
+    base=$(run "$shell" "$dir/empty")
+    ns=$(run "$shell" "$dir/script")
+    ns=$((ns - base))
+    echo "{\"bench\":\"pipeline\",\"shell\":\"$shell\",\"stages\":3,\"megabytes\":$mb,\"ms\":$((ns / 1000000)),\"mb_per_sec\":$(awk -v mb="$mb" -v ns="$ns" 'BEGIN { printf "%.1f", mb * 1048576000 / ns }')}"
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Stream join: compares two sorted streams of the given number of lines
+# with `comm`, once through temporary files on disk and once through
+# process substitution, and reports the time each way took in ./version7.
+#
+# usage: bench/procsub_bench.sh [lines] [shell]   (default: 1000000 ./version7)
+
+lines=${1:-1000000}
+shell=${2:-./version7}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+seq 1 2 $((lines * 2)) | shuf > "$dir/a"
+seq 1 3 $((lines * 3)) | shuf > "$dir/b"
+printf 'sort %s > %s\nsort %s > %s\ncomm -12 %s %s | wc -l\nexit\n' \
+    "$dir/a" "$dir/a.sorted" "$dir/b" "$dir/b.sorted" "$dir/a.sorted" "$dir/b.sorted" > "$dir/files"
+printf 'comm -12 <(sort %s) <(sort %s) | wc -l\nexit\n' "$dir/a" "$dir/b" > "$dir/procsub"
+
+# Prints the nanoseconds one run of the shell on script took
+run() {
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" LC_ALL=C "$shell" < "$1" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+for mode in files procsub; do
+    ns=$(run "$dir/$mode")
+    echo "{\"bench\":\"procsub\",\"shell\":\"$shell\",\"mode\":\"$mode\",\"lines\":$lines,\"ms\":$((ns / 1000000))}"
+done
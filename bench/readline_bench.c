@@ -0,0 +1,102 @@
+// Command-stream reader throughput: the getc()-per-byte read_cmd() of
+// versions 1-6 against version 7's LineReader. A child process writes the
+// stream into a pipe, the way a script is piped into the shell.
+//
+// usage: readline_bench [megabytes]
+
+#define SHELL_NO_MAIN
+#include "../version7.c"
+#include <time.h>
+
+#define MAX_LEN 512  // Line buffer of the versions 1-6 reader
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starts a writer that sends total bytes of command lines; returns the read end
+static int start_stream(size_t total, pid_t* writer) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe failed");
+        exit(1);
+    }
+    if ((*writer = fork()) == 0) {
+        static char block[1 << 20];
+        size_t used = 0;
+        for (int i = 0; used + 128 < sizeof(block); i++)
+            used += sprintf(block + used, "grep -n pattern_%d file_%d.txt | sort | uniq -c > out_%d\n",
+                            i, i % 100, i);
+        close(fds[0]);
+        for (size_t sent = 0; sent < total; sent += used) {
+            for (size_t off = 0; off < used; ) {
+                ssize_t w = write(fds[1], block + off, used - off);
+                if (w <= 0) _exit(1);
+                off += w;
+            }
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+// The reader of versions 1-6: getc() into a fresh malloc'd buffer per line
+static char* legacy_read_cmd(FILE* fp) {
+    int c;
+    int pos = 0;
+    char* cmdline = (char*)malloc(sizeof(char) * MAX_LEN);
+
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\n') break;
+        cmdline[pos++] = c;
+    }
+    if (c == EOF && pos == 0) {
+        free(cmdline);
+        return NULL;
+    }
+    cmdline[pos] = '\0';
+    return cmdline;
+}
+
+int main(int argc, char* argv[]) {
+    size_t total = (size_t)(argc > 1 ? atoi(argv[1]) : 1024) << 20;
+    pid_t writer;
+    size_t bytes, lines;
+    double start, secs;
+
+    int fd = start_stream(total, &writer);
+    FILE* fp = fdopen(fd, "r");
+    bytes = lines = 0;
+    start = now_sec();
+    char* line;
+    while ((line = legacy_read_cmd(fp)) != NULL) {
+        bytes += strlen(line) + 1;
+        lines++;
+        free(line);
+    }
+    secs = now_sec() - start;
+    fclose(fp);
+    waitpid(writer, NULL, 0);
+    printf("{\"bench\":\"read_cmd\",\"reader\":\"getc\",\"bytes\":%zu,\"lines\":%zu,\"mb_per_sec\":%.1f}\n",
+           bytes, lines, bytes / secs / 1e6);
+
+    fd = start_stream(total, &writer);
+    LineReader reader;
+    size_t len;
+    lr_init(&reader, fd);
+    bytes = lines = 0;
+    start = now_sec();
+    while ((line = lr_next_line(&reader, &len)) != NULL) {
+        bytes += len + 1;
+        lines++;
+    }
+    secs = now_sec() - start;
+    close(fd);
+    waitpid(writer, NULL, 0);
+    printf("{\"bench\":\"read_cmd\",\"reader\":\"line_reader\",\"bytes\":%zu,\"lines\":%zu,\"mb_per_sec\":%.1f}\n",
+           bytes, lines, bytes / secs / 1e6);
+    return 0;
+}
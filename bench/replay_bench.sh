@@ -0,0 +1,40 @@
+#!/bin/sh
+# Script replay: generates a script of N commands shaped like a build or
+# test script (mostly echo, printf, test and true, with a /bin/true every
+# 100 lines and a two-stage pipeline every 1000) and reports how long each
+# shell takes to run it. Versions 1-6 fork for every line, so expect them
+# to take minutes at the default size.
+#
+# usage: bench/replay_bench.sh [commands] [shell...]   (default: 100000 sh ./version7)
+
+lines=${1:-100000}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- sh ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+awk -v n="$lines" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 1000 == 999) print "echo step " i " | cat"
+        else if (i % 100 == 99) print "/bin/true " i
+        else if (i % 4 == 0) print "echo compiling unit_" i ".c"
+        else if (i % 4 == 1) print "printf %s:%d\\n unit " i
+        else if (i % 4 == 2) print "test " i " -gt 5"
+        else print "true"
+    }
+    print "exit"
+}' > "$dir/script"
+echo exit > "$dir/empty"
+
+run() {
+    start=$(date +%s%N)
+    HISTFILE="$dir/history" "$1" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+for shell in "$@"; do
+    base=$(run "$shell" "$dir/empty")
+    ns=$(($(run "$shell" "$dir/script") - base))
+    echo "{\"bench\":\"replay\",\"shell\":\"$shell\",\"commands\":$lines,\"ms\":$((ns / 1000000)),\"commands_per_sec\":$(awk -v n="$lines" -v ns="$ns" 'BEGIN { printf "%.0f", n * 1e9 / ns }')}"
+done
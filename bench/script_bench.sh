@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compiled scripts: runs a cron-style script of the given number of
+# functions, most of which a run never calls, the given number of times.
+# version7 runs it once with PUCIT_SCRIPT_CACHE=0, lexing and parsing it
+# on every run, and once from the compiled form it keeps in script.v7c.
+# Other shells run it the same way both times. Reports runs per second.
+#
+# usage: bench/script_bench.sh [functions] [runs] [shell...]
+#        (default: 200 200 sh ./version7)
+
+functions=${1:-200}
+runs=${2:-200}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- sh ./version7
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+awk -v n="$functions" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "task%d() {\n", i
+        printf "    case \"$1\" in\n"
+        printf "        start|restart) echo \"starting %d\" > \"$2\" ;;\n", i
+        printf "        stop) [ -f \"$2\" ] && echo \"stopping %d\" ;;\n", i
+        printf "        *) echo \"task%d: unknown action $1\" >&2; return 1 ;;\n", i
+        printf "    esac\n"
+        printf "    if [ \"$3\" != \"\" ]; then\n        for f in $3 a b c; do\n            : \"$f\"\n        done\n    fi\n"
+        printf "}\n\n"
+    }
+    print "task0 start /dev/null"
+    print "task1 stop /dev/null x"
+    print "exit 0"
+}' > "$dir/script.sh"
+
+# Prints the nanoseconds runs runs of shell on the script took
+run() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$1" "$dir/script.sh" > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+lines=$(wc -l < "$dir/script.sh")
+for shell in "$@"; do
+    for form in uncached cached; do
+        if [ $form = uncached ]; then
+            ns=$(PUCIT_SCRIPT_CACHE=0 run "$shell")
+        else
+            "$shell" "$dir/script.sh" > /dev/null 2>&1
+            ns=$(run "$shell")
+        fi
+        echo "{\"bench\":\"script\",\"shell\":\"$shell\",\"form\":\"$form\",\"lines\":$lines,\"runs\":$runs,\"us_per_run\":$((ns / runs / 1000)),\"runs_per_sec\":$((runs * 1000000000 / ns))}"
+    done
+    rm -f "$dir/script.sh.v7c"
+done
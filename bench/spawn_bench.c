@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+// Stage-launch latency: fork()+execvp() (versions 1-6) against posix_spawn()
+// (version 7) while the parent carries a growing heap, the way a long-running
+// shell does.
+//
+// usage: spawn_bench [iterations] [heap_mb...]
+
+extern char **environ;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static pid_t launch_fork(char** argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_spawn(char** argv) {
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0) return -1;
+    return pid;
+}
+
+static double run(pid_t (*launch)(char**), int iterations) {
+    char* argv[] = {"true", NULL};
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        pid_t pid = launch(argv);
+        if (pid < 0) {
+            perror("launch failed");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    int default_sizes[] = {0, 256, 1024};
+    int nsizes = argc > 2 ? argc - 2 : 3;
+
+    for (int i = 0; i < nsizes; i++) {
+        int heap_mb = argc > 2 ? atoi(argv[i + 2]) : default_sizes[i];
+        size_t bytes = (size_t)heap_mb << 20;
+        char* heap = NULL;
+        if (bytes > 0) {
+            // Touch every page so the parent really owns the page tables
+            heap = malloc(bytes);
+            if (heap == NULL) {
+                perror("heap allocation failed");
+                return 1;
+            }
+            memset(heap, 1, bytes);
+        }
+
+        double fork_ns = run(launch_fork, iterations);
+        double spawn_ns = run(launch_spawn, iterations);
+        printf("{\"bench\":\"spawn\",\"heap_mb\":%d,\"mode\":\"fork_execvp\",\"ns_per_launch\":%.0f}\n",
+               heap_mb, fork_ns);
+        printf("{\"bench\":\"spawn\",\"heap_mb\":%d,\"mode\":\"posix_spawn\",\"ns_per_launch\":%.0f}\n",
+               heap_mb, spawn_ns);
+        free(heap);
+    }
+    return 0;
+}
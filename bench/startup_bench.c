@@ -0,0 +1,69 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+// Startup time to first exec: runs `shell -c true` repeatedly and reports
+// the round trip, plus the shell's own share after subtracting a direct
+// launch of the same command.
+//
+// usage: startup_bench [shell] [iterations]
+
+extern char **environ;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Times each launch of argv and stores it in samples
+static void measure(char** argv, double* samples, int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        pid_t pid;
+        double start = now_us();
+        if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+            perror(argv[0]);
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, iterations, sizeof(double), cmp_double);
+}
+
+static void report(const char* mode, double* samples, int iterations, double baseline) {
+    double sum = 0;
+    for (int i = 0; i < iterations; i++) sum += samples[i];
+    printf("{\"bench\":\"startup\",\"mode\":\"%s\",\"mean_us\":%.1f,\"p50_us\":%.1f,"
+           "\"p99_us\":%.1f,\"overhead_us\":%.1f}\n",
+           mode, sum / iterations, samples[iterations / 2], samples[iterations * 99 / 100],
+           sum / iterations - baseline);
+}
+
+int main(int argc, char* argv[]) {
+    char* shell = argc > 1 ? argv[1] : "./version7";
+    int iterations = argc > 2 ? atoi(argv[2]) : 500;
+    double* samples = malloc(sizeof(double) * iterations);
+    double direct_mean = 0;
+
+    char* direct[] = {"/bin/true", NULL};
+    measure(direct, samples, iterations);
+    for (int i = 0; i < iterations; i++) direct_mean += samples[i];
+    direct_mean /= iterations;
+    report("direct", samples, iterations, direct_mean);
+
+    char* via_shell[] = {shell, "-c", "/bin/true", NULL};
+    measure(via_shell, samples, iterations);
+    report("shell_c", samples, iterations, direct_mean);
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Lexer and parser throughput in MB/s. Builds version 7's lex(), parse()
+// and parse_command() straight from the shell source and feeds them
+// generated command lines: lexing alone, lexing plus parsing into a fresh
+// tree, and parse_command() over a working set that fits in its cache.
+//
+// usage: tokenize_bench [megabytes] [args_per_line]
+
+#define SHELL_NO_MAIN
+#include "../version7.c"
+#include <time.h>
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills line with a command of nargs words, mixing bare, quoted, escaped
+// and operator tokens the way generated scripts do
+static size_t make_line(char* line, int nargs, unsigned seed) {
+    size_t len = 0;
+    len += sprintf(line + len, "cmd%u", seed % 97);
+    for (int i = 0; i < nargs; i++) {
+        switch ((seed + i) % 6) {
+            case 0: len += sprintf(line + len, " file_%u.txt", seed + i); break;
+            case 1: len += sprintf(line + len, " \"quoted arg %d\"", i); break;
+            case 2: len += sprintf(line + len, " 'single %d'", i); break;
+            case 3: len += sprintf(line + len, " esc\\ aped%d", i); break;
+            case 4: len += sprintf(line + len, " -o%d", i); break;
+            case 5: len += sprintf(line + len, i % 12 == 5 ? " |" : " plain%d", i); break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char* argv[]) {
+    size_t target = (size_t)(argc > 1 ? atoi(argv[1]) : 256) << 20;
+    int nargs = argc > 2 ? atoi(argv[2]) : 64;
+
+    // A pool of distinct lines, processed round-robin from a scratch copy
+    int nlines = 256;
+    char** lines = malloc(sizeof(char*) * nlines);
+    size_t* lens = malloc(sizeof(size_t) * nlines);
+    size_t maxlen = 0;
+    for (int i = 0; i < nlines; i++) {
+        lines[i] = malloc(nargs * 32 + 64);
+        lens[i] = make_line(lines[i], nargs, i * 7919);
+        if (lens[i] > maxlen) maxlen = lens[i];
+    }
+    char* scratch = malloc(maxlen + 1);
+
+    size_t bytes = 0, tokens = 0;
+    double start = now_sec();
+    for (int i = 0; bytes < target; i = (i + 1) % nlines) {
+        int n;
+        memcpy(scratch, lines[i], lens[i] + 1);
+        lex(scratch, &n);
+        tokens += n;
+        bytes += lens[i];
+        arena_reset(&cmd_arena);
+    }
+    double secs = now_sec() - start;
+    printf("{\"bench\":\"lex\",\"args_per_line\":%d,\"bytes\":%zu,\"tokens\":%zu,"
+           "\"mb_per_sec\":%.1f}\n", nargs, bytes, tokens, bytes / secs / 1e6);
+
+    // Lex and parse, with the tree built in an arena of its own
+    Arena tree = {0};
+    size_t nodes = 0;
+    bytes = 0;
+    start = now_sec();
+    for (int i = 0; bytes < target; i = (i + 1) % nlines) {
+        int n, error;
+        memcpy(scratch, lines[i], lens[i] + 1);
+        Node* ast = parse(lex(scratch, &n), &tree, &error);
+        nodes += ast != NULL;
+        bytes += lens[i];
+        arena_reset(&cmd_arena);
+        arena_reset(&tree);
+    }
+    secs = now_sec() - start;
+    printf("{\"bench\":\"parse\",\"args_per_line\":%d,\"bytes\":%zu,\"trees\":%zu,"
+           "\"mb_per_sec\":%.1f}\n", nargs, bytes, nodes, bytes / secs / 1e6);
+
+    // The same lines through the parse cache: after the first pass over the
+    // pool every lookup is a hit, so this is hashing plus one memcmp
+    bytes = 0;
+    start = now_sec();
+    for (int i = 0; bytes < target; i = (i + 1) % nlines) {
+        int error;
+        memcpy(scratch, lines[i], lens[i] + 1);
+        parse_command(scratch, &error);
+        bytes += lens[i];
+        arena_reset(&cmd_arena);
+    }
+    secs = now_sec() - start;
+    printf("{\"bench\":\"parse_cached\",\"args_per_line\":%d,\"bytes\":%zu,\"hits\":%lu,"
+           "\"misses\":%lu,\"mb_per_sec\":%.1f}\n", nargs, bytes, parse_hits, parse_misses, bytes / secs / 1e6);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Data stages under job control: runs version7 on a pseudo-terminal, via
+# script(1), so it is interactive and does job control, and checks that
+# a trailing cat or tee is still carried out by the shell rather than
+# exec'd. With PATH pointing nowhere only the shell's own copy can print
+# anything. Then pushes a file of the given size through
+# `cat file | STAGE > /dev/null` and reports MB/s, with `cat -u`, which
+# the shell leaves to /bin/cat, as the reference.
+#
+# usage: bench/tty_data_bench.sh [megabytes] [shell]   (default: 256 ./version7)
+
+mb=${1:-256}
+shell=${2:-./version7}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+head -c $((mb * 1024 * 1024)) /dev/urandom > "$dir/data"
+
+# Runs a script on a terminal, leaving what it printed in $dir/out
+run() {
+    HISTFILE="$dir/history" script -qec "$shell" /dev/null < "$1" > "$dir/out" 2>&1
+}
+
+# Did the stage run inside the shell, with no cat or tee to exec?
+probe() {
+    printf 'PATH=/nonexistent\necho probe-%s | %s\nexit\n' "$1" "$1" > "$dir/probe"
+    run "$dir/probe"
+    if grep -q "probe-$1$(printf '\r')\$" "$dir/out"; then echo true; else echo false; fi
+}
+
+for stage in cat tee "cat -u"; do
+    fast=false
+    [ "$stage" = "cat -u" ] || fast=$(probe "$stage")
+    # script(1) itself takes a while to wind down, so the pipeline is
+    # timed by the shell's "time" rather than from outside
+    printf 'time cat %s | %s > /dev/null\nexit\n' "$dir/data" "$stage" > "$dir/script"
+    run "$dir/script"
+    ms=$(awk '/^real/ { split($2, t, /[ms]/); printf "%d", (t[1] * 60 + t[2]) * 1000; exit }' "$dir/out")
+    # No "real" line means the run failed; report 0 rather than bad JSON.
+    # The ternary below must stay in parentheses, or awk takes "> 0" as
+    # output to a file named 0.
+    ms=${ms:-0}
+    echo "{\"bench\":\"tty_data_stage\",\"shell\":\"$shell\",\"stage\":\"$stage\",\"fast_path\":$fast,\"megabytes\":$mb,\"ms\":$ms,\"mb_per_sec\":$(awk -v mb="$mb" -v ms="$ms" 'BEGIN { printf "%.1f", (ms > 0 ? mb * 1000 / ms : 0) }')}"
+done
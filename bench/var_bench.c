@@ -0,0 +1,102 @@
+// Variable expansion cost as the number of variables grows: version 7's
+// hash table against the linear array scan of version 6.
+//
+// usage: var_bench [lookups]
+
+#define SHELL_NO_MAIN
+#include "../version7.c"
+#include <time.h>
+
+#define LEGACY_VAR_LEN 50
+
+// Version 6's store, without its 100-entry cap so the scan can be timed
+typedef struct {
+    char name[LEGACY_VAR_LEN];
+    char value[LEGACY_VAR_LEN];
+} LegacyVariable;
+
+static LegacyVariable* legacy_vars;
+static int legacy_count = 0;
+
+static char* legacy_get_variable(char* name) {
+    for (int i = 0; i < legacy_count; i++) {
+        if (strcmp(legacy_vars[i].name, name) == 0) return legacy_vars[i].value;
+    }
+    return NULL;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    int lookups = argc > 1 ? atoi(argv[1]) : 200000;
+    int sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    int defined = 0;
+    char name[32], value[32], word[40];
+
+    legacy_vars = malloc(sizeof(LegacyVariable) * 10000);
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int n = sizes[s];
+        for (; defined < n; defined++) {
+            sprintf(name, "VAR_%d", defined);
+            sprintf(value, "value_%d", defined);
+            set_variable(name, value);
+            if (defined < 10000) {
+                strcpy(legacy_vars[defined].name, name);
+                strcpy(legacy_vars[defined].value, value);
+                legacy_count = defined + 1;
+            }
+        }
+
+        // Expand "$VAR_k" words as the executor does, spread over all names
+        unsigned seed = 12345;
+        size_t sink = 0;
+        double start = now_ns();
+        for (int i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            int len = sprintf(word, "%cVAR_%u", VAR_MARK, (seed >> 8) % n);
+            int drop;
+            sink += strlen(expand_word(word, &drop)) + len;
+            if ((i & 1023) == 1023) arena_reset(&cmd_arena);
+        }
+        double hash_ns = (now_ns() - start) / lookups;
+        printf("{\"bench\":\"variables\",\"store\":\"hash\",\"variables\":%d,\"ns_per_expansion\":%.1f}\n",
+               n, hash_ns);
+
+        if (n <= 10000) {
+            int legacy_lookups = lookups / 10;
+            start = now_ns();
+            for (int i = 0; i < legacy_lookups; i++) {
+                seed = seed * 1103515245 + 12345;
+                sprintf(name, "VAR_%u", (seed >> 8) % n);
+                char* v = legacy_get_variable(name);
+                sink += v ? strlen(v) : 0;
+            }
+            printf("{\"bench\":\"variables\",\"store\":\"linear\",\"variables\":%d,\"ns_per_expansion\":%.1f}\n",
+                   n, (now_ns() - start) / legacy_lookups);
+        }
+        if (sink == 1) printf("\n");
+    }
+
+    // Set and unset the same names over and over; an unset name keeps its
+    // slot, so the name pool should not grow after the first pass
+    for (int i = 0; i < 64; i++) {
+        sprintf(name, "CHURN_%d", i);
+        set_variable(name, "x");
+        unset_variable(name);
+    }
+    size_t pool_before = var_names.in_use;
+    double start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        sprintf(name, "CHURN_%d", i & 63);
+        set_variable(name, "x");
+        unset_variable(name);
+    }
+    printf("{\"bench\":\"variables\",\"store\":\"hash\",\"churn\":%d,\"ns_per_set_unset\":%.1f,"
+           "\"name_pool_growth\":%zu}\n",
+           lookups, (now_ns() - start) / lookups, var_names.in_use - pool_before);
+    return 0;
+}
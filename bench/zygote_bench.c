@@ -0,0 +1,84 @@
+// Command-launch round trip (launch + wait for /bin/true) through version
+// 7's spawn_stage(), spawning directly and through the zygote, while the
+// shell holds a growing heap. fork()+execv() of the whole shell, as
+// versions 1-6 launch, is the reference.
+//
+// usage: zygote_bench [iterations] [heap_mb...]
+
+#define SHELL_NO_MAIN
+#include "../version7.c"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static pid_t launch_fork(Stage* stage) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(stage->argv[0], stage->argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_stage(Stage* stage) {
+    return spawn_stage(stage, -1, -1, PGID_SHELL);
+}
+
+static double run(pid_t (*launch)(Stage*), int iterations) {
+    static char* argv[] = {"/bin/true", NULL};
+    static char* no_assigns[] = {NULL};
+    Stage stage = {argv, no_assigns, NULL};
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        pid_t pid = launch(&stage);
+        if (pid < 0) {
+            perror("launch failed");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+        arena_reset(&cmd_arena);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    // The zygote is this program run again with --zygote
+    if (argc == 3 && strcmp(argv[1], "--zygote") == 0) return zygote_main(atoi(argv[2]));
+
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    int default_sizes[] = {0, 256, 1024};
+    int nsizes = argc > 2 ? argc - 2 : 3;
+
+    for (int i = 0; i < nsizes; i++) {
+        int heap_mb = argc > 2 ? atoi(argv[i + 2]) : default_sizes[i];
+        size_t bytes = (size_t)heap_mb << 20;
+        char* heap = NULL;
+        if (bytes > 0) {
+            // Touch every page so the shell really owns the page tables
+            heap = malloc(bytes);
+            if (heap == NULL) {
+                perror("heap allocation failed");
+                return 1;
+            }
+            memset(heap, 1, bytes);
+        }
+
+        double fork_ns = run(launch_fork, iterations);
+        double spawn_ns = run(launch_stage, iterations);
+        if (start_zygote() == -1) return 1;
+        double zygote_ns = run(launch_stage, iterations);
+        stop_zygote();
+
+        printf("{\"bench\":\"launch\",\"heap_mb\":%d,\"mode\":\"fork_execv\",\"ns_per_launch\":%.0f}\n",
+               heap_mb, fork_ns);
+        printf("{\"bench\":\"launch\",\"heap_mb\":%d,\"mode\":\"posix_spawn\",\"ns_per_launch\":%.0f}\n",
+               heap_mb, spawn_ns);
+        printf("{\"bench\":\"launch\",\"heap_mb\":%d,\"mode\":\"zygote\",\"ns_per_launch\":%.0f}\n",
+               heap_mb, zygote_ns);
+        free(heap);
+    }
+    return 0;
+}
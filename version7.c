@@ -0,0 +1,7208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <fnmatch.h>
+#include <termios.h>
+
+#define ARGV_INITIAL 16  // Starting capacity of the growable argv
+#define PROMPT "PUCITVer7shell:- "
+#define HISTORY_SIZE 10  // Entries `history` lists by default
+#define HIST_MAGIC 0x37484350  // Identifies a version 7 history index
+#define HIST_NEWLINE '\036'     // Stands for a newline inside a history entry
+#define HIST_BUCKETS 65536     // Prefix buckets, one per first-two-bytes pair
+#define HIST_BLOCK 16          // Entries behind one trigram filter bit
+#define HIST_SEGMENT 1024      // Blocks per index segment
+#define HIST_SEG_ENTRIES (HIST_SEGMENT * HIST_BLOCK)
+#define HIST_FILTER_ROWS 2048  // Trigram hash values
+#define JOB_TABLE_INITIAL 16  // Job slots before the table first grows
+#define PARALLEL_DEFAULT_JOBS 4
+#define VAR_TABLE_INITIAL 64  // Slots in the variable table before it grows
+#define VAR_MARK '\001'        // Tokenizer's mark for an unquoted $
+#define VAR_MARK_QUOTED '\002' // ...and for a $ inside double quotes
+#define PROCSUB_IN '\003'      // Starts a <(list) word, followed by the list
+#define PROCSUB_OUT '\004'     // ...and a >(list) word
+#define GLOB_CHARS "*?[]\\"     // Bytes fnmatch() treats specially
+#define EXPAND_FDS_MAX 32      // Descriptors one pipeline's expansion may hold open
+#define HEREDOC_PIPE_MAX 4096  // Here-documents up to this size go in a pipe, larger ones in a memfd
+#define COPROC_MAX 8
+#define FUNC_BUCKETS 64        // Hash buckets of the function table
+#define FUNC_DEPTH_MAX 1000    // Nested function calls before one is refused
+#define COPY_CHUNK (1 << 20)  // Bytes moved per splice/copy_file_range call
+#define USER_COPY_BUF (128 * 1024)
+#define READ_CHUNK (64 * 1024)  // Initial line reader buffer and read(2) size
+#define ARENA_BLOCK (64 * 1024)  // Initial size of the per-command arena
+#define ARENA_ALIGN 16
+#define PATH_TABLE_INITIAL 64  // Slots in the command location cache
+#define BUILTIN_TABLE_BITS 7   // The builtin dispatch table has 1 << this many slots
+#define PARSE_CACHE_SIZE 256     // Parsed command lines kept for reuse
+#define PARSE_CACHE_BUCKETS 512
+#define PARSE_ARENA_BLOCK 1024   // First block of a cache entry's arena
+#define ACCT_RING 1024           // Stage records kept by resource accounting
+#define ACCT_CMD_LEN 80          // Command text kept per record
+#define STAT_SUB_BITS 3          // Linear sub-buckets per power of two in a latency histogram
+#define STAT_BUCKETS (64 << STAT_SUB_BITS)
+#define TRACE_MAX_EVENTS (1 << 20)  // Trace events buffered before new ones are dropped
+#define ZYGOTE_MSG_MAX (64 * 1024)  // Largest launch request; bigger ones are spawned directly
+#define ZYGOTE_MAX_FDS 32
+#define ZYGOTE_MAX_ACTIONS 64
+#define ZYGOTE_SOCK_FD 3            // The zygote's end of its socket
+#define ZYGOTE_FD_BASE 100          // The zygote keeps received fds at or above this
+#define EV_FOREGROUND (1ULL << 63)  // Event loop tags; anything else is a background pid
+#define EV_SIGCHLD (1ULL << 62)
+#define EV_INPUT (1ULL << 61)
+#define EV_CHILDREN (1ULL << 60)
+
+extern char **environ;
+
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_STOPPED 3      // Every process still alive is stopped
+
+// Process group a launched stage goes into, besides a pgid to join
+#define PGID_SHELL -1      // The shell's own
+#define PGID_NEW 0         // A new one it leads, in the background
+#define PGID_NEW_FG -2     // A new one it leads, which takes the terminal
+
+// cpu.max period for "run --cpu", in microseconds: the kernel's default
+#define CGROUP_CPU_PERIOD 100000
+
+// Where background jobs and parallel workers are placed ("affinity")
+#define AFFINITY_OFF 0     // On the shell's CPUs
+#define AFFINITY_RR 1      // Each process on the next CPU in turn
+#define AFFINITY_NUMA 2    // Each job on the next NUMA node's CPUs
+#define AFFINITY_MAX_NODES 64
+
+#define TOK_WORD 1
+#define TOK_IO_NUMBER 2    // The digits of "2>"
+#define TOK_PIPE 3
+#define TOK_AND 4
+#define TOK_OR 5
+#define TOK_SEMI 6
+#define TOK_AMP 7
+#define TOK_LESS 8         // Redirection operators run TOK_LESS..TOK_TLESS
+#define TOK_GREAT 9
+#define TOK_DGREAT 10
+#define TOK_LESSAND 11
+#define TOK_GREATAND 12
+#define TOK_DLESS 13       // <<
+#define TOK_DLESSDASH 14   // <<-
+#define TOK_TLESS 15       // <<<, the last redirection operator
+#define TOK_NEWLINE 16
+#define TOK_LPAREN 17
+#define TOK_RPAREN 18
+#define TOK_DSEMI 19       // ;; ends a case item
+#define TOK_END 20
+
+#define NODE_COMMAND 1
+#define NODE_PIPELINE 2
+#define NODE_AND 3
+#define NODE_OR 4
+#define NODE_LIST 5
+#define NODE_BACKGROUND 6
+#define NODE_IF 7          // if left; then right; else next (an elif is a nested if)
+#define NODE_WHILE 8       // while left; do right
+#define NODE_UNTIL 9
+#define NODE_FOR 10        // for name in argv (NULL for "$@"); do right
+#define NODE_CASE 11       // case argv[0] in next, a chain of items
+#define NODE_CASE_ITEM 12  // argv are the patterns, left the list (or NULL)
+#define NODE_GROUP 13      // { left; }
+#define NODE_SUBSHELL 14   // ( left )
+#define NODE_FUNCTION 15   // name() left
+
+#define REDIR_IN 1
+#define REDIR_OUT 2
+#define REDIR_APPEND 3
+#define REDIR_DUP 4        // n>&m or n<&m
+#define REDIR_HEREDOC 5    // n<<word; target is the body, with $ marks unless word was quoted
+#define REDIR_HERESTRING 6 // n<<<word
+
+#define ACCT_TABLE 0
+#define ACCT_CSV 1
+#define ACCT_JSON 2
+
+// Shell phases timed for shellstat
+#define PHASE_READ 0       // Waiting for and reading a command line
+#define PHASE_HISTORY 1    // ! expansion and appending to the history
+#define PHASE_PARSE 2      // Lexing and parsing, or a parse cache hit
+#define PHASE_EXPAND 3     // $ expansion and building the stages
+#define PHASE_BUILTIN 4    // A builtin run inside the shell
+#define PHASE_DATA 5       // An in-process cat/tee stage
+#define PHASE_SPAWN 6      // posix_spawn() or fork() of one stage
+#define PHASE_WAIT 7       // Waiting for a foreground pipeline's children
+#define PHASE_COUNT 8
+
+// Descriptor actions a zygote request carries, applied in order
+#define ZACT_PASSED 1      // dup2 the passed descriptor arg onto fd
+#define ZACT_DUP 2         // dup2 the child's descriptor arg onto fd
+#define ZACT_CLOSE 3
+#define ZACT_CHDIR 4       // fchdir to the passed descriptor arg
+
+// Compiled scripts: "v7c" files, and the format version of their image.
+// The struct sizes go into the layout too, so no other build's file is
+// ever taken for this one's.
+#define SCRIPT_MAGIC 0x63377650u
+#define SCRIPT_LAYOUT ((uint32_t)(sizeof(Node) << 16 | sizeof(Redirect) << 8 | 1))
+
+// A background or stopped pipeline. Slot id-1 of the job table holds job
+// id; a free slot has id 0.
+typedef struct {
+    int id;
+    int state;
+    int reported;       // The state last announced, so each change is told once
+    pid_t pgid;         // Its process group under job control, else 0
+    pid_t *pids;        // One per stage
+    int nprocs;
+    int live;           // Stages not yet reaped
+    int nstopped;       // ...of which stopped
+    int has_tmodes;
+    struct termios tmodes;  // Terminal modes it stopped with, restored by fg
+    int status;         // Exit status of the last stage once it is reaped
+    char *command;
+    unsigned long seq;  // Accounting sequence number, 0 if not accounted
+    double start;       // Launch time since the epoch, for accounting
+    double launched;    // ...and on the monotonic clock
+    char *cgroup;       // Its cgroup directory under "run", else NULL
+} Job;
+
+// A shell variable. The name is interned in the var_names pool; the
+// value buffer is reused when the variable is reassigned. An unset
+// variable keeps its slot and name, so setting it again interns nothing.
+typedef struct {
+    char *name;             // NULL for an empty slot
+    unsigned long hash;
+    char *value;            // NULL once the variable is unset
+    size_t cap;
+} Variable;
+
+// A running worker of the parallel builtin
+typedef struct {
+    pid_t pid;          // 0 when the slot is idle
+    int item;           // Index of the input item it is running
+    int out_fd;         // Read end of its output pipe, -1 after EOF
+    int reaped;
+    int status;
+    char *out;          // Output collected so far
+    size_t out_len, out_cap;
+} ParallelSlot;
+
+// A coprocess and the shell's ends of the pipes to it
+typedef struct {
+    char* name;
+    pid_t pid;
+    int read_fd;        // Its standard output
+    int write_fd;       // Its standard input
+} Coproc;
+
+// pid -> job id index; pid 0 is an empty slot and -1 a deleted one
+typedef struct {
+    pid_t pid;
+    int job_id;
+    int pidfd;          // Watched by the event loop, or -1
+    int stopped;
+} PidSlot;
+
+// A block of arena memory; blocks are chained when a command outgrows one
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for everything that lives only as long as one command
+typedef struct {
+    ArenaBlock *head;
+    ArenaBlock *current;
+    size_t in_use;          // Bytes handed out since the last reset
+    size_t high_water;      // Largest in_use seen over the session
+    size_t reserved;        // Bytes held in all blocks
+    unsigned long allocs;   // Allocations since the last reset
+    unsigned long resets;
+    unsigned long grows;    // Times a new block had to be malloc'd
+    size_t min_block;       // First block size, ARENA_BLOCK when 0
+} Arena;
+
+// A point in an arena to release back to
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+    size_t in_use;
+} ArenaMark;
+
+// Reads input with large read(2) calls into one reusable buffer and hands
+// out each line as a view into it. Unread bytes are slid to the front
+// when the buffer wraps, and the buffer doubles for lines longer than it.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;   // First byte not yet handed out
+    size_t end;     // One past the last byte read
+    size_t scanned; // Bytes after start already known to hold no newline
+    int eof;
+} LineReader;
+
+// A remembered command location; path is NULL once it has gone stale
+typedef struct {
+    char *name;
+    char *path;
+    unsigned long hits;
+} PathEntry;
+
+// Header of the history index file. Entries are numbered from 1, so 0
+// ends a bucket chain.
+typedef struct {
+    uint32_t magic;
+    uint32_t count;                 // Entries indexed
+    uint64_t data_size;             // Bytes of the data file the index covers
+    uint32_t first[256];            // Newest entry starting with each byte
+    uint32_t pair[HIST_BUCKETS];    // Newest entry starting with each byte pair
+} HistHeader;
+
+// Where one history line lives in the data file, and the next older entry
+// sharing its first byte and its first two bytes
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t prev_first;
+    uint32_t prev_pair;
+    uint32_t unused;
+} HistRecord;
+
+// HIST_SEG_ENTRIES index records plus a trigram filter over them, stored
+// bit-sliced: row r has one bit per block of HIST_BLOCK entries, set if an
+// entry in the block has a trigram hashing to r. A substring search ANDs
+// the rows of its pattern's trigrams and reads only the blocks left.
+typedef struct {
+    uint64_t filter[HIST_FILTER_ROWS][HIST_SEGMENT / 64];
+    HistRecord rec[HIST_SEG_ENTRIES];
+} HistSegment;
+
+// A command the shell runs itself; help is NULL for an alias
+typedef struct {
+    const char* name;
+    int (*fn)(char** argv);
+    const char* help;
+} Builtin;
+
+// A lexer token; text is set for words and numbers only
+typedef struct {
+    int type;
+    int quoted;         // A word had quotes or backslashes, so it is no keyword
+    char* text;
+    char* pattern;      // text with its quoted glob characters escaped, or NULL if it has none
+} Token;
+
+// A redirection of fd, applied in source order
+typedef struct Redirect {
+    int type;
+    int fd;
+    char* target;       // File name, the descriptor (or "-") for REDIR_DUP, or the text
+                        // of a here-document or here-string
+    struct Redirect* next;
+} Redirect;
+
+// A node of the parsed command tree. A command has argv, assigns and
+// redirs; a pipeline its stages; the and/or/list operators left and
+// right; a background job only left. Compound commands use the fields
+// as their NODE_ comments say, plus redirs when they are a pipeline
+// stage. Words keep their $ marks.
+typedef struct Node {
+    int type;
+    struct Node* left;
+    struct Node* right;
+    struct Node* next;
+    struct Node** stages;
+    int nstages;
+    int timed;          // A pipeline preceded by the "time" keyword
+    char* name;         // A for loop's variable, or a function's name
+    char** argv;
+    char** assigns;     // NAME=value words before the command name
+    Redirect* redirs;
+} Node;
+
+// Recursive descent parser state
+typedef struct {
+    Token* tok;         // Next unconsumed token
+    Arena* arena;       // Where the tree is built
+    int error;
+    int partial_ok;     // Running out of tokens means more input is needed
+    int incomplete;     // ...and it did
+} Parser;
+
+// A shell function. Its body is copied into the function's own arena, so
+// it outlives the command that defined it; one redefined while it runs
+// is kept, as stale, until its last call returns.
+typedef struct Function {
+    char* name;
+    Node* body;
+    Arena arena;
+    int busy;           // Calls in progress
+    int stale;
+    struct Function* chain;
+} Function;
+
+// A compiled script being built: its trees laid out in one buffer, with
+// offsets from the start of the buffer in place of pointers. Offset 0 is
+// never used, so it stands for NULL.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} ScriptImage;
+
+// The header of a compiled script file, which the image follows. A file
+// is used only while the source still has the mtime, size and hash here.
+typedef struct {
+    uint32_t magic;
+    uint32_t layout;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t source_hash;
+    uint64_t image_size;
+    uint64_t image_hash;
+    uint64_t roots;         // Offset of the array of top-level commands
+    uint64_t nroots;
+} ScriptHeader;
+
+// A descriptor a builtin's redirection replaced, and where it was kept
+typedef struct {
+    int fd;
+    int copy;           // -1 if fd was not open
+} SavedFd;
+
+// A cached parse. The tree and the text it came from live in the entry's
+// own arena, which is freed when the entry is evicted.
+typedef struct CacheEntry {
+    unsigned long hash;
+    char* text;
+    size_t len;
+    Node* ast;
+    Arena arena;
+    struct CacheEntry* chain;   // Next entry in the hash bucket
+    struct CacheEntry* prev;    // LRU neighbours, most recent first
+    struct CacheEntry* next;
+} CacheEntry;
+
+// Resource usage of one pipeline stage, from wait4() for a child or from
+// getrusage() differences for a stage the shell ran itself
+typedef struct {
+    unsigned long seq;  // Pipeline number; the stages of one pipeline share it
+    int stage;          // Position in the pipeline, from 0
+    int status;
+    double start;       // Launch time, seconds since the epoch
+    double real;        // Seconds from launch to exit
+    double user;
+    double sys;
+    long maxrss;        // Peak resident set size in KB
+    long nvcsw;         // Voluntary context switches
+    long nivcsw;        // Involuntary context switches
+    char command[ACCT_CMD_LEN];
+} AcctRecord;
+
+// The foreground stages a wait is collecting, each watched by a pidfd
+typedef struct {
+    pid_t* pids;
+    int* pidfds;
+    int* statuses;
+    AcctRecord* usage;  // NULL unless resource usage is recorded
+    double* launched;
+    int left;           // Stages not yet reaped
+    int stopped;        // A stage stopped, so the pipeline becomes a job
+} ForegroundWait;
+
+// Latency histogram of one shell phase, in nanoseconds
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STAT_BUCKETS];
+} PhaseStats;
+
+// A timed phase, kept for the Chrome trace
+typedef struct {
+    int phase;
+    uint64_t start;     // CLOCK_MONOTONIC, ns
+    uint64_t dur;
+    char detail[32];    // Usually the command name
+} TraceEvent;
+
+// Head of a zygote launch request. The actions follow it, then the path,
+// argv and environment as NUL-terminated strings; the descriptors the
+// actions refer to travel alongside as SCM_RIGHTS.
+typedef struct {
+    int nargs;
+    int nenv;
+    int nactions;
+    pid_t pgid;         // Process group to join, or a PGID_ value
+} ZygoteRequest;
+
+typedef struct {
+    int op;
+    int fd;             // Descriptor in the new process
+    int arg;
+} ZygoteAction;
+
+typedef struct {
+    int pid;            // -1 if no process was created
+    int err;            // errno of a failed launch, else 0
+} ZygoteReply;
+
+// A stage's descriptors worked out for the zygote
+typedef struct {
+    ZygoteAction actions[ZYGOTE_MAX_ACTIONS];
+    int nactions;
+    int fds[ZYGOTE_MAX_FDS];
+    int owned[ZYGOTE_MAX_FDS];  // Opened for this launch and closed after it
+    int nfds;
+} ZygotePlan;
+
+// One stage of a pipeline ready to run: expanded words and redirections.
+// A compound command or function call stage has argv only for its name.
+typedef struct {
+    char **argv;
+    char **assigns;
+    Redirect *redirs;
+    Node *compound;
+    Function *function;
+} Stage;
+
+// Limits "run" gives a pipeline's cgroup; 0 leaves one unlimited
+typedef struct {
+    long cpu_percent;   // Of one CPU, so 200 is two CPUs' worth
+    long long mem_bytes;
+} RunLimits;
+
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strdup(Arena* arena, const char* str);
+void arena_reset(Arena* arena);
+ArenaMark arena_mark(Arena* arena);
+void arena_release(Arena* arena, ArenaMark mark);
+void arena_free(Arena* arena);
+void arena_stats(Arena* arena);
+int run_command(char* cmdline);
+int run_script(int fd, const char* path);
+int run_node(Node* node);
+int run_loop(Node* node);
+int run_case(Node* node);
+int run_background(Node* node);
+int run_pipeline(Node* pipeline, int is_background);
+void close_expand_fds(int first);
+int here_document(const char* text, int add_newline);
+static void write_all(int fd, const char* buf, size_t len);
+int execute(Stage* stages, int nstages, int is_background, int timed);
+void describe_node(FILE* fp, Node* node);
+int apply_redirects(Redirect* redirs, SavedFd* saved, int* nsaved);
+void restore_redirects(SavedFd* saved, int nsaved);
+pid_t spawn_stage(Stage* stage, int in_fd, int out_fd, pid_t pgid);
+int start_zygote();
+void stop_zygote();
+void close_zygote_socket();
+int zygote_main(int sock);
+unsigned long hash_string(const char* str);
+unsigned long hash_bytes(const char* str, size_t len);
+void set_variable(const char* name, const char* value);
+char* get_variable(const char* name);
+void unset_variable(const char* name);
+void list_variables();
+char* expand_word(char* word, int* drop);
+int is_assignment(const char* word);
+int is_name(const char* word);
+char* assignment_name(const char* word);
+char* find_command(char* name);
+void forget_command(char* name);
+void clear_command_cache();
+void list_command_cache();
+int is_data_stage(Stage* stage);
+int run_data_stage(Stage* stage, int in_fd);
+pid_t fork_data_stage(Stage* stage, int in_fd, pid_t pgid);
+int move_data(int in_fd, int out_fd);
+int tee_data(int in_fd, int* out_fds, int nouts);
+Token* lex(char* cmdline, int* ntokens);
+Node* parse(Token* tokens, Arena* arena, int* error);
+Node* parse_command(char* cmdline, int* error);
+void clear_parse_cache();
+Function* find_function(const char* name);
+void define_function(const char* name, Node* body);
+int unset_function(const char* name);
+int call_function(Function* fn, char** argv);
+void parse_cache_stats();
+char* read_cmd(char* prompt, LineReader* reader);
+void lr_init(LineReader* reader, int fd);
+void lr_init_string(LineReader* reader, const char* text);
+char* lr_next_line(LineReader* reader, size_t* len);
+char* lr_buffered_line(LineReader* reader, size_t* len);
+void lr_fill(LineReader* reader);
+void init_history();
+void close_history();
+void add_to_history(char* cmd);
+unsigned history_length();
+char* get_history_command(unsigned n);
+unsigned find_history_prefix(const char* prefix);
+char* expand_history(char* cmdline);
+void list_history(int max);
+void search_history(const char* pattern, int max);
+void init_builtins();
+Builtin* find_builtin(const char* name);
+int run_builtin(Builtin* builtin, Stage* stage);
+static Builtin* stage_builtin(Stage* stage);
+pid_t fork_builtin(Builtin* builtin, Stage* stage, int in_fd, int out_fd, int close_fd, pid_t pgid);
+int builtin_cd(char** argv);
+int builtin_exit(char** argv);
+int builtin_echo(char** argv);
+int builtin_printf(char** argv);
+int builtin_true(char** argv);
+int builtin_false(char** argv);
+int builtin_test(char** argv);
+int builtin_read(char** argv);
+int builtin_jobs(char** argv);
+int builtin_kill(char** argv);
+int builtin_fg(char** argv);
+int builtin_bg(char** argv);
+int builtin_wait(char** argv);
+int builtin_disown(char** argv);
+int builtin_hash(char** argv);
+int builtin_arena(char** argv);
+int builtin_history(char** argv);
+int builtin_parallel(char** argv);
+int builtin_export(char** argv);
+int builtin_unset(char** argv);
+int builtin_set(char** argv);
+int builtin_help(char** argv);
+int builtin_colon(char** argv);
+int builtin_parsecache(char** argv);
+int builtin_acct(char** argv);
+int builtin_shellstat(char** argv);
+int builtin_zygote(char** argv);
+int builtin_coproc(char** argv);
+int builtin_break(char** argv);
+int builtin_continue(char** argv);
+int builtin_return(char** argv);
+int builtin_shift(char** argv);
+int builtin_ulimit(char** argv);
+int builtin_run(char** argv);
+int builtin_cgstat(char** argv);
+int builtin_affinity(char** argv);
+int run_parallel(char** arglist);
+int add_job(pid_t* pids, int nprocs, char* cmd, pid_t pgid);
+Job* find_job(int id);
+void list_jobs();
+int signal_job(Job* job, int sig);
+void continue_job(Job* job);
+int wait_job(Job* job, int foreground);
+void remove_job(Job* job);
+void disown_job(Job* job);
+void init_job_control();
+void reclaim_terminal(Job* stopped);
+void stop_job(Job* job);
+void adopt_child(pid_t pid);
+void init_reaper();
+void init_event_loop(int input_fd);
+int watch_pid(pid_t pid, uint64_t tag);
+int child_events(int timeout, ForegroundWait* fg);
+void forked_child();
+void reap_jobs();
+void job_exited(pid_t pid, int status, struct rusage* ru);
+void job_changed(pid_t pid, int stopped);
+void notify_jobs();
+void init_acct();
+void acct_set_command(AcctRecord* rec, char** argv);
+void acct_add(AcctRecord* rec);
+void record_usage(AcctRecord* usage, int nstages, int timed);
+void acct_dump(FILE* fp, int format);
+uint64_t stat_now();
+uint64_t stat_record(int phase, uint64_t start, const char* detail);
+void print_shellstat();
+void start_trace(const char* path);
+int write_trace();
+
+// Persistent history: commands are appended to a plain text file, and a
+// fixed-layout index beside it is mapped, not parsed, at startup
+int hist_fd = -1;
+int hist_index_fd = -1;
+char* hist_data = NULL;         // Mapping of the data file
+size_t hist_data_map = 0;
+char* hist_index = NULL;        // Mapping of the index file
+size_t hist_index_map = 0;
+
+// Background jobs: a growable table indexed by job id, plus a pid hash
+// so the reaper finds a child's job in O(1)
+Job* jobs = NULL;
+int jobs_cap = 0;
+int max_job_id = 0;         // Highest id in use; new jobs get the next one
+int jobs_done = 0;          // Finished jobs not yet reported
+PidSlot* job_pids = NULL;
+size_t job_pids_cap = 0;
+size_t job_pids_used = 0;   // Live and deleted slots, for the load factor
+int sigchld_fd = -1;        // signalfd that becomes readable on SIGCHLD
+int current_job = 0;        // The job fg and bg act on by default
+
+// Job control, on in an interactive shell on a terminal: every pipeline
+// gets a process group, and the one in the foreground gets the terminal
+int job_control = 0;
+int tty_fd = -1;
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+int interrupted = 0;        // A foreground job was stopped or interrupted; abandon the command
+int job_news = 0;           // Jobs stopped in the background, to announce
+int reap_pending = 0;       // SIGCHLD was consumed by someone other than reap_jobs()
+int launch_status = 127;    // Status of a stage spawn_stage() could not launch
+int forked_copy = 0;        // This process is a forked copy of the shell
+
+// cgroup v2 launch mode: "run" puts each pipeline in a cgroup of its own
+// under cgroup_base, which its stages join before they start
+char* cgroup_base = NULL;   // Set up by the first "run"
+pid_t cgroup_owner = 0;     // The shell that set it up
+int cgroup_enable_errno = 0;    // Why cpu or memory could not be enabled there
+unsigned long cgroup_seq = 0;
+int launch_cgroup = -1;     // Directory of the cgroup stages being launched join
+char* last_run_cgroup = NULL;   // A finished foreground run's, kept for cgstat
+
+// CPU placement: the CPUs it hands out, node by node, and the NUMA nodes'
+// CPU sets, with the next of each to use
+int affinity_mode = AFFINITY_OFF;
+int affinity_cpus[CPU_SETSIZE];
+int affinity_ncpus = 0;
+cpu_set_t affinity_nodes[AFFINITY_MAX_NODES];
+int affinity_nnodes = 0;
+int affinity_next_cpu = 0;
+int affinity_next_node = 0;
+
+// Event loop: loop_epoll watches the input and child_epoll, which in turn
+// watches a pidfd per running child, or the SIGCHLD signalfd on kernels
+// without pidfds. Foreground waits sleep on child_epoll alone.
+int loop_epoll = -1;
+int child_epoll = -1;
+int polled_fd = -1;         // Input fd registered in loop_epoll; regular files cannot be
+int use_pidfds = 0;
+
+// Descriptors opened while expanding a pipeline: the shell's ends of
+// process substitutions and here-document bodies. They stay open until
+// the pipeline has started.
+int expand_fds[EXPAND_FDS_MAX];
+int nexpand_fds = 0;
+LineReader* more_input = NULL;  // Where the rest of an unfinished command is read from
+int record_history = 0;         // run_command() adds the command it parses to the history
+char* continued_text = NULL;    // The lines parse_continued() last joined
+int lex_partial = 0;            // lex() and parse() may stop for more input
+Token* lex_heredoc = NULL;      // The delimiter of a here-document that ran out of input
+int* lex_globs = NULL;          // Offsets of the quoted glob characters in the word being lexed
+int lex_nglobs = 0, lex_globs_cap = 0;
+int expand_pattern = 0;         // expand_word() escapes glob characters in quoted values
+int script_compiling = 0;       // lex() and parse() messages only mark the compile failed
+int script_compile_failed = 0;
+Coproc coprocs[COPROC_MAX];
+int ncoprocs = 0;
+
+// Builtin dispatch: a perfect hash table built at startup by searching
+// for a seed under which no two builtins share a slot
+Builtin* builtin_table[1 << BUILTIN_TABLE_BITS];
+unsigned long builtin_seed = 0;
+
+// Resource accounting: a ring of the newest ACCT_RING stage records.
+// Stages are recorded while accounting is on and under "time".
+AcctRecord acct_ring[ACCT_RING];
+unsigned long acct_total = 0;   // Records ever added; the ring holds the newest
+unsigned long acct_seq = 0;
+int acct_enabled = 0;
+pid_t acct_owner = 0;           // The shell that writes PUCIT_ACCT at exit
+
+// Shell phase timing for shellstat, and the Chrome trace being recorded
+// while trace_path is set
+PhaseStats phase_stats[PHASE_COUNT];
+const char* phase_names[PHASE_COUNT] = {"read", "history", "parse", "expand", "builtin", "data", "spawn", "wait"};
+char* trace_path = NULL;
+TraceEvent* trace_events = NULL;
+size_t trace_count = 0;
+size_t trace_cap = 0;
+unsigned long trace_dropped = 0;
+pid_t trace_owner = 0;          // The shell that writes the trace at exit
+
+// Zygote mode: commands are launched by a small helper process over this
+// socket while zygote_fd is open
+int zygote_fd = -1;
+pid_t zygote_pid = 0;
+unsigned long zygote_spawns = 0;
+
+// Scratch memory for the command being processed; reset once per command
+Arena cmd_arena;
+
+// Variables: open addressing with linear probing. Names are copied once
+// into a pool that is never reset, so a slot only holds pointers.
+Variable* var_table = NULL;
+size_t var_cap = 0;
+size_t var_count = 0;   // Variables that are set
+size_t var_used = 0;    // Slots with a name, set or unset
+Arena var_names;
+
+// Prompts, history and status messages only when reading from a user;
+// -c and script runs go straight from the reader to the executor
+int interactive = 1;
+int last_status = 0;
+
+// Positional parameters: $0, and $1 on as pos_args[0..pos_count-1]. A
+// function call replaces the arguments for its duration.
+char* shell_name = "version7";
+char** pos_args = NULL;
+int pos_count = 0;
+
+// Control flow. break, continue and return only set these; the loops and
+// lists of the interpreter see them and unwind to the right place.
+int break_levels = 0;       // Loops a pending break still has to leave
+int continue_levels = 0;    // ...or a continue, counting the loop it resumes
+int returning = 0;          // A return is unwinding the current function
+int return_status = 0;
+int loop_depth = 0;         // Enclosing loops in the current function
+int func_depth = 0;         // Function calls in progress
+
+// Shell functions, chained in buckets by name hash
+Function* functions[FUNC_BUCKETS];
+int nfunctions = 0;
+
+// Parse cache: chained hash buckets over a fixed pool of entries, with an
+// LRU list to pick the entry to evict
+CacheEntry parse_cache[PARSE_CACHE_SIZE];
+CacheEntry* parse_buckets[PARSE_CACHE_BUCKETS];
+CacheEntry* lru_head = NULL;
+CacheEntry* lru_tail = NULL;
+CacheEntry* cache_free = NULL;  // Entries released by eviction or a failed parse
+int parse_cache_next = 0;       // Pool entries never used yet start here
+int parse_cache_count = 0;
+unsigned long parse_hits = 0;
+unsigned long parse_misses = 0;
+unsigned long parse_evictions = 0;
+
+// Command location cache: open addressing with linear probing, keyed by
+// command name and rebuilt whenever PATH changes
+PathEntry* path_table = NULL;
+size_t path_cap = 0;
+size_t path_used = 0;
+char* path_cached_for = NULL;   // PATH value the cache was built against
+unsigned long path_hits = 0;
+unsigned long path_misses = 0;
+
+#ifndef SHELL_NO_MAIN
+int main(int argc, char* argv[]) {
+    char *cmdline;
+    char *prompt = PROMPT;
+    LineReader input;
+    const char* script = NULL;
+    size_t len;
+
+    if (argc == 3 && strcmp(argv[1], "--zygote") == 0) return zygote_main(atoi(argv[2]));
+    shell_name = argv[0];
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        // As with sh -c, the words after the command are $0, $1 and so on
+        interactive = 0;
+        lr_init_string(&input, argv[2]);
+        if (argc > 3) shell_name = argv[3];
+        pos_args = argv + (argc > 3 ? 4 : 3);
+        pos_count = argc > 3 ? argc - 4 : 0;
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return 127;
+        }
+        interactive = 0;
+        lr_init(&input, fd);
+        script = argv[1];
+        shell_name = argv[1];
+        pos_args = argv + 2;
+        pos_count = argc - 2;
+    } else {
+        lr_init(&input, STDIN_FILENO);
+    }
+
+    more_input = &input;
+    init_job_control();
+    init_reaper();
+    init_event_loop(interactive ? input.fd : -1);
+    init_builtins();
+    init_acct();
+    if (getenv("PUCIT_ZYGOTE") != NULL && strcmp(getenv("PUCIT_ZYGOTE"), "1") == 0) start_zygote();
+    if (getenv("PUCIT_TRACE") != NULL && *getenv("PUCIT_TRACE") != '\0') start_trace(getenv("PUCIT_TRACE"));
+    if (interactive) init_history();
+
+    // In-process stages report EPIPE instead of killing the shell
+    signal(SIGPIPE, SIG_IGN);
+
+    if (script != NULL && run_script(input.fd, script) == 0) {
+        free(input.buf);
+        return last_status;
+    }
+
+    for (;;) {
+        // Everything the previous command allocated goes away in one step
+        arena_reset(&cmd_arena);
+        interrupted = 0;
+        // Collect background jobs that finished since the last command
+        reap_jobs();
+        notify_jobs();
+        uint64_t started = stat_now();
+        if (!interactive) {
+            if ((cmdline = lr_next_line(&input, &len)) == NULL) break;
+            stat_record(PHASE_READ, started, NULL);
+            run_command(cmdline);
+            continue;
+        }
+        if ((cmdline = read_cmd(prompt, &input)) == NULL) break;
+        started = stat_record(PHASE_READ, started, NULL);
+
+        if (cmdline[0] == '!' && cmdline[1] != '\0') {
+            if ((cmdline = expand_history(cmdline)) == NULL) {
+                printf("No such command in history.\n");
+                continue;
+            }
+            printf("Repeating command: %s\n", cmdline);
+            stat_record(PHASE_HISTORY, started, NULL);
+        }
+        record_history = 1;
+        run_command(cmdline);
+    }
+
+    if (interactive) {
+        close_history();
+        printf("\nExiting shell...\n");
+    }
+    free(input.buf);
+    return last_status;
+}
+#endif
+
+// Parses and runs one command line, returning its exit status. With
+// record_history set, the command goes into the history once parsed,
+// with every line it took.
+int run_command(char* cmdline) {
+    int error, record = record_history;
+    // Lexing squeezes cmdline in place, so the history gets a copy
+    char* line = record ? arena_strdup(&cmd_arena, cmdline) : NULL;
+    record_history = 0;
+    continued_text = NULL;
+    uint64_t started = stat_now();
+    Node* ast = parse_command(cmdline, &error);
+    stat_record(PHASE_PARSE, started, NULL);
+    if (record) {
+        started = stat_now();
+        add_to_history(continued_text != NULL ? continued_text : line);
+        stat_record(PHASE_HISTORY, started, NULL);
+    }
+    if (ast == NULL) return error ? (last_status = 2) : last_status;
+    return run_node(ast);
+}
+
+// Whether a break, continue or return is unwinding the interpreter, or a
+// foreground job was stopped or interrupted and the command is abandoned
+static int flow_pending() {
+    return break_levels > 0 || continue_levels > 0 || returning || interrupted;
+}
+
+// Runs a parsed command and returns its exit status, which also becomes $?.
+// Compound commands are interpreted here, straight from the tree, so a
+// loop body is parsed once however many times it runs.
+int run_node(Node* node) {
+    int status = 0;
+    switch (node->type) {
+        case NODE_PIPELINE:
+            status = run_pipeline(node, 0);
+            break;
+        case NODE_AND:
+            if ((status = run_node(node->left)) == 0 && !flow_pending()) status = run_node(node->right);
+            break;
+        case NODE_OR:
+            if ((status = run_node(node->left)) != 0 && !flow_pending()) status = run_node(node->right);
+            break;
+        case NODE_LIST:
+            status = run_node(node->left);
+            if (!flow_pending()) status = run_node(node->right);
+            break;
+        case NODE_BACKGROUND:
+            status = run_background(node->left);
+            break;
+        case NODE_IF:
+            status = run_node(node->left);
+            if (flow_pending()) break;
+            if (status == 0) status = run_node(node->right);
+            else status = node->next != NULL ? run_node(node->next) : 0;
+            break;
+        case NODE_WHILE:
+        case NODE_UNTIL:
+        case NODE_FOR:
+            status = run_loop(node);
+            break;
+        case NODE_CASE:
+            status = run_case(node);
+            break;
+        case NODE_GROUP:
+        case NODE_SUBSHELL:
+            // The stage running a subshell has forked already
+            status = run_node(node->left);
+            break;
+        case NODE_FUNCTION:
+            define_function(node->name, node->left);
+            break;
+    }
+    return last_status = status;
+}
+
+// Starts a command in the background. A pipeline becomes a job directly;
+// anything bigger, like "a && b &", runs in a forked copy of the shell.
+int run_background(Node* node) {
+    if (node->type == NODE_PIPELINE) return run_pipeline(node, 1);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        return 1;
+    }
+    if (pid == 0) {
+        if (job_control) setpgid(0, 0);
+        forked_child();
+        _exit(run_node(node));
+    }
+    if (job_control) setpgid(pid, pid);
+    char* text;
+    size_t len;
+    FILE* fp = open_memstream(&text, &len);
+    describe_node(fp, node);
+    fclose(fp);
+    int id = add_job(&pid, 1, text, job_control ? pid : 0);
+    free(text);
+    if (interactive) printf("[Job %d] %d\n", id, pid);
+    return 0;
+}
+
+// Whether a word is just $@ or "$@", which expands to one word per
+// positional parameter
+static int is_all_args(const char* word) {
+    return (word[0] == VAR_MARK || word[0] == VAR_MARK_QUOTED) && word[1] == '@' && word[2] == '\0';
+}
+
+// Expands a NULL-terminated word list into the arena, dropping words that
+// were only an unquoted expansion of an empty value
+static char** expand_words(char** words) {
+    int n = 0, extra = 0;
+    for (; words[n] != NULL; n++)
+        if (is_all_args(words[n])) extra += pos_count;
+    char** out = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (n + extra + 1));
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        int drop = 0;
+        if (is_all_args(words[i])) {
+            memcpy(out + kept, pos_args, sizeof(char*) * pos_count);
+            kept += pos_count;
+            continue;
+        }
+        char* word = expand_word(words[i], &drop);
+        if (!drop) out[kept++] = word;
+    }
+    out[kept] = NULL;
+    return out;
+}
+
+// Runs a while, until or for loop. The command arena is released back to
+// where it was before each pass, so a long loop runs in constant space.
+int run_loop(Node* node) {
+    static char* no_words[] = {NULL};
+    char** words = NULL;
+    int status = 0;
+
+    if (node->type == NODE_FOR)
+        words = node->argv != NULL ? expand_words(node->argv) : pos_args != NULL ? pos_args : no_words;
+    ArenaMark mark = arena_mark(&cmd_arena);
+    loop_depth++;
+    for (int i = 0; ; i++) {
+        if (node->type == NODE_FOR) {
+            if (words[i] == NULL) break;
+            set_variable(node->name, words[i]);
+        } else {
+            int cond = run_node(node->left);
+            if (!flow_pending() && (cond == 0) != (node->type == NODE_WHILE)) break;
+        }
+        if (!flow_pending()) status = run_node(node->right);
+        arena_release(&cmd_arena, mark);
+        if (returning || interrupted) break;
+        if (break_levels > 0) {
+            break_levels--;
+            break;
+        }
+        // A continue for an outer loop leaves this one like a break
+        if (continue_levels > 0 && --continue_levels > 0) break;
+    }
+    loop_depth--;
+    return status;
+}
+
+// Runs the list of the first case item with a pattern matching the word.
+// Patterns are fnmatch() globs; the parser has escaped the glob characters
+// that were quoted, and those of quoted expansions are escaped here.
+int run_case(Node* node) {
+    int drop, status = 0;
+    char* word = expand_word(node->argv[0], &drop);
+
+    for (Node* item = node->next; item != NULL; item = item->next) {
+        int matched = 0;
+        for (int i = 0; item->argv[i] != NULL && !matched; i++) {
+            expand_pattern = 1;
+            char* pattern = expand_word(item->argv[i], &drop);
+            expand_pattern = 0;
+            matched = fnmatch(pattern, word, 0) == 0;
+        }
+        if (matched) {
+            if (item->left != NULL) status = run_node(item->left);
+            break;
+        }
+    }
+    return status;
+}
+
+static char** copy_words(Arena* arena, char** words) {
+    if (words == NULL) return NULL;
+    int n = 0;
+    while (words[n] != NULL) n++;
+    char** copy = (char**)arena_alloc(arena, sizeof(char*) * (n + 1));
+    for (int i = 0; i < n; i++) copy[i] = arena_strdup(arena, words[i]);
+    copy[n] = NULL;
+    return copy;
+}
+
+// Copies a tree, with its words and redirections, into arena
+static Node* copy_node(Arena* arena, Node* node) {
+    if (node == NULL) return NULL;
+    Node* copy = (Node*)arena_alloc(arena, sizeof(Node));
+    *copy = *node;
+    copy->left = copy_node(arena, node->left);
+    copy->right = copy_node(arena, node->right);
+    copy->next = copy_node(arena, node->next);
+    if (node->stages != NULL) {
+        copy->stages = (Node**)arena_alloc(arena, sizeof(Node*) * node->nstages);
+        for (int i = 0; i < node->nstages; i++) copy->stages[i] = copy_node(arena, node->stages[i]);
+    }
+    if (node->name != NULL) copy->name = arena_strdup(arena, node->name);
+    copy->argv = copy_words(arena, node->argv);
+    copy->assigns = copy_words(arena, node->assigns);
+    Redirect** tail = &copy->redirs;
+    for (Redirect* r = node->redirs; r != NULL; r = r->next) {
+        Redirect* c = (Redirect*)arena_alloc(arena, sizeof(Redirect));
+        *c = *r;
+        c->target = arena_strdup(arena, r->target);
+        *tail = c;
+        tail = &c->next;
+    }
+    *tail = NULL;
+    return copy;
+}
+
+// Returns the function called name, or NULL
+Function* find_function(const char* name) {
+    if (nfunctions == 0) return NULL;
+    for (Function* fn = functions[hash_string(name) & (FUNC_BUCKETS - 1)]; fn != NULL; fn = fn->chain)
+        if (strcmp(fn->name, name) == 0) return fn;
+    return NULL;
+}
+
+static void free_function(Function* fn) {
+    arena_free(&fn->arena);
+    free(fn);
+}
+
+// Defines a function, replacing any of the same name, with a copy of body:
+// the tree may live in the command arena or in an evictable cache entry
+void define_function(const char* name, Node* body) {
+    Function** bucket = &functions[hash_string(name) & (FUNC_BUCKETS - 1)];
+    Function* fn = (Function*)calloc(1, sizeof(Function));
+    if (fn == NULL) {
+        perror("Function allocation failed");
+        exit(1);
+    }
+    unset_function(name);
+    fn->arena.min_block = PARSE_ARENA_BLOCK;
+    fn->name = arena_strdup(&fn->arena, name);
+    fn->body = copy_node(&fn->arena, body);
+    fn->chain = *bucket;
+    *bucket = fn;
+    nfunctions++;
+}
+
+// Removes a function. One that is running is only marked stale, and freed
+// when its last call returns. Returns 0 if there was no such function.
+int unset_function(const char* name) {
+    Function** link = &functions[hash_string(name) & (FUNC_BUCKETS - 1)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) link = &(*link)->chain;
+    if (*link == NULL) return 0;
+    Function* fn = *link;
+    *link = fn->chain;
+    nfunctions--;
+    if (fn->busy > 0) fn->stale = 1;
+    else free_function(fn);
+    return 1;
+}
+
+// Runs a function with argv[1] on as its positional parameters. A return
+// ends the call, and no break or continue reaches the caller's loops.
+int call_function(Function* fn, char** argv) {
+    char** saved_args = pos_args;
+    int saved_count = pos_count, saved_loops = loop_depth;
+
+    if (func_depth == FUNC_DEPTH_MAX) {
+        fprintf(stderr, "%s: maximum function nesting depth (%d) exceeded\n", argv[0], FUNC_DEPTH_MAX);
+        return 1;
+    }
+    pos_args = argv + 1;
+    for (pos_count = 0; pos_args[pos_count] != NULL; pos_count++) {}
+    loop_depth = 0;
+    fn->busy++;
+    func_depth++;
+    int status = run_node(fn->body);
+    if (returning) {
+        status = return_status;
+        returning = 0;
+    }
+    func_depth--;
+    if (--fn->busy == 0 && fn->stale) free_function(fn);
+    pos_args = saved_args;
+    pos_count = saved_count;
+    loop_depth = saved_loops;
+    return status;
+}
+
+// The argv of a compound command stage: its keyword, or for a stage of a
+// job, which is listed, the text of the whole command
+static char** compound_argv(Node* node, int described) {
+    static char* keywords[] = {"if", "while", "until", "for", "case", "", "{", "(", "function"};
+    char** argv = (char**)arena_alloc(&cmd_arena, sizeof(char*) * 2);
+    argv[0] = keywords[node->type - NODE_IF];
+    argv[1] = NULL;
+    if (described) {
+        char* text;
+        size_t len;
+        FILE* fp = open_memstream(&text, &len);
+        describe_node(fp, node);
+        fclose(fp);
+        argv[0] = arena_strdup(&cmd_arena, text);
+        free(text);
+    }
+    return argv;
+}
+
+// Expands a parsed pipeline into the stages execute() runs. The AST may be
+// cached, so everything that changes per run is built in the arena.
+int run_pipeline(Node* pipeline, int is_background) {
+    static char* no_command[] = {":", NULL};
+    static char* no_assigns[] = {NULL};
+    int nstages = pipeline->nstages;
+    Stage* stages = (Stage*)arena_alloc(&cmd_arena, sizeof(Stage) * nstages);
+    uint64_t started = stat_now();
+    int first_fd = nexpand_fds;
+
+    for (int i = 0; i < nstages; i++) {
+        Node* cmd = pipeline->stages[i];
+        Redirect** tail = &stages[i].redirs;
+        stages[i].compound = NULL;
+        stages[i].function = NULL;
+        if (cmd->type != NODE_COMMAND) {
+            stages[i].compound = cmd;
+            stages[i].argv = compound_argv(cmd, nstages > 1 || is_background);
+            stages[i].assigns = no_assigns;
+        } else {
+            stages[i].argv = expand_words(cmd->argv);
+            stages[i].assigns = expand_words(cmd->assigns);
+        }
+        for (Redirect* r = cmd->redirs; r != NULL; r = r->next) {
+            Redirect* copy = (Redirect*)arena_alloc(&cmd_arena, sizeof(Redirect));
+            int drop;
+            *copy = *r;
+            copy->target = expand_word(r->target, &drop);
+            if (r->type == REDIR_HEREDOC || r->type == REDIR_HERESTRING) {
+                // The body is handed over as an open descriptor to dup
+                int fd = here_document(copy->target, r->type == REDIR_HERESTRING);
+                if (fd == -1) {
+                    close_expand_fds(first_fd);
+                    return 1;
+                }
+                copy->type = REDIR_DUP;
+                copy->target = (char*)arena_alloc(&cmd_arena, 16);
+                snprintf(copy->target, 16, "%d", fd);
+            }
+            *tail = copy;
+            tail = &copy->next;
+        }
+        *tail = NULL;
+
+        if (stages[i].compound != NULL) continue;
+        if (stages[i].argv[0] != NULL) {
+            stages[i].function = find_function(stages[i].argv[0]);
+            continue;
+        }
+        // Without a command name, NAME=value words set shell variables
+        if (nstages == 1 && !is_background) {
+            for (int j = 0; stages[i].assigns[j] != NULL; j++)
+                set_variable(assignment_name(stages[i].assigns[j]), strchr(stages[i].assigns[j], '=') + 1);
+            stages[i].assigns[0] = NULL;
+            if (stages[i].redirs == NULL) {
+                stat_record(PHASE_EXPAND, started, NULL);
+                close_expand_fds(first_fd);
+                return 0;
+            }
+        }
+        // ...and redirections alone are carried out by the no-op builtin
+        stages[i].argv = no_command;
+    }
+    stat_record(PHASE_EXPAND, started, stages[0].argv[0]);
+    int status = execute(stages, nstages, is_background, pipeline->timed);
+    close_expand_fds(first_fd);
+    return status;
+}
+
+// Closes the descriptors expansion opened since the first'th; the
+// commands started with them hold their own copies
+void close_expand_fds(int first) {
+    while (nexpand_fds > first) close(expand_fds[--nexpand_fds]);
+}
+
+// Returns a close-on-exec descriptor positioned at the start of text,
+// plus a newline for a here-string. Small bodies are written into a pipe,
+// which holds them without blocking; larger ones go into a memfd, so no
+// file is ever created on disk.
+int here_document(const char* text, int add_newline) {
+    size_t len = strlen(text);
+    int fd, pipe_fd[2] = {-1, -1};
+
+    if (nexpand_fds == EXPAND_FDS_MAX) {
+        fprintf(stderr, "Too many here-documents\n");
+        return -1;
+    }
+    if (len + add_newline <= HEREDOC_PIPE_MAX) {
+        if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+            perror("Pipe failed");
+            return -1;
+        }
+        fd = pipe_fd[1];
+    } else if ((fd = memfd_create("heredoc", MFD_CLOEXEC)) == -1) {
+        perror("memfd_create failed");
+        return -1;
+    }
+    write_all(fd, text, len);
+    if (add_newline) write_all(fd, "\n", 1);
+    if (pipe_fd[0] != -1) {
+        close(pipe_fd[1]);
+        fd = pipe_fd[0];
+    } else {
+        lseek(fd, 0, SEEK_SET);
+    }
+    expand_fds[nexpand_fds++] = fd;
+    return fd;
+}
+
+// Runs the list of a <(list) or >(list) word in a forked copy of the
+// shell, connected by a pipe, and returns the /dev/fd path of the shell's
+// end. The child is reaped like a job that is never reported.
+static char* process_substitution(char* word) {
+    int reading = *word == PROCSUB_IN;  // The command reads the list's output
+    int pipe_fd[2];
+    char* path = (char*)arena_alloc(&cmd_arena, 32);
+
+    if (nexpand_fds == EXPAND_FDS_MAX) {
+        fprintf(stderr, "Too many process substitutions\n");
+        return "";
+    }
+    if (pipe(pipe_fd) == -1) {
+        perror("Pipe failed");
+        return "";
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return "";
+    }
+    if (pid == 0) {
+        forked_child();
+        dup2(pipe_fd[reading], reading ? STDOUT_FILENO : STDIN_FILENO);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        // Earlier substitutions' ends would keep their lists from seeing EOF
+        close_expand_fds(0);
+        int status = run_command(word + 1);
+        fflush(stdout);
+        _exit(status);
+    }
+    adopt_child(pid);
+    close(pipe_fd[reading]);
+    expand_fds[nexpand_fds++] = pipe_fd[!reading];
+    snprintf(path, 32, "/dev/fd/%d", pipe_fd[!reading]);
+    return path;
+}
+
+// Returns environ with a command's NAME=value assignments added, each one
+// replacing any entry of the same name
+static char** command_env(char** assigns) {
+    if (assigns[0] == NULL) return environ;
+    int nenv = 0, nassigns = 0;
+    while (environ[nenv] != NULL) nenv++;
+    while (assigns[nassigns] != NULL) nassigns++;
+
+    char** env = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (nenv + nassigns + 1));
+    int n = 0;
+    for (int i = 0; i < nenv; i++) {
+        int replaced = 0;
+        for (int j = 0; j < nassigns && !replaced; j++) {
+            size_t name_len = strchr(assigns[j], '=') - assigns[j] + 1;
+            replaced = strncmp(environ[i], assigns[j], name_len) == 0;
+        }
+        if (!replaced) env[n++] = environ[i];
+    }
+    memcpy(env + n, assigns, sizeof(char*) * (nassigns + 1));
+    return env;
+}
+
+// Returns the descriptor a >& or <& redirection copies, -1 for "-" (close),
+// or -2 after reporting a target that is not a descriptor
+static int dup_target(const char* target) {
+    if (strcmp(target, "-") == 0) return -1;
+    if (*target == '\0' || strspn(target, "0123456789") != strlen(target)) {
+        fprintf(stderr, "%s: ambiguous redirect\n", target);
+        return -2;
+    }
+    return atoi(target);
+}
+
+// open(2) flags for a file redirection
+static int redirect_flags(Redirect* r) {
+    if (r->type == REDIR_IN) return O_RDONLY;
+    return O_WRONLY | O_CREAT | (r->type == REDIR_APPEND ? O_APPEND : O_TRUNC);
+}
+
+// Adds a descriptor to a zygote plan, returning its index, or -1 if the
+// plan is full. Descriptors opened for the plan are owned and closed
+// by zygote_release().
+static int plan_fd(ZygotePlan* plan, int fd, int owned) {
+    if (plan->nfds == ZYGOTE_MAX_FDS) {
+        if (owned) close(fd);
+        return -1;
+    }
+    plan->fds[plan->nfds] = fd;
+    plan->owned[plan->nfds] = owned;
+    return plan->nfds++;
+}
+
+static void plan_action(ZygotePlan* plan, int op, int fd, int arg) {
+    ZygoteAction* action = &plan->actions[plan->nactions++];
+    action->op = op;
+    action->fd = fd;
+    action->arg = arg;
+}
+
+// Returns 1 if the plan's actions so far put a descriptor at fd
+static int plan_installs(ZygotePlan* plan, int fd) {
+    for (int i = 0; i < plan->nactions; i++)
+        if (plan->actions[i].op != ZACT_CHDIR && plan->actions[i].fd == fd) return 1;
+    return 0;
+}
+
+// Closes the descriptors a plan opened
+static void zygote_release(ZygotePlan* plan) {
+    for (int i = 0; i < plan->nfds; i++)
+        if (plan->owned[i]) close(plan->fds[i]);
+}
+
+// Works out the descriptors a stage's process needs, in the order a
+// posix_spawn file action list would install them: the shell's working
+// directory and stdio, the pipe ends, then the redirections. Files are
+// opened here, since the zygote cannot see the shell's cwd. Returns the
+// plan, or NULL with *error set after reporting a failure, or NULL with
+// *error clear if the stage needs more descriptors than a request carries.
+static ZygotePlan* zygote_plan(Stage* stage, int in_fd, int out_fd, int* error) {
+    ZygotePlan* plan = (ZygotePlan*)arena_alloc(&cmd_arena, sizeof(ZygotePlan));
+    int idx;
+    plan->nfds = plan->nactions = 0;
+    *error = 0;
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd != -1 && (idx = plan_fd(plan, cwd, 1)) != -1) plan_action(plan, ZACT_CHDIR, -1, idx);
+    for (int fd = 0; fd <= 2; fd++) {
+        int src = fd == STDIN_FILENO && in_fd != -1 ? in_fd : fd == STDOUT_FILENO && out_fd != -1 ? out_fd : fd;
+        if (fcntl(src, F_GETFD) == -1) plan_action(plan, ZACT_CLOSE, fd, 0);
+        else if ((idx = plan_fd(plan, src, 0)) != -1) plan_action(plan, ZACT_PASSED, fd, idx);
+    }
+    // Process substitutions and here-documents keep their numbers, as
+    // named by /dev/fd/N or <&N
+    for (int i = 0; i < nexpand_fds; i++) {
+        if (expand_fds[i] >= ZYGOTE_FD_BASE || (idx = plan_fd(plan, expand_fds[i], 0)) == -1) {
+            zygote_release(plan);
+            return NULL;
+        }
+        plan_action(plan, ZACT_PASSED, expand_fds[i], idx);
+    }
+    for (Redirect* r = stage->redirs; r != NULL; r = r->next) {
+        if (plan->nactions == ZYGOTE_MAX_ACTIONS) {
+            zygote_release(plan);
+            return NULL;
+        }
+        if (r->type == REDIR_DUP) {
+            int target = dup_target(r->target);
+            if (target == -2) {
+                zygote_release(plan);
+                *error = 1;
+                return NULL;
+            }
+            // A descriptor the plan has not installed is the shell's own
+            if (target != -1 && !plan_installs(plan, target) && fcntl(target, F_GETFD) != -1) {
+                if ((idx = plan_fd(plan, target, 0)) == -1) {
+                    zygote_release(plan);
+                    return NULL;
+                }
+                plan_action(plan, ZACT_PASSED, r->fd, idx);
+                continue;
+            }
+            if (target != -1 && !plan_installs(plan, target)) {
+                fprintf(stderr, "%d: %s\n", target, strerror(EBADF));
+                zygote_release(plan);
+                *error = 1;
+                return NULL;
+            }
+            if (target == -1) plan_action(plan, ZACT_CLOSE, r->fd, 0);
+            else plan_action(plan, ZACT_DUP, r->fd, target);
+            continue;
+        }
+        int fd = open(r->target, redirect_flags(r) | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+            zygote_release(plan);
+            *error = 1;
+            return NULL;
+        }
+        if ((idx = plan_fd(plan, fd, 1)) == -1) {
+            zygote_release(plan);
+            return NULL;
+        }
+        plan_action(plan, ZACT_PASSED, r->fd, idx);
+    }
+    return plan;
+}
+
+// Forgets the zygote in a forked copy of the shell. The zygote's clones
+// become children of its parent, so only that shell may use it.
+void close_zygote_socket() {
+    if (zygote_fd != -1) close(zygote_fd);
+    zygote_fd = -1;
+    zygote_pid = 0;
+}
+
+// Shuts the zygote down and goes back to spawning directly
+void stop_zygote() {
+    if (zygote_fd == -1) return;
+    close(zygote_fd);
+    zygote_fd = -1;
+    if (zygote_pid > 0) {
+        kill(zygote_pid, SIGKILL);
+        waitpid(zygote_pid, NULL, 0);
+    }
+    zygote_pid = 0;
+}
+
+// Asks the zygote to launch path. Returns 0 with *pid set, an errno value
+// if the launch failed, or -1 if the zygote could not take the request,
+// in which case the caller spawns the command itself.
+static int zygote_spawn(pid_t* pid, char* path, char** argv, char** env, ZygotePlan* plan, pid_t pgid) {
+    static char msg[ZYGOTE_MSG_MAX];
+    ZygoteRequest* req = (ZygoteRequest*)msg;
+    size_t len = sizeof(ZygoteRequest) + sizeof(ZygoteAction) * plan->nactions;
+
+    req->nargs = req->nenv = 0;
+    req->pgid = pgid;
+    req->nactions = plan->nactions;
+    memcpy(msg + sizeof(ZygoteRequest), plan->actions, sizeof(ZygoteAction) * plan->nactions);
+    // The path, then argv, then the environment, each string NUL-terminated
+    for (int part = 0; part < 3; part++) {
+        char* one[] = {path, NULL};
+        char** strs = part == 0 ? one : part == 1 ? argv : env;
+        for (int i = 0; strs[i] != NULL; i++) {
+            size_t n = strlen(strs[i]) + 1;
+            if (len + n > sizeof(msg)) return -1;
+            memcpy(msg + len, strs[i], n);
+            len += n;
+            if (part == 1) req->nargs++;
+            if (part == 2) req->nenv++;
+        }
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    struct iovec iov = {msg, len};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (plan->nfds > 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * plan->nfds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * plan->nfds);
+        memcpy(CMSG_DATA(cmsg), plan->fds, sizeof(int) * plan->nfds);
+    }
+
+    ZygoteReply reply;
+    if (sendmsg(zygote_fd, &mh, MSG_NOSIGNAL) != (ssize_t)len ||
+        recv(zygote_fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        fprintf(stderr, "zygote: %s; launching directly\n", strerror(errno));
+        stop_zygote();
+        return -1;
+    }
+    zygote_spawns++;
+    // A command that failed to exec was still started as our child
+    if (reply.err != 0 && reply.pid > 0) waitpid(reply.pid, NULL, 0);
+    *pid = reply.pid;
+    return reply.err;
+}
+
+// Starts the zygote as a fresh exec of this program, so its address space
+// holds none of the shell's history, variables or caches however large
+// they grow. Its stdio is /dev/null, so it never holds a pipe open.
+int start_zygote() {
+    if (zygote_fd != -1) return 0;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("zygote socket failed");
+        return -1;
+    }
+    // Out of the way of the dup2 onto ZYGOTE_SOCK_FD
+    int theirs = fcntl(sv[1], F_DUPFD_CLOEXEC, 10);
+    close(sv[1]);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, mask;
+    char sock_arg[16];
+    snprintf(sock_arg, sizeof(sock_arg), "%d", ZYGOTE_SOCK_FD);
+    char* argv[] = {"pucit-zygote", "--zygote", sock_arg, NULL};
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, theirs, ZYGOTE_SOCK_FD);
+    posix_spawnattr_init(&attr);
+    sigfillset(&defaults);
+    sigdelset(&defaults, SIGKILL);
+    sigdelset(&defaults, SIGSTOP);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    int err = posix_spawn(&zygote_pid, "/proc/self/exe", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(theirs);
+    if (err != 0) {
+        fprintf(stderr, "zygote: %s\n", strerror(err));
+        close(sv[0]);
+        zygote_pid = 0;
+        return -1;
+    }
+    zygote_fd = sv[0];
+    zygote_spawns = 0;
+    return 0;
+}
+
+// Runs one launch request in the zygote. The process is cloned with
+// CLONE_PARENT, so it is the shell's child and the shell waits for it
+// and gets its rusage as if it had spawned it. fds have been moved above
+// ZYGOTE_FD_BASE so installing them cannot clobber one another. Being
+// cloned, it starts in the zygote's process group, so it moves to the
+// request's group itself.
+static ZygoteReply zygote_launch(char* msg, size_t len, int* fds, int nfds) {
+    ZygoteReply reply = {-1, EINVAL};
+    ZygoteRequest* req = (ZygoteRequest*)msg;
+    if (len < sizeof(ZygoteRequest) || req->nactions < 0 || req->nactions > ZYGOTE_MAX_ACTIONS ||
+        req->nargs < 1 || len < sizeof(ZygoteRequest) + sizeof(ZygoteAction) * req->nactions)
+        return reply;
+    ZygoteAction* actions = (ZygoteAction*)(msg + sizeof(ZygoteRequest));
+    char** argv = (char**)malloc(sizeof(char*) * (req->nargs + req->nenv + 3));
+    if (argv == NULL) {
+        reply.err = ENOMEM;
+        return reply;
+    }
+    char** env = argv + req->nargs + 1;
+    char* path = NULL;
+    char* cp = msg + sizeof(ZygoteRequest) + sizeof(ZygoteAction) * req->nactions;
+    char* end = msg + len;
+    for (int i = -1; i < req->nargs + req->nenv; i++) {
+        char* nul = memchr(cp, '\0', end - cp);
+        if (nul == NULL) {
+            free(argv);
+            return reply;
+        }
+        if (i == -1) path = cp;
+        else if (i < req->nargs) argv[i] = cp;
+        else env[i - req->nargs] = cp;
+        cp = nul + 1;
+    }
+    argv[req->nargs] = NULL;
+    env[req->nenv] = NULL;
+
+    int errpipe[2];
+    if (pipe2(errpipe, O_CLOEXEC) == -1) {
+        reply.err = errno;
+        free(argv);
+        return reply;
+    }
+    for (int i = 0; i < 2; i++) {
+        int high = fcntl(errpipe[i], F_DUPFD_CLOEXEC, ZYGOTE_FD_BASE);
+        close(errpipe[i]);
+        errpipe[i] = high;
+    }
+
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if (pid == 0) {
+        int err = 0;
+        for (int i = 0; i < req->nactions && err == 0; i++) {
+            ZygoteAction* a = &actions[i];
+            if (a->op == ZACT_CHDIR) {
+                if (a->arg < nfds && fchdir(fds[a->arg]) == -1) err = errno;
+            } else if (a->op == ZACT_CLOSE) {
+                close(a->fd);
+            } else {
+                int src = a->op == ZACT_PASSED ? (a->arg < nfds ? fds[a->arg] : -1) : a->arg;
+                if (src == a->fd) fcntl(src, F_SETFD, 0);
+                else if (dup2(src, a->fd) == -1) err = errno;
+            }
+        }
+        if (err == 0) {
+            if (req->pgid != PGID_SHELL) setpgid(0, req->pgid > 0 ? req->pgid : 0);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            execve(path, argv, env);
+            err = errno;
+        }
+        if (write(errpipe[1], &err, sizeof(err)) < 0) _exit(127);
+        _exit(127);
+    }
+    close(errpipe[1]);
+    reply.pid = pid;
+    reply.err = pid == -1 ? errno : 0;
+    if (pid > 0) {
+        int err;
+        ssize_t n;
+        while ((n = read(errpipe[0], &err, sizeof(err))) == -1 && errno == EINTR) ;
+        if (n == sizeof(err)) reply.err = err;
+    }
+    close(errpipe[0]);
+    free(argv);
+    return reply;
+}
+
+// Main loop of the zygote process ("version7 --zygote fd"): serves launch
+// requests until the shell closes the socket, and dies with the shell.
+int zygote_main(int sock) {
+    static char msg[ZYGOTE_MSG_MAX];
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) return 0;
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    // Keyboard signals are for the commands, which reset them. The zygote
+    // stays in the shell's process group, where ^Z at the prompt must not
+    // stop it.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    for (;;) {
+        struct iovec iov = {msg, sizeof(msg)};
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+
+        int fds[ZYGOTE_MAX_FDS], nfds = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int* passed = (int*)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++) {
+                int high = fcntl(passed[i], F_DUPFD_CLOEXEC, ZYGOTE_FD_BASE);
+                close(passed[i]);
+                if (nfds < ZYGOTE_MAX_FDS) fds[nfds++] = high;
+                else close(high);
+            }
+        }
+        ZygoteReply reply = zygote_launch(msg, n, fds, nfds);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) return 0;
+    }
+}
+
+// Whether descriptor fd will be open in a spawned stage's child when
+// redirection upto is carried out: the shell has it open, or a pipe end
+// or an earlier redirection puts it there
+static int spawn_fd_open(Stage* stage, Redirect* upto, int fd, int in_fd, int out_fd) {
+    int open_now = fcntl(fd, F_GETFD) != -1 || (fd == STDIN_FILENO && in_fd != -1) ||
+                   (fd == STDOUT_FILENO && out_fd != -1);
+    for (Redirect* r = stage->redirs; r != upto; r = r->next)
+        if (r->fd == fd) open_now = r->type != REDIR_DUP || strcmp(r->target, "-") != 0;
+    return open_now;
+}
+
+// Fills in the file actions that give a spawned stage its descriptors:
+// pipe ends first, then its redirections in source order, so "2>&1 |"
+// sends errors down the pipe. Files are opened here rather than by the
+// child, so an ENOENT from posix_spawn can only mean the command itself
+// is missing. Each is moved to 10 or above, clear of the numbers
+// redirections name, and kept in opened for the caller to close once the
+// child has started. Returns -1 after reporting a failure.
+static int spawn_actions(posix_spawn_file_actions_t* actions, Stage* stage, int in_fd, int out_fd, int* opened,
+                         int* nopened) {
+    if (in_fd != -1) posix_spawn_file_actions_adddup2(actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1) posix_spawn_file_actions_adddup2(actions, out_fd, STDOUT_FILENO);
+    for (Redirect* r = stage->redirs; r != NULL; r = r->next) {
+        if (r->type != REDIR_DUP) {
+            int fd = open(r->target, redirect_flags(r) | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+                return -1;
+            }
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            if (high == -1) {
+                fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+                return -1;
+            }
+            opened[(*nopened)++] = high;
+            posix_spawn_file_actions_adddup2(actions, high, r->fd);
+            continue;
+        }
+        int target = dup_target(r->target);
+        if (target == -2) return -1;
+        // Named here, as apply_redirects() would, not left to posix_spawn
+        if (target != -1 && !spawn_fd_open(stage, r, target, in_fd, out_fd)) {
+            fprintf(stderr, "%d: %s\n", target, strerror(EBADF));
+            return -1;
+        }
+        if (target == -1)
+            posix_spawn_file_actions_addclose(actions, r->fd);
+        else
+            posix_spawn_file_actions_adddup2(actions, target, r->fd);
+    }
+    return 0;
+}
+
+// Launches one stage with posix_spawn into process group pgid. The child
+// never duplicates the shell's address space, so launch cost does not
+// grow with the shell.
+pid_t spawn_stage(Stage* stage, int in_fd, int out_fd, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, mask;
+    pid_t pid;
+
+    // A stage that fails on a redirection reports 1, as a builtin would
+    int nredirs = 0, nopened = 0;
+    launch_status = 1;
+    for (Redirect* r = stage->redirs; r != NULL; r = r->next) nredirs++;
+    int* opened = (int*)arena_alloc(&cmd_arena, sizeof(int) * (nredirs + 1));
+    posix_spawn_file_actions_init(&actions);
+
+    // Children start with default signal handling regardless of the shell's
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    // ...and without the shell's blocked SIGCHLD
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (pgid != PGID_SHELL) {
+        posix_spawnattr_setpgroup(&attr, pgid > 0 ? pgid : 0);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+#if __GLIBC_PREREQ(2, 35)
+    // A foreground leader takes the terminal itself, before it can read
+    if (pgid == PGID_NEW_FG) posix_spawn_file_actions_addtcsetpgrp_np(&actions, tty_fd);
+#endif
+
+    // In zygote mode the zygote launches the command, and the file actions
+    // are only filled in if it cannot take the request, since both open
+    // the redirections' files
+    ZygotePlan* plan = NULL;
+    if (zygote_fd != -1) {
+        int error;
+        if ((plan = zygote_plan(stage, in_fd, out_fd, &error)) == NULL && error) {
+            posix_spawn_file_actions_destroy(&actions);
+            posix_spawnattr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    // Exec by absolute path from the cache instead of letting execvp try
+    // every PATH directory. A cached path that vanished is looked up again.
+    char** env = command_env(stage->assigns);
+    int err = ENOENT, ready = 0;
+    char* path = NULL;
+    for (int attempt = 0; attempt < 2 && err == ENOENT; attempt++) {
+        if ((path = find_command(stage->argv[0])) == NULL) break;
+        err = plan != NULL && zygote_fd != -1 ? zygote_spawn(&pid, path, stage->argv, env, plan, pgid) : -1;
+        if (err == -1 && !ready) ready = spawn_actions(&actions, stage, in_fd, out_fd, opened, &nopened) == 0 ? 1 : -1;
+        if (ready == -1) break;
+        if (err == -1) err = posix_spawn(&pid, path, &actions, &attr, stage->argv, env);
+        if (err == ENOENT) forget_command(stage->argv[0]);
+    }
+    // Like execvp, hand a script without a #! line to /bin/sh
+    if (err == ENOEXEC && ready != -1) {
+        int argc = 0;
+        while (stage->argv[argc] != NULL) argc++;
+        char** sh_argv = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (argc + 2));
+        sh_argv[0] = "/bin/sh";
+        sh_argv[1] = path;
+        memcpy(sh_argv + 2, stage->argv + 1, sizeof(char*) * argc);
+        err = plan != NULL && zygote_fd != -1 ? zygote_spawn(&pid, "/bin/sh", sh_argv, env, plan, pgid) : -1;
+        if (err == -1 && !ready) ready = spawn_actions(&actions, stage, in_fd, out_fd, opened, &nopened) == 0 ? 1 : -1;
+        if (err == -1 && ready == 1) err = posix_spawn(&pid, "/bin/sh", &actions, &attr, sh_argv, env);
+    }
+    if (plan != NULL) zygote_release(plan);
+    while (nopened > 0) close(opened[--nopened]);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (ready == -1) return -1;
+    launch_status = 127;
+    if (err == ENOENT && strchr(stage->argv[0], '/') == NULL) {
+        fprintf(stderr, "%s: command not found\n", stage->argv[0]);
+        return -1;
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", stage->argv[0], strerror(err));
+        return -1;
+    }
+    // The zygote's clone may not have moved yet; whichever of us is first
+    // wins, and the other's call fails harmlessly
+    if (pgid != PGID_SHELL) setpgid(pid, pgid > 0 ? pgid : pid);
+    return pid;
+}
+
+// Writes words separated by spaces, showing a pending $ or process
+// substitution as it was typed
+static void describe_words(FILE* fp, char** words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (i > 0) fputc(' ', fp);
+        if (*words[i] == PROCSUB_IN || *words[i] == PROCSUB_OUT) {
+            fprintf(fp, "%c(%s)", *words[i] == PROCSUB_IN ? '<' : '>', words[i] + 1);
+            continue;
+        }
+        for (char* cp = words[i]; *cp; cp++)
+            fputc(*cp == VAR_MARK || *cp == VAR_MARK_QUOTED ? '$' : *cp, fp);
+    }
+}
+
+static void describe_redirects(FILE* fp, Redirect* redirs) {
+    for (Redirect* r = redirs; r != NULL; r = r->next) {
+        int default_fd = r->type == REDIR_OUT || r->type == REDIR_APPEND || (r->type == REDIR_DUP && r->fd != 0) ? 1 : 0;
+        fputc(' ', fp);
+        if (r->fd != default_fd) fprintf(fp, "%d", r->fd);
+        switch (r->type) {
+            case REDIR_IN: fputs("< ", fp); break;
+            case REDIR_OUT: fputs("> ", fp); break;
+            case REDIR_APPEND: fputs(">> ", fp); break;
+            case REDIR_DUP: fputs(r->fd == 0 ? "<&" : ">&", fp); break;
+            case REDIR_HEREDOC: fputs("<< (here-document)", fp); continue;
+            case REDIR_HERESTRING: fputs("<<< ", fp); break;
+        }
+        char* target[] = {r->target, NULL};
+        describe_words(fp, target);
+    }
+}
+
+// Writes a parsed command back out as text, for the job table
+void describe_node(FILE* fp, Node* node) {
+    switch (node->type) {
+        case NODE_COMMAND:
+            describe_words(fp, node->assigns);
+            if (node->assigns[0] != NULL && node->argv[0] != NULL) fputc(' ', fp);
+            describe_words(fp, node->argv);
+            describe_redirects(fp, node->redirs);
+            break;
+        case NODE_PIPELINE:
+            if (node->timed) fputs("time ", fp);
+            for (int i = 0; i < node->nstages; i++) {
+                if (i > 0) fputs(" | ", fp);
+                describe_node(fp, node->stages[i]);
+            }
+            break;
+        case NODE_AND:
+        case NODE_OR:
+        case NODE_LIST:
+            describe_node(fp, node->left);
+            fputs(node->type == NODE_AND ? " && " : node->type == NODE_OR ? " || " : "; ", fp);
+            describe_node(fp, node->right);
+            break;
+        case NODE_BACKGROUND:
+            describe_node(fp, node->left);
+            fputs(" &", fp);
+            break;
+        case NODE_IF: {
+            Node* branch = node;
+            fputs("if ", fp);
+            for (;;) {
+                describe_node(fp, branch->left);
+                fputs("; then ", fp);
+                describe_node(fp, branch->right);
+                if (branch->next == NULL || branch->next->type != NODE_IF) break;
+                branch = branch->next;
+                fputs("; elif ", fp);
+            }
+            if (branch->next != NULL) {
+                fputs("; else ", fp);
+                describe_node(fp, branch->next);
+            }
+            fputs("; fi", fp);
+            break;
+        }
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            fputs(node->type == NODE_WHILE ? "while " : "until ", fp);
+            describe_node(fp, node->left);
+            fputs("; do ", fp);
+            describe_node(fp, node->right);
+            fputs("; done", fp);
+            break;
+        case NODE_FOR:
+            fprintf(fp, "for %s", node->name);
+            if (node->argv != NULL) {
+                fputs(" in ", fp);
+                describe_words(fp, node->argv);
+            }
+            fputs("; do ", fp);
+            describe_node(fp, node->right);
+            fputs("; done", fp);
+            break;
+        case NODE_CASE:
+            fputs("case ", fp);
+            describe_words(fp, node->argv);
+            fputs(" in", fp);
+            for (Node* item = node->next; item != NULL; item = item->next) {
+                for (int i = 0; item->argv[i] != NULL; i++) {
+                    char* pattern[] = {item->argv[i], NULL};
+                    fputc(i > 0 ? '|' : ' ', fp);
+                    describe_words(fp, pattern);
+                }
+                fputs(") ", fp);
+                if (item->left != NULL) describe_node(fp, item->left);
+                fputs(";;", fp);
+            }
+            fputs(" esac", fp);
+            break;
+        case NODE_GROUP:
+            fputs("{ ", fp);
+            describe_node(fp, node->left);
+            fputs("; }", fp);
+            break;
+        case NODE_SUBSHELL:
+            fputc('(', fp);
+            describe_node(fp, node->left);
+            fputc(')', fp);
+            break;
+        case NODE_FUNCTION:
+            fprintf(fp, "%s() ", node->name);
+            describe_node(fp, node->left);
+            break;
+    }
+    // A compound command's own redirections follow it
+    if (node->type >= NODE_IF) describe_redirects(fp, node->redirs);
+}
+
+// Rebuilds a readable command line from expanded stages, for the job
+// table; the caller frees it
+static char* describe_pipeline(Stage* stages, int nstages) {
+    char* text;
+    size_t len;
+    FILE* fp = open_memstream(&text, &len);
+    for (int i = 0; i < nstages; i++) {
+        if (i > 0) fputs(" | ", fp);
+        describe_words(fp, stages[i].argv);
+        describe_redirects(fp, stages[i].redirs);
+    }
+    fclose(fp);
+    return text;
+}
+
+// Current reading of clock in seconds
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Exit status of a waited-for child, 128 + the signal if it was killed
+static int exit_status(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Marks a stage as launched now. With before, the shell's own usage is
+// also taken, for a stage the shell runs itself.
+static void stage_started(AcctRecord* rec, double* launched, struct rusage* before) {
+    rec->start = clock_seconds(CLOCK_REALTIME);
+    *launched = clock_seconds(CLOCK_MONOTONIC);
+    if (before != NULL) getrusage(RUSAGE_SELF, before);
+}
+
+// Fills in a record from the rusage wait4() returned for a child
+static void usage_from_child(AcctRecord* rec, struct rusage* ru) {
+    rec->user = timeval_seconds(ru->ru_utime);
+    rec->sys = timeval_seconds(ru->ru_stime);
+    rec->maxrss = ru->ru_maxrss;
+    rec->nvcsw = ru->ru_nvcsw;
+    rec->nivcsw = ru->ru_nivcsw;
+}
+
+// Fills in a record for a stage the shell ran itself: what the shell used
+// since before, and the shell's own peak RSS
+static void usage_from_self(AcctRecord* rec, struct rusage* before, double launched) {
+    struct rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    rec->real = clock_seconds(CLOCK_MONOTONIC) - launched;
+    rec->user = timeval_seconds(now.ru_utime) - timeval_seconds(before->ru_utime);
+    rec->sys = timeval_seconds(now.ru_stime) - timeval_seconds(before->ru_stime);
+    rec->maxrss = now.ru_maxrss;
+    rec->nvcsw = now.ru_nvcsw - before->ru_nvcsw;
+    rec->nivcsw = now.ru_nivcsw - before->ru_nivcsw;
+}
+
+// Sets a record's command from argv, cut short if it does not fit
+void acct_set_command(AcctRecord* rec, char** argv) {
+    size_t len = 0;
+    rec->command[0] = '\0';
+    for (int i = 0; argv[i] != NULL && len < ACCT_CMD_LEN - 1; i++) {
+        int n = snprintf(rec->command + len, ACCT_CMD_LEN - len, "%s%s", i > 0 ? " " : "", argv[i]);
+        if (n < 0) break;
+        len += n;
+    }
+}
+
+// Copies a record into the ring, over the oldest one once it is full
+void acct_add(AcctRecord* rec) {
+    acct_ring[acct_total++ % ACCT_RING] = *rec;
+}
+
+// Prints seconds the way "time" does, as 0m0.000s
+static void print_duration(const char* label, double secs) {
+    fprintf(stderr, "%-7s %dm%.3fs\n", label, (int)(secs / 60), secs - 60 * (int)(secs / 60));
+}
+
+// Adds the launched stages of a measured pipeline to the ring. For "time"
+// the totals go to stderr, followed by one line per stage of a pipeline.
+void record_usage(AcctRecord* usage, int nstages, int timed) {
+    double first = 0, end = 0, user = 0, sys = 0;
+    long maxrss = 0, nvcsw = 0, nivcsw = 0;
+
+    for (int i = 0; i < nstages; i++) {
+        AcctRecord* rec = &usage[i];
+        if (rec->start == 0) continue;
+        acct_add(rec);
+        if (first == 0 || rec->start < first) first = rec->start;
+        if (rec->start + rec->real > end) end = rec->start + rec->real;
+        user += rec->user;
+        sys += rec->sys;
+        if (rec->maxrss > maxrss) maxrss = rec->maxrss;
+        nvcsw += rec->nvcsw;
+        nivcsw += rec->nivcsw;
+    }
+    if (!timed) return;
+
+    fflush(stdout);
+    fputc('\n', stderr);
+    print_duration("real", end - first);
+    print_duration("user", user);
+    print_duration("sys", sys);
+    fprintf(stderr, "maxrss  %ld KB\n", maxrss);
+    fprintf(stderr, "ctxsw   %ld voluntary, %ld involuntary\n", nvcsw, nivcsw);
+    if (nstages == 1) return;
+    for (int i = 0; i < nstages; i++) {
+        AcctRecord* rec = &usage[i];
+        if (rec->start == 0) continue;
+        fprintf(stderr, "  [%d] real %.3fs user %.3fs sys %.3fs maxrss %ld KB status %d  %s\n",
+                i + 1, rec->real, rec->user, rec->sys, rec->maxrss, rec->status, rec->command);
+    }
+}
+
+// Writes a string as a JSON string literal
+static void json_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// Writes the ring oldest first, as a table or in CSV or JSON format
+void acct_dump(FILE* fp, int format) {
+    unsigned long first = acct_total > ACCT_RING ? acct_total - ACCT_RING : 0;
+
+    if (format == ACCT_CSV)
+        fprintf(fp, "seq,stage,start,real,user,sys,maxrss_kb,nvcsw,nivcsw,status,command\n");
+    else if (format == ACCT_JSON)
+        fprintf(fp, "[");
+    else
+        fprintf(fp, "%6s %5s %9s %9s %9s %10s %6s %6s %6s  %s\n", "SEQ", "STAGE", "REAL", "USER", "SYS",
+                "MAXRSS_KB", "VCSW", "IVCSW", "STATUS", "COMMAND");
+
+    for (unsigned long n = first; n < acct_total; n++) {
+        AcctRecord* rec = &acct_ring[n % ACCT_RING];
+        if (format == ACCT_CSV) {
+            fprintf(fp, "%lu,%d,%.6f,%.6f,%.6f,%.6f,%ld,%ld,%ld,%d,\"", rec->seq, rec->stage, rec->start,
+                    rec->real, rec->user, rec->sys, rec->maxrss, rec->nvcsw, rec->nivcsw, rec->status);
+            for (char* cp = rec->command; *cp; cp++) {
+                if (*cp == '"') fputc('"', fp);
+                fputc(*cp, fp);
+            }
+            fprintf(fp, "\"\n");
+        } else if (format == ACCT_JSON) {
+            fprintf(fp, "%s\n{\"seq\":%lu,\"stage\":%d,\"start\":%.6f,\"real\":%.6f,\"user\":%.6f,"
+                    "\"sys\":%.6f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"status\":%d,\"command\":",
+                    n > first ? "," : "", rec->seq, rec->stage, rec->start, rec->real, rec->user, rec->sys,
+                    rec->maxrss, rec->nvcsw, rec->nivcsw, rec->status);
+            json_string(fp, rec->command);
+            fputc('}', fp);
+        } else {
+            fprintf(fp, "%6lu %5d %9.3f %9.3f %9.3f %10ld %6ld %6ld %6d  %s\n", rec->seq, rec->stage + 1,
+                    rec->real, rec->user, rec->sys, rec->maxrss, rec->nvcsw, rec->nivcsw, rec->status,
+                    rec->command);
+        }
+    }
+    if (format == ACCT_JSON) fprintf(fp, "\n]\n");
+}
+
+// Writes the ring to the file named by PUCIT_ACCT when the shell exits.
+// Forked children that call exit() leave it alone.
+static void acct_at_exit() {
+    if (getpid() != acct_owner) return;
+    const char* path = getenv("PUCIT_ACCT");
+    FILE* fp = path != NULL ? fopen(path, "w") : NULL;
+    if (fp == NULL) return;
+    size_t len = strlen(path);
+    acct_dump(fp, len > 5 && strcmp(path + len - 5, ".json") == 0 ? ACCT_JSON : ACCT_CSV);
+    fclose(fp);
+}
+
+// Turns accounting on from the start when PUCIT_ACCT names a file
+void init_acct() {
+    const char* path = getenv("PUCIT_ACCT");
+    if (path == NULL || *path == '\0') return;
+    acct_enabled = 1;
+    acct_owner = getpid();
+    atexit(acct_at_exit);
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds, for phase timing
+uint64_t stat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Histogram bucket of a latency in ns: the power of two it falls in,
+// split into 1 << STAT_SUB_BITS linear sub-buckets, so every bucket is
+// within 12.5% of the values it holds
+static int stat_bucket(uint64_t ns) {
+    if (ns < (1 << STAT_SUB_BITS)) return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    return ((exp - STAT_SUB_BITS + 1) << STAT_SUB_BITS) + ((ns >> (exp - STAT_SUB_BITS)) & ((1 << STAT_SUB_BITS) - 1));
+}
+
+// Smallest latency that lands in bucket
+static uint64_t stat_bucket_floor(int bucket) {
+    if (bucket < (1 << STAT_SUB_BITS)) return bucket;
+    int exp = (bucket >> STAT_SUB_BITS) + STAT_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << STAT_SUB_BITS) - 1);
+    return ((uint64_t)1 << exp) + (sub << (exp - STAT_SUB_BITS));
+}
+
+// Ends a phase that began at start: adds its latency to the phase's
+// histogram and, while tracing, logs it as an event with detail (which may
+// be NULL). Returns the end time so a following phase can start from it.
+uint64_t stat_record(int phase, uint64_t start, const char* detail) {
+    uint64_t end = stat_now();
+    uint64_t ns = end - start;
+    PhaseStats* ps = &phase_stats[phase];
+    if (ps->count == 0 || ns < ps->min) ps->min = ns;
+    if (ns > ps->max) ps->max = ns;
+    ps->count++;
+    ps->total += ns;
+    ps->buckets[stat_bucket(ns)]++;
+
+    if (trace_path == NULL) return end;
+    if (trace_count == trace_cap) {
+        if (trace_cap == TRACE_MAX_EVENTS) {
+            trace_dropped++;
+            return end;
+        }
+        size_t cap = trace_cap ? trace_cap * 2 : 1024;
+        TraceEvent* bigger = (TraceEvent*)realloc(trace_events, sizeof(TraceEvent) * cap);
+        if (bigger == NULL) {
+            trace_dropped++;
+            return end;
+        }
+        trace_events = bigger;
+        trace_cap = cap;
+    }
+    TraceEvent* ev = &trace_events[trace_count++];
+    ev->phase = phase;
+    ev->start = start;
+    ev->dur = ns;
+    snprintf(ev->detail, sizeof(ev->detail), "%s", detail != NULL ? detail : "");
+    return end;
+}
+
+// Latency at or below which a fraction q of a phase's samples fall,
+// to histogram resolution
+static uint64_t stat_percentile(PhaseStats* ps, double q) {
+    uint64_t want = (uint64_t)(q * ps->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += ps->buckets[b];
+        if (seen >= want) return stat_bucket_floor(b);
+    }
+    return ps->max;
+}
+
+// Prints a latency in ns with a unit that keeps it short
+static void print_latency(uint64_t ns) {
+    if (ns < 10000) printf(" %8luns", (unsigned long)ns);
+    else if (ns < 10000000) printf(" %8.1fus", ns / 1e3);
+    else printf(" %8.1fms", ns / 1e6);
+}
+
+// Prints every phase's count, total and latency percentiles
+void print_shellstat() {
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "PHASE", "COUNT", "TOTAL", "MEAN", "P50", "P90",
+           "P99", "MAX");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        PhaseStats* ps = &phase_stats[p];
+        printf("%-8s %10lu", phase_names[p], (unsigned long)ps->count);
+        print_latency(ps->total);
+        print_latency(ps->count ? ps->total / ps->count : 0);
+        print_latency(ps->count ? stat_percentile(ps, 0.50) : 0);
+        print_latency(ps->count ? stat_percentile(ps, 0.90) : 0);
+        print_latency(ps->count ? stat_percentile(ps, 0.99) : 0);
+        print_latency(ps->max);
+        printf("\n");
+    }
+    if (trace_path != NULL)
+        printf("Tracing to %s: %zu event(s), %lu dropped\n", trace_path, trace_count, trace_dropped);
+}
+
+// Writes the buffered events as Chrome trace-event JSON (complete "X"
+// events, microsecond timestamps), loadable in chrome://tracing or
+// Perfetto, and stops tracing
+int write_trace() {
+    if (trace_path == NULL) return 0;
+    FILE* fp = fopen(trace_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "shellstat: %s: %s\n", trace_path, strerror(errno));
+    } else {
+        int pid = getpid();
+        fprintf(fp, "{\"traceEvents\":[");
+        for (size_t i = 0; i < trace_count; i++) {
+            TraceEvent* ev = &trace_events[i];
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":", i > 0 ? "," : "", phase_names[ev->phase],
+                    ev->start / 1e3, ev->dur / 1e3, pid, pid);
+            json_string(fp, ev->detail);
+            fprintf(fp, "}}");
+        }
+        fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%lu}}\n", trace_dropped);
+        fclose(fp);
+    }
+    free(trace_path);
+    free(trace_events);
+    trace_path = NULL;
+    trace_events = NULL;
+    trace_count = trace_cap = 0;
+    trace_dropped = 0;
+    return fp != NULL ? 0 : 1;
+}
+
+// Flushes an unfinished trace when the shell exits; forked children that
+// call exit() leave it alone
+static void trace_at_exit() {
+    if (getpid() == trace_owner) write_trace();
+}
+
+// Starts buffering trace events for path, replacing any trace in progress
+void start_trace(const char* path) {
+    write_trace();
+    trace_path = strdup(path);
+    if (trace_owner == 0) atexit(trace_at_exit);
+    trace_owner = getpid();
+}
+
+// Waits for the first n stages, storing each one's raw status and, with
+// usage, its resource usage. Each stage is watched by a pidfd and reaped
+// by its own pid, so nothing else is collected by accident; background
+// children that exit meanwhile are passed on to the job table. Without
+// pidfds the stages are waited for one at a time. Under job control the
+// wait ends early if a stage stops, returning 1: the pids of the stages
+// reaped by then are cleared, and the rest are left for a job.
+static int wait_stages(pid_t* pids, int n, int* statuses, AcctRecord* usage, double* launched) {
+    ForegroundWait fg = {pids, NULL, statuses, usage, launched, 0, 0};
+    struct rusage ru;
+
+    fg.pidfds = (int*)arena_alloc(&cmd_arena, sizeof(int) * n);
+    for (int i = 0; i < n; i++) fg.pidfds[i] = -1;
+    for (int i = 0; i < n && !fg.stopped; i++) {
+        if (pids[i] <= 0) continue;
+        if (use_pidfds && (fg.pidfds[i] = watch_pid(pids[i], EV_FOREGROUND | i)) != -1) {
+            fg.left++;
+            continue;
+        }
+        // Not watchable: block on this stage alone
+        while (wait4(pids[i], &statuses[i], job_control ? WUNTRACED : 0, &ru) == -1 && errno == EINTR) {}
+        if (WIFSTOPPED(statuses[i])) {
+            fg.stopped = 1;
+            break;
+        }
+        pids[i] = -pids[i];
+        if (usage != NULL) {
+            usage_from_child(&usage[i], &ru);
+            usage[i].real = clock_seconds(CLOCK_MONOTONIC) - launched[i];
+            usage[i].status = exit_status(statuses[i]);
+        }
+    }
+    while (fg.left > 0 && !fg.stopped) child_events(-1, &fg);
+
+    // Reaped stages were marked by negating their pids
+    for (int i = 0; i < n; i++) {
+        if (fg.pidfds[i] != -1) close(fg.pidfds[i]);
+        if (pids[i] < 0) pids[i] = fg.stopped ? 0 : -pids[i];
+    }
+    return fg.stopped;
+}
+
+// Execs a stage's command in a forked child, as spawn_stage() would launch
+// it, for a stage that has to be forked; reports failure and exits 127
+static void exec_stage(Stage* stage) {
+    // Default signal handling and no blocked signals, as spawn_stage() gives
+    int defaults[] = {SIGINT, SIGQUIT, SIGCHLD, SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU};
+    sigset_t mask;
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) signal(defaults[i], SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    char** env = command_env(stage->assigns);
+    char* path = find_command(stage->argv[0]);
+    if (path != NULL) {
+        execve(path, stage->argv, env);
+        if (errno == ENOEXEC) {
+            int argc = 0;
+            while (stage->argv[argc] != NULL) argc++;
+            char** sh_argv = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (argc + 2));
+            sh_argv[0] = "/bin/sh";
+            sh_argv[1] = path;
+            memcpy(sh_argv + 2, stage->argv + 1, sizeof(char*) * argc);
+            execve("/bin/sh", sh_argv, env);
+        }
+        fprintf(stderr, "%s: %s\n", stage->argv[0], strerror(errno));
+    } else {
+        fprintf(stderr, "%s: command not found\n", stage->argv[0]);
+    }
+    _exit(127);
+}
+
+// Writes value to a file of the cgroup directory dir; -1 with errno set
+// if it cannot
+static int write_cgroup_file(const char* dir, const char* file, const char* value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t len = strlen(value), written = write(fd, value, len);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return written == len ? 0 : -1;
+}
+
+// Reads a file of the cgroup directory dir into buf; -1 if it is missing
+static int read_cgroup_file(const char* dir, const char* file, char* buf, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+// The number after key in cgroup file text made of "key value" or
+// "key=value" fields, or -1. The first match wins, so "avg10" in a
+// pressure file is that of its "some" line.
+static double cgroup_field(const char* text, const char* key) {
+    size_t len = strlen(key);
+    for (const char* p = strstr(text, key); p != NULL; p = strstr(p + 1, key)) {
+        if ((p == text || isspace((unsigned char)p[-1])) && (p[len] == ' ' || p[len] == '='))
+            return strtod(p + len + 1, NULL);
+    }
+    return -1;
+}
+
+// Finds the shell's own cgroup: the cgroup2 mount point from mountinfo
+// plus the "0::" path from /proc/self/cgroup. Returns a malloc'd path, or
+// NULL with no cgroup v2 hierarchy mounted. *is_root is set for the root
+// cgroup, which may hold processes and still delegate controllers.
+static char* own_cgroup(int* is_root) {
+    char line[PATH_MAX + 256], mount[PATH_MAX + 256] = "", path[PATH_MAX + 256] = "";
+    FILE* fp = fopen("/proc/self/mountinfo", "r");
+    if (fp == NULL) return NULL;
+    // Fields: id parent major:minor root mount-point options... - type source
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, " - cgroup2 ") != NULL && sscanf(line, "%*s %*s %*s %*s %s", mount) == 1) break;
+        mount[0] = '\0';
+    }
+    fclose(fp);
+    if (mount[0] == '\0' || (fp = fopen("/proc/self/cgroup", "r")) == NULL) return NULL;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            strcpy(path, line + 3);
+            break;
+        }
+    }
+    fclose(fp);
+
+    *is_root = path[0] == '\0' || strcmp(path, "/") == 0;
+    char* dir = (char*)malloc(strlen(mount) + strlen(path) + 1);
+    if (dir != NULL) sprintf(dir, "%s%s", mount, *is_root ? "" : path);
+    return dir;
+}
+
+// Removes the cgroup of the last foreground "run" when the shell exits
+static void release_cgroups() {
+    if (last_run_cgroup != NULL && getpid() == cgroup_owner) rmdir(last_run_cgroup);
+}
+
+// Readies the directory run's cgroups are made in, once: PUCIT_CGROUP or
+// the shell's own cgroup. cgroup v2 only lets a cgroup without processes
+// of its own hand controllers to its children, so the shell and its
+// zygote first move from their cgroup into a leaf, pucit-PID-shell. If
+// cpu or memory still cannot be enabled, that is reported when a limit
+// needs it.
+static int setup_cgroups() {
+    if (cgroup_base != NULL) return 0;
+    const char* dir = getenv("PUCIT_CGROUP");
+    int is_root = 1;
+    char* base = dir != NULL && *dir != '\0' ? strdup(dir) : own_cgroup(&is_root);
+    if (base == NULL) {
+        fprintf(stderr, "run: no cgroup v2 hierarchy is mounted\n");
+        return -1;
+    }
+
+    if (!is_root) {
+        char leaf[PATH_MAX], pid[32];
+        snprintf(leaf, sizeof(leaf), "%s/pucit-%d-shell", base, (int)getpid());
+        if (mkdir(leaf, 0755) == 0 || errno == EEXIST) {
+            snprintf(pid, sizeof(pid), "%d", (int)getpid());
+            write_cgroup_file(leaf, "cgroup.procs", pid);
+            if (zygote_pid > 0) {
+                snprintf(pid, sizeof(pid), "%d", (int)zygote_pid);
+                write_cgroup_file(leaf, "cgroup.procs", pid);
+            }
+        }
+    }
+    cgroup_enable_errno = 0;
+    if (write_cgroup_file(base, "cgroup.subtree_control", "+cpu") == -1) cgroup_enable_errno = errno;
+    if (write_cgroup_file(base, "cgroup.subtree_control", "+memory") == -1) cgroup_enable_errno = errno;
+    cgroup_base = base;
+    cgroup_owner = getpid();
+    atexit(release_cgroups);
+    return 0;
+}
+
+// Creates the cgroup for one pipeline under "run", pucit-PID-N, with the
+// given limits. Returns an open descriptor for its directory, for children
+// to join it by, and its path in *path; -1 after reporting a failure.
+static int make_job_cgroup(const RunLimits* limits, char** path) {
+    char dir[PATH_MAX], value[64];
+    const char* controller = NULL;
+
+    if (setup_cgroups() == -1) return -1;
+    snprintf(dir, sizeof(dir), "%s/pucit-%d-%lu", cgroup_base, (int)getpid(), ++cgroup_seq);
+    if (mkdir(dir, 0755) == -1) {
+        fprintf(stderr, "run: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (limits->cpu_percent > 0) {
+        snprintf(value, sizeof(value), "%ld %d", limits->cpu_percent * CGROUP_CPU_PERIOD / 100, CGROUP_CPU_PERIOD);
+        if (write_cgroup_file(dir, "cpu.max", value) == -1) controller = "cpu";
+    }
+    if (controller == NULL && limits->mem_bytes > 0) {
+        snprintf(value, sizeof(value), "%lld", limits->mem_bytes);
+        if (write_cgroup_file(dir, "memory.max", value) == -1) controller = "memory";
+    }
+    int fd = controller == NULL ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (fd == -1) {
+        // A limit file missing means the controller is not enabled above it
+        int err = errno;
+        if (controller != NULL && err == ENOENT)
+            fprintf(stderr, "run: the %s controller is not available in %s%s%s\n", controller, cgroup_base,
+                    cgroup_enable_errno ? ": " : "", cgroup_enable_errno ? strerror(cgroup_enable_errno) : "");
+        else
+            fprintf(stderr, "run: cannot set up %s: %s\n", dir, strerror(err));
+        fprintf(stderr, "run: set PUCIT_CGROUP to a cgroup v2 directory delegated to this user\n");
+        rmdir(dir);
+        return -1;
+    }
+    *path = strdup(dir);
+    return fd;
+}
+
+// Moves the calling process into the cgroup whose directory fd is open
+static int join_cgroup(int dir_fd) {
+    int fd = openat(dir_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    int ok = write(fd, "0", 1) == 1;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Reads run's options into limits. Returns the index of the command word,
+// or -1 after reporting bad usage.
+static int run_options(char** argv, RunLimits* limits) {
+    limits->cpu_percent = 0;
+    limits->mem_bytes = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        char* end = NULL;
+        if (strcmp(argv[i], "--") == 0) {
+            if (argv[i + 1] != NULL) return i + 1;
+        } else if (argv[i][0] != '-') {
+            return i;
+        } else if (strcmp(argv[i], "--cpu") == 0 && argv[i + 1] != NULL) {
+            limits->cpu_percent = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || limits->cpu_percent <= 0 || limits->cpu_percent > 100000) end = NULL;
+        } else if (strcmp(argv[i], "--mem") == 0 && argv[i + 1] != NULL) {
+            limits->mem_bytes = strtoll(argv[++i], &end, 10);
+            switch (toupper((unsigned char)*end)) {
+            case 'G': limits->mem_bytes <<= 10; // fall through
+            case 'M': limits->mem_bytes <<= 10; // fall through
+            case 'K': limits->mem_bytes <<= 10; end++;
+            }
+            if (*end != '\0' || limits->mem_bytes <= 0) end = NULL;
+        }
+        if (end == NULL) break;
+    }
+    fprintf(stderr, "usage: run [--cpu PERCENT] [--mem SIZE[K|M|G]] command [args]\n");
+    return -1;
+}
+
+// Gives a pipeline's cgroup to its job, or keeps it as the last foreground
+// run's, for cgstat, until the next one finishes. A forked copy of the
+// shell has no one to show it to.
+static void keep_cgroup(Job* job, char* cgroup) {
+    if (cgroup == NULL) return;
+    if (job != NULL) {
+        job->cgroup = cgroup;
+        return;
+    }
+    if (forked_copy) {
+        rmdir(cgroup);
+        free(cgroup);
+        return;
+    }
+    if (last_run_cgroup != NULL) {
+        rmdir(last_run_cgroup);
+        free(last_run_cgroup);
+    }
+    last_run_cgroup = cgroup;
+}
+
+// Reads a kernel CPU or node list like "0-3,8-11" from path into set;
+// -1 if it cannot be read
+static int read_cpulist(const char* path, cpu_set_t* set) {
+    char text[4096];
+    CPU_ZERO(set);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    text[n] = '\0';
+    for (char* p = text; *p != '\0' && *p != '\n';) {
+        char* end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Learns the CPUs placement hands out: the shell's own, grouped by NUMA
+// node, so CPUs next to each other in affinity_cpus share a node and its
+// caches. Without NUMA information in sysfs all of them form one node.
+static void init_affinity() {
+    cpu_set_t allowed, nodes, node_cpus;
+    char path[64];
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    affinity_ncpus = affinity_nnodes = 0;
+    if (read_cpulist("/sys/devices/system/node/online", &nodes) == -1) CPU_ZERO(&nodes);
+    for (int node = 0; node < CPU_SETSIZE && affinity_nnodes < AFFINITY_MAX_NODES - 1; node++) {
+        if (!CPU_ISSET(node, &nodes)) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_cpulist(path, &node_cpus) == -1) continue;
+        CPU_AND(&node_cpus, &node_cpus, &allowed);
+        if (CPU_COUNT(&node_cpus) == 0) continue;
+        affinity_nodes[affinity_nnodes++] = node_cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &node_cpus)) affinity_cpus[affinity_ncpus++] = cpu;
+        CPU_XOR(&allowed, &allowed, &node_cpus);
+    }
+    // CPUs no node claimed, or all of them without NUMA information or
+    // beyond the nodes kept
+    if (CPU_COUNT(&allowed) > 0) {
+        affinity_nodes[affinity_nnodes++] = allowed;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed)) affinity_cpus[affinity_ncpus++] = cpu;
+    }
+    affinity_next_cpu = affinity_next_node = 0;
+}
+
+// Picks the NUMA node for the next job or parallel worker under numa
+// placement, round-robin; -1 when placement is not by node
+static int next_affinity_node() {
+    if (affinity_mode != AFFINITY_NUMA || affinity_nnodes == 0) return -1;
+    int node = affinity_next_node;
+    affinity_next_node = (affinity_next_node + 1) % affinity_nnodes;
+    return node;
+}
+
+// Pins a launched process where placement puts it: under rr on the next
+// CPU in turn, so a pipeline's stages land on neighbouring CPUs, and
+// under numa on every CPU of node. The parent sets it just after the
+// launch, which works the same for spawned, forked and zygote children;
+// at worst a child's first instructions run elsewhere.
+static void place_process(pid_t pid, int node) {
+    cpu_set_t set;
+    if (pid <= 0 || affinity_mode == AFFINITY_OFF || affinity_ncpus == 0) return;
+    if (affinity_mode == AFFINITY_NUMA) {
+        set = affinity_nodes[node];
+    } else {
+        CPU_ZERO(&set);
+        CPU_SET(affinity_cpus[affinity_next_cpu], &set);
+        affinity_next_cpu = (affinity_next_cpu + 1) % affinity_ncpus;
+    }
+    sched_setaffinity(pid, sizeof(set), &set);
+}
+
+// Executes a pipeline of any number of stages, handling background jobs.
+// Under "time", or with accounting on, every foreground stage's resource
+// usage is recorded; "time" also prints it.
+int execute(Stage* stages, int nstages, int is_background, int timed) {
+    AcctRecord* usage = NULL;
+    double* launched = NULL;
+    struct rusage self_before;
+    RunLimits run_limits, *limits = NULL;
+    char* cgroup = NULL;
+
+    // "run [options]" leading a pipeline puts all of it in a cgroup of its
+    // own, as "time" times all of it
+    Builtin* builtin = stage_builtin(&stages[0]);
+    if (builtin != NULL && builtin->fn == builtin_run) {
+        int first = run_options(stages[0].argv, &run_limits);
+        if (first == -1) return 2;
+        stages[0].argv += first;
+        stages[0].function = find_function(stages[0].argv[0]);
+        limits = &run_limits;
+    }
+
+    if (!is_background && (timed || acct_enabled)) {
+        usage = (AcctRecord*)arena_alloc(&cmd_arena, sizeof(AcctRecord) * nstages);
+        launched = (double*)arena_alloc(&cmd_arena, sizeof(double) * nstages);
+        memset(usage, 0, sizeof(AcctRecord) * nstages);
+        acct_seq++;
+        for (int i = 0; i < nstages; i++) {
+            usage[i].seq = acct_seq;
+            usage[i].stage = i;
+            acct_set_command(&usage[i], stages[i].argv);
+        }
+    }
+
+    // A lone foreground builtin, function call or compound command runs in
+    // the shell without a fork; a subshell always forks. Only builtins are
+    // timed as a phase, since the others run whole commands of their own.
+    builtin = stage_builtin(&stages[0]);
+    int in_shell = builtin != NULL || stages[0].function != NULL ||
+                   (stages[0].compound != NULL && stages[0].compound->type != NODE_SUBSHELL);
+    if (nstages == 1 && !is_background && in_shell && limits == NULL) {
+        uint64_t started = stat_now();
+        if (usage == NULL) {
+            int result = run_builtin(builtin, &stages[0]);
+            if (builtin != NULL) stat_record(PHASE_BUILTIN, started, builtin->name);
+            return result;
+        }
+        stage_started(&usage[0], &launched[0], &self_before);
+        int result = run_builtin(builtin, &stages[0]);
+        if (builtin != NULL) stat_record(PHASE_BUILTIN, started, builtin->name);
+        usage_from_self(&usage[0], &self_before, launched[0]);
+        usage[0].status = result;
+        record_usage(usage, nstages, timed);
+        return result;
+    }
+
+    pid_t* pids = (pid_t*)arena_alloc(&cmd_arena, sizeof(pid_t) * nstages);
+    int* statuses = (int*)arena_alloc(&cmd_arena, sizeof(int) * nstages);
+    memset(pids, 0, sizeof(pid_t) * nstages);
+    memset(statuses, 0, sizeof(int) * nstages);
+
+    // A trailing cat/tee is run by the shell itself so its data never
+    // passes through user space; it needs the shell, so not for "&". Under
+    // job control it runs in a forked copy in the pipeline's group, so ^Z
+    // stops it with the rest and the copy still moves the data in-kernel.
+    int in_process = !is_background && limits == NULL && is_data_stage(&stages[nstages - 1]);
+    int data_forked = in_process && job_control;
+    if (data_forked) in_process = 0;
+    int nspawn = in_process ? nstages - 1 : nstages;
+    // Under job control the first stage leads a new process group, which
+    // the others join and which gets the terminal unless it is a job
+    pid_t pgid = job_control ? PGID_NEW : PGID_SHELL;
+    // posix_spawn() cannot start a child in a cgroup, so under "run" every
+    // stage is forked and joins the cgroup itself before it execs
+    if (limits != NULL && (launch_cgroup = make_job_cgroup(limits, &cgroup)) == -1) return 1;
+    // A background job's stages are pinned where placement puts them
+    int node = is_background ? next_affinity_node() : -1;
+
+    // Children write straight to the fds, so earlier builtin output must go first
+    fflush(stdout);
+
+    int prev_read = -1;
+    for (int i = 0; i < nspawn; i++) {
+        launch_status = 127;
+        int pipe_fd[2] = {-1, -1};
+        if (i < nstages - 1 && pipe2(pipe_fd, O_CLOEXEC) == -1) {
+            perror("Pipe failed");
+            pids[i] = -1;
+            break;
+        }
+
+        if (usage != NULL) stage_started(&usage[i], &launched[i], NULL);
+        uint64_t started = stat_now();
+        builtin = stage_builtin(&stages[i]);
+        pid_t group = pgid == PGID_NEW && !is_background ? PGID_NEW_FG : pgid;
+        if (data_forked && i == nstages - 1)
+            pids[i] = fork_data_stage(&stages[i], prev_read, group);
+        else if (launch_cgroup != -1 || builtin != NULL || stages[i].compound != NULL || stages[i].function != NULL)
+            pids[i] = fork_builtin(builtin, &stages[i], prev_read, pipe_fd[1], pipe_fd[0], group);
+        else
+            pids[i] = spawn_stage(&stages[i], prev_read, pipe_fd[1], group);
+        stat_record(PHASE_SPAWN, started, stages[i].argv[0]);
+        if (is_background) place_process(pids[i], node);
+        if (pgid == PGID_NEW && pids[i] > 0) {
+            pgid = pids[i];
+            if (!is_background) tcsetpgrp(tty_fd, pgid);
+        }
+        if (usage != NULL && pids[i] <= 0) usage[i].start = 0;
+
+        // The parent keeps no pipe ends once a stage owns them
+        if (prev_read != -1) close(prev_read);
+        if (pipe_fd[1] != -1) close(pipe_fd[1]);
+        prev_read = pipe_fd[0];
+    }
+    if (launch_cgroup != -1) {
+        close(launch_cgroup);
+        launch_cgroup = -1;
+    }
+    int data_status = 0;
+    if (in_process) {
+        int last = nstages - 1;
+        if (usage != NULL) stage_started(&usage[last], &launched[last], &self_before);
+        uint64_t started = stat_now();
+        data_status = run_data_stage(&stages[last], prev_read);
+        stat_record(PHASE_DATA, started, stages[last].argv[0]);
+        if (usage != NULL) {
+            usage_from_self(&usage[last], &self_before, launched[last]);
+            usage[last].status = data_status;
+        }
+    }
+    if (prev_read != -1) close(prev_read);
+
+    // A stage that could not be launched reports 127, like "command not
+    // found", or 1 if one of its redirections failed
+    pid_t last = pids[nstages - 1];
+    int result = last == -1 ? launch_status : 127;
+    uint64_t started = stat_now();
+    if (in_process) {
+        wait_stages(pids, nspawn, statuses, usage, launched);
+        stat_record(PHASE_WAIT, started, stages[0].argv[0]);
+        result = data_status;
+    } else if (is_background) {
+        if (last > 0) {
+            char* text = describe_pipeline(stages, nstages);
+            int id = add_job(pids, nstages, text, pgid > 0 ? pgid : 0);
+            free(text);
+            keep_cgroup(find_job(id), cgroup);
+            if (interactive) printf("[Job %d] %d\n", id, last);
+            result = 0;
+        } else {
+            keep_cgroup(NULL, cgroup);
+        }
+    } else if (wait_stages(pids, nstages, statuses, usage, launched)) {
+        // Stopped by ^Z: the pipeline becomes a stopped job, and the rest
+        // of the command line is abandoned
+        stat_record(PHASE_WAIT, started, stages[0].argv[0]);
+        char* text = describe_pipeline(stages, nstages);
+        Job* job = find_job(add_job(pids, nstages, text, pgid));
+        free(text);
+        keep_cgroup(job, cgroup);
+        if (job != NULL) {
+            stop_job(job);
+            reclaim_terminal(job);
+            printf("\n[%d] Stopped   %s\n", job->id, job->command);
+        }
+        interrupted = 1;
+        result = 128 + SIGTSTP;
+    } else {
+        stat_record(PHASE_WAIT, started, stages[0].argv[0]);
+        keep_cgroup(NULL, cgroup);
+        if (pgid > 0) reclaim_terminal(NULL);
+        if (last > 0) result = exit_status(statuses[nstages - 1]);
+        // ^C ends the whole command line, as it would a script
+        if (job_control && last > 0 && WIFSIGNALED(statuses[nstages - 1]) && WTERMSIG(statuses[nstages - 1]) == SIGINT)
+            interrupted = 1;
+    }
+    if (usage != NULL) record_usage(usage, nstages, timed);
+    if (interactive && !is_background && result != 128 + SIGTSTP) printf("child exited with status %d\n", result);
+
+    return result;
+}
+
+// FNV-1a hash of a NUL-terminated string
+unsigned long hash_string(const char* str) {
+    unsigned long hash = 14695981039346656037UL;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// FNV-1a hash of len bytes, matching hash_string() on the same text
+unsigned long hash_bytes(const char* str, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+    while (len-- > 0) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Returns the cache slot for name: the matching entry or the empty slot
+// where it belongs
+static PathEntry* path_slot(const char* name) {
+    size_t i = hash_string(name) & (path_cap - 1);
+    while (path_table[i].name != NULL && strcmp(path_table[i].name, name) != 0)
+        i = (i + 1) & (path_cap - 1);
+    return &path_table[i];
+}
+
+// Doubles the cache, re-inserting every entry
+static void path_grow() {
+    PathEntry* old = path_table;
+    size_t old_cap = path_cap;
+    path_cap = old_cap ? old_cap * 2 : PATH_TABLE_INITIAL;
+    path_table = (PathEntry*)calloc(path_cap, sizeof(PathEntry));
+    if (path_table == NULL) {
+        perror("Command cache allocation failed");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name != NULL) *path_slot(old[i].name) = old[i];
+    }
+    free(old);
+}
+
+// Walks PATH the way execvp would; returns a malloc'd path or NULL
+static char* search_path(const char* name, const char* path_var) {
+    size_t name_len = strlen(name);
+    const char* dir = path_var;
+    struct stat st;
+
+    while (dir != NULL) {
+        const char* colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+        char* candidate = (char*)malloc(dir_len + name_len + 3);
+        if (dir_len == 0) {
+            strcpy(candidate, "./");   // An empty PATH entry means the current directory
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            candidate[dir_len + 1] = '\0';
+        }
+        strcat(candidate, name);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+        free(candidate);
+        dir = colon ? colon + 1 : NULL;
+    }
+    return NULL;
+}
+
+// Resolves a command name to the path to exec, consulting the cache first.
+// Names containing a slash are used as given, and only locations found
+// through absolute PATH entries are cached. Returns NULL if not found.
+char* find_command(char* name) {
+    if (strchr(name, '/') != NULL) return name;
+
+    const char* path_var = getenv("PATH");
+    if (path_var == NULL) path_var = "/usr/local/bin:/usr/bin:/bin";
+    if (path_cached_for == NULL || strcmp(path_cached_for, path_var) != 0) {
+        clear_command_cache();
+        path_cached_for = strdup(path_var);
+    }
+    if (path_cap == 0 || (path_used + 1) * 2 > path_cap) path_grow();
+
+    PathEntry* entry = path_slot(name);
+    if (entry->name != NULL && entry->path != NULL) {
+        entry->hits++;
+        path_hits++;
+        return entry->path;
+    }
+
+    path_misses++;
+    char* found = search_path(name, path_var);
+    if (found == NULL) return NULL;
+    // A match through a relative entry such as "." or an empty one means
+    // a different file after cd, so it is looked up afresh each time
+    if (found[0] != '/') {
+        char* copy = arena_strdup(&cmd_arena, found);
+        free(found);
+        return copy;
+    }
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        path_used++;
+    }
+    entry->path = found;
+    entry->hits = 1;
+    return found;
+}
+
+// Drops a cached location after exec reported ENOENT for it
+void forget_command(char* name) {
+    if (path_cap == 0 || strchr(name, '/') != NULL) return;
+    PathEntry* entry = path_slot(name);
+    if (entry->name != NULL) {
+        free(entry->path);
+        entry->path = NULL;
+        entry->hits = 0;
+    }
+}
+
+// Empties the cache, as "hash -r" does
+void clear_command_cache() {
+    for (size_t i = 0; i < path_cap; i++) {
+        free(path_table[i].name);
+        free(path_table[i].path);
+    }
+    free(path_table);
+    free(path_cached_for);
+    path_table = NULL;
+    path_cached_for = NULL;
+    path_cap = path_used = 0;
+}
+
+// Prints the cached locations and hit/miss counters for "hash"
+void list_command_cache() {
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < path_cap; i++) {
+        if (path_table[i].name != NULL && path_table[i].path != NULL)
+            printf("%4lu\t%s\n", path_table[i].hits, path_table[i].path);
+    }
+    printf("cache hits: %lu, misses: %lu\n", path_hits, path_misses);
+}
+
+// A cat or tee stage with plain file operands (no options) can be carried
+// out by the shell with in-kernel copies.
+int is_data_stage(Stage* stage) {
+    char* name = stage->argv[0];
+    if (stage->compound != NULL || stage->function != NULL) return 0;
+    if (strcmp(name, "cat") != 0 && strcmp(name, "tee") != 0) return 0;
+    for (int i = 1; stage->argv[i] != NULL; i++) {
+        char* arg = stage->argv[i];
+        if (arg[0] == '-' && (name[0] == 't' || arg[1] != '\0')) return 0;
+    }
+    return 1;
+}
+
+// Carries out redirections on the shell's own descriptors. With saved, each
+// descriptor is first copied away so restore_redirects() can put it back;
+// *nsaved counts the copies. Returns -1 after reporting a failure.
+int apply_redirects(Redirect* redirs, SavedFd* saved, int* nsaved) {
+    for (Redirect* r = redirs; r != NULL; r = r->next) {
+        int fd;
+        if (r->type == REDIR_DUP) {
+            if ((fd = dup_target(r->target)) == -2) return -1;
+            if (fd != -1 && fcntl(fd, F_GETFD) == -1) {
+                fprintf(stderr, "%d: %s\n", fd, strerror(errno));
+                return -1;
+            }
+        } else if ((fd = open(r->target, redirect_flags(r) | O_CLOEXEC, 0644)) == -1) {
+            fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+            return -1;
+        }
+        if (saved != NULL) {
+            saved[*nsaved].fd = r->fd;
+            saved[*nsaved].copy = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+            (*nsaved)++;
+        }
+        if (fd == -1) close(r->fd);
+        else if (fd != r->fd) dup2(fd, r->fd);
+        if (r->type != REDIR_DUP && fd != r->fd) close(fd);
+    }
+    return 0;
+}
+
+// Undoes apply_redirects(), newest first
+void restore_redirects(SavedFd* saved, int nsaved) {
+    while (nsaved-- > 0) {
+        if (saved[nsaved].copy == -1) {
+            close(saved[nsaved].fd);
+        } else {
+            dup2(saved[nsaved].copy, saved[nsaved].fd);
+            close(saved[nsaved].copy);
+        }
+    }
+}
+
+// Room for the descriptors a stage's redirections may save
+static SavedFd* saved_fds(Redirect* redirs) {
+    int n = 0;
+    for (Redirect* r = redirs; r != NULL; r = r->next) n++;
+    return (SavedFd*)arena_alloc(&cmd_arena, sizeof(SavedFd) * (n + 1));
+}
+
+// Runs a cat/tee stage inside the shell. in_fd is the read end of the
+// previous stage's pipe, or -1 to read the stage's own input.
+int run_data_stage(Stage* stage, int in_fd) {
+    int status = 0, nsaved = 0;
+    int out_fd = STDOUT_FILENO;
+    SavedFd* saved = saved_fds(stage->redirs);
+
+    if (apply_redirects(stage->redirs, saved, &nsaved) == -1) {
+        restore_redirects(saved, nsaved);
+        return 1;
+    }
+    // A redirection of its own input wins over the pipe
+    for (Redirect* r = stage->redirs; r != NULL; r = r->next)
+        if (r->fd == STDIN_FILENO) in_fd = -1;
+    if (in_fd == -1) in_fd = STDIN_FILENO;
+
+    if (strcmp(stage->argv[0], "cat") == 0) {
+        if (stage->argv[1] == NULL && move_data(in_fd, out_fd) == -1) status = 1;
+        for (int i = 1; stage->argv[i] != NULL; i++) {
+            int fd = in_fd;
+            if (strcmp(stage->argv[i], "-") != 0 &&
+                (fd = open(stage->argv[i], O_RDONLY | O_CLOEXEC)) == -1) {
+                fprintf(stderr, "cat: %s: %s\n", stage->argv[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+            if (move_data(fd, out_fd) == -1) status = 1;
+            if (fd != in_fd) close(fd);
+        }
+    } else {
+        int nfiles = 0;
+        while (stage->argv[nfiles + 1] != NULL) nfiles++;
+        int* outs = (int*)arena_alloc(&cmd_arena, sizeof(int) * (nfiles + 1));
+        int nouts = 0;
+        outs[nouts++] = out_fd;
+        for (int i = 1; i <= nfiles; i++) {
+            int fd = open(stage->argv[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "tee: %s: %s\n", stage->argv[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+            outs[nouts++] = fd;
+        }
+        if (tee_data(in_fd, outs, nouts) == -1) status = 1;
+        for (int i = 1; i < nouts; i++) close(outs[i]);
+    }
+
+    restore_redirects(saved, nsaved);
+    return status;
+}
+
+// Runs a cat/tee stage in a forked copy of the shell in process group
+// pgid, for a pipeline under job control: ^Z stops it with the other
+// stages instead of leaving the shell blocked in a copy. in_fd is as for
+// run_data_stage().
+pid_t fork_data_stage(Stage* stage, int in_fd, pid_t pgid) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid > 0) {
+        setpgid(pid, pgid > 0 ? pgid : pid);
+        return pid;
+    }
+
+    setpgid(0, pgid > 0 ? pgid : 0);
+    if (pgid == PGID_NEW_FG) tcsetpgrp(tty_fd, getpid());
+    forked_child();
+    _exit(run_data_stage(stage, in_fd));
+}
+
+// Returns 1 if fd refers to a pipe or FIFO
+static int is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Copies n bytes (or to EOF when n is -1) through a user-space buffer
+static int copy_user(int in_fd, int out_fd, ssize_t n) {
+    static char buf[USER_COPY_BUF];
+    while (n != 0) {
+        size_t want = (n < 0 || n > USER_COPY_BUF) ? USER_COPY_BUF : (size_t)n;
+        ssize_t got = read(in_fd, buf, want);
+        if (got == 0) return 0;
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            perror("read failed");
+            return -1;
+        }
+        for (ssize_t off = 0; off < got; ) {
+            ssize_t w = write(out_fd, buf + off, got - off);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                perror("write failed");
+                return -1;
+            }
+            off += w;
+        }
+        if (n > 0) n -= got;
+    }
+    return 0;
+}
+
+// Moves everything from in_fd to out_fd, preferring in-kernel copies:
+// copy_file_range() between files, splice() when either side is a pipe,
+// and a user-space buffer when the kernel refuses both.
+int move_data(int in_fd, int out_fd) {
+    ssize_t n;
+    int moved = 0;
+
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0) moved = 1;
+    if (n == 0) return 0;
+    if (moved || (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                  errno != EBADF && errno != EOPNOTSUPP)) {
+        perror("copy_file_range failed");
+        return -1;
+    }
+
+    if (is_pipe(in_fd) || is_pipe(out_fd)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0) moved = 1;
+        if (n == 0) return 0;
+        if (moved || errno != EINVAL) {
+            perror("splice failed");
+            return -1;
+        }
+    }
+    return copy_user(in_fd, out_fd, -1);
+}
+
+// Drains exactly n bytes from pipe_r into out_fd
+static int drain_pipe(int pipe_r, int out_fd, ssize_t n) {
+    while (n > 0) {
+        ssize_t m = splice(pipe_r, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+        if (m == -1 && errno == EINVAL) return copy_user(pipe_r, out_fd, n);
+        if (m <= 0) {
+            if (m == -1 && errno == EINTR) continue;
+            perror("splice failed");
+            return -1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+// Fans in_fd out to every fd in out_fds. With a pipe as input each chunk
+// is duplicated with tee() into a scratch pipe per extra output and the
+// original is spliced to the last output, so bytes are never copied to
+// user space.
+int tee_data(int in_fd, int* out_fds, int nouts) {
+    int scratch[2];
+    if (nouts == 1) return move_data(in_fd, out_fds[0]);
+    if (!is_pipe(in_fd) || pipe2(scratch, O_CLOEXEC) == -1) goto user_copy;
+    // A scratch pipe as large as the input always takes a whole tee()
+    fcntl(scratch[1], F_SETPIPE_SZ, fcntl(in_fd, F_GETPIPE_SZ));
+
+    for (;;) {
+        ssize_t n = tee(in_fd, scratch[1], COPY_CHUNK, 0);
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            close(scratch[0]);
+            close(scratch[1]);
+            if (errno == EINVAL) goto user_copy;
+            perror("tee failed");
+            return -1;
+        }
+        for (int i = 0; i < nouts - 1; i++) {
+            if (i > 0 && tee(in_fd, scratch[1], n, 0) != n) {
+                perror("tee failed");
+                close(scratch[0]);
+                close(scratch[1]);
+                return -1;
+            }
+            if (drain_pipe(scratch[0], out_fds[i], n) == -1) {
+                close(scratch[0]);
+                close(scratch[1]);
+                return -1;
+            }
+        }
+        if (drain_pipe(in_fd, out_fds[nouts - 1], n) == -1) {
+            close(scratch[0]);
+            close(scratch[1]);
+            return -1;
+        }
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    return 0;
+
+user_copy:
+    {
+        static char buf[USER_COPY_BUF];
+        ssize_t got;
+        while ((got = read(in_fd, buf, sizeof(buf))) != 0) {
+            if (got == -1) {
+                if (errno == EINTR) continue;
+                perror("read failed");
+                return -1;
+            }
+            for (int i = 0; i < nouts; i++) {
+                for (ssize_t off = 0; off < got; ) {
+                    ssize_t w = write(out_fds[i], buf + off, got - off);
+                    if (w == -1) {
+                        if (errno == EINTR) continue;
+                        perror("write failed");
+                        return -1;
+                    }
+                    off += w;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// The registry. Each builtin gets argv and returns its exit status.
+Builtin builtins[] = {
+    {"cd", builtin_cd, "cd [directory] - Change the working directory"},
+    {"exit", builtin_exit, "exit [status] - Exit the shell"},
+    {"echo", builtin_echo, "echo [-neE] [args] - Print the arguments"},
+    {"printf", builtin_printf, "printf format [args] - Print the arguments under control of format"},
+    {"true", builtin_true, "true - Succeed"},
+    {"false", builtin_false, "false - Fail"},
+    {"test", builtin_test, "test expr, [ expr ] - Evaluate a file, string or integer test"},
+    {"[", builtin_test, NULL},
+    {"read", builtin_read, "read [-r] [name...] - Read a line from standard input into variables"},
+    {"jobs", builtin_jobs, "jobs - List background and stopped jobs"},
+    {"kill", builtin_kill, "kill [-SIGNAL] job... - Send a job SIGTERM or another signal; a job is %n or n"},
+    {"fg", builtin_fg, "fg [job] - Continue a job in the foreground"},
+    {"bg", builtin_bg, "bg [job] - Continue a stopped job in the background"},
+    {"wait", builtin_wait, "wait [job...] - Wait for jobs to finish, or all of them"},
+    {"disown", builtin_disown, "disown [job] - Forget a job, leaving it running"},
+    {"hash", builtin_hash, "hash [-r] [name...] - Show, forget or pre-load cached command locations"},
+    {"arena", builtin_arena, "arena - Show per-command memory arena statistics"},
+    {"history", builtin_history, "history [n], history -s text [n] - Show the last n commands, or those containing text"},
+    {"parallel", builtin_parallel, "parallel [-j N] [-k] command [args] ::: items - Run command once per item, N at a time"},
+    {"export", builtin_export, "export NAME[=value] - Put a variable in the environment of commands"},
+    {"unset", builtin_unset, "unset [-f] NAME - Remove a variable, or with -f a function"},
+    {"list_variables", builtin_set, "list_variables, set - List variables"},
+    {"set", builtin_set, NULL},
+    {"acct", builtin_acct, "acct [on|off|-c|csv [file]|json [file]] - Show or control per-stage resource accounting"},
+    {"shellstat", builtin_shellstat, "shellstat [-c|trace file|trace off] - Show shell phase latencies, or record a Chrome trace"},
+    {"zygote", builtin_zygote, "zygote [on|off] - Launch commands through a small pre-started helper process"},
+    {"coproc", builtin_coproc, "coproc [-n NAME] command [args], coproc -c [NAME] - Start a command with pipes to and from it, or close them"},
+    {"parsecache", builtin_parsecache, "parsecache [-c] - Show parse cache statistics, or clear the cache"},
+    {"break", builtin_break, "break [n] - Leave the innermost loop, or n loops"},
+    {"continue", builtin_continue, "continue [n] - Start the next pass of the innermost loop, or the nth one out"},
+    {"return", builtin_return, "return [n] - Return from a function with status n, or that of the last command"},
+    {"shift", builtin_shift, "shift [n] - Drop the first n positional parameters, 1 by default"},
+    {"ulimit", builtin_ulimit, "ulimit [-H|-S] [-a|-c|-d|-f|-l|-n|-s|-t|-u|-v] [limit|unlimited] - Show or set a resource limit of commands"},
+    {"run", builtin_run, "run [--cpu PERCENT] [--mem SIZE[K|M|G]] pipeline - Run a pipeline in a cgroup of its own with CPU and memory limits"},
+    {"affinity", builtin_affinity, "affinity [off|rr|numa] - Pin background jobs and parallel workers to CPUs in turn, or to NUMA nodes"},
+    {"cgstat", builtin_cgstat, "cgstat - Show CPU, memory and pressure of pipelines started with run"},
+    {":", builtin_colon, ": [args] - Do nothing and succeed"},
+    {"help", builtin_help, "help - Show this help message"},
+};
+
+// Dispatch table slot of name under seed
+static unsigned builtin_slot(const char* name, unsigned long seed) {
+    return ((hash_string(name) ^ seed) * 0x9E3779B97F4A7C15UL) >> (64 - BUILTIN_TABLE_BITS);
+}
+
+// Builds the dispatch table, trying seeds until every builtin lands in a
+// slot of its own. A lookup is then one hash, one load and one strcmp.
+void init_builtins() {
+    int nbuiltins = sizeof(builtins) / sizeof(builtins[0]);
+    for (unsigned long seed = 1; ; seed++) {
+        int i;
+        memset(builtin_table, 0, sizeof(builtin_table));
+        for (i = 0; i < nbuiltins; i++) {
+            unsigned slot = builtin_slot(builtins[i].name, seed);
+            if (builtin_table[slot] != NULL) break;
+            builtin_table[slot] = &builtins[i];
+        }
+        if (i == nbuiltins) {
+            builtin_seed = seed;
+            return;
+        }
+    }
+}
+
+// Returns the builtin called name, or NULL
+Builtin* find_builtin(const char* name) {
+    if (builtin_seed == 0) init_builtins();
+    Builtin* builtin = builtin_table[builtin_slot(name, builtin_seed)];
+    return builtin != NULL && strcmp(builtin->name, name) == 0 ? builtin : NULL;
+}
+
+// Gives a builtin its prefix assignments as shell variables. Returns the
+// values they replaced, for restore_assignments().
+static char** apply_assignments(char** assigns) {
+    int n = 0;
+    while (assigns[n] != NULL) n++;
+    char** old = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (n + 1));
+    for (int i = 0; i < n; i++) {
+        char* name = assignment_name(assigns[i]);
+        char* value = get_variable(name);
+        old[i] = value != NULL ? arena_strdup(&cmd_arena, value) : NULL;
+        set_variable(name, strchr(assigns[i], '=') + 1);
+    }
+    return old;
+}
+
+static void restore_assignments(char** assigns, char** old) {
+    for (int i = 0; assigns[i] != NULL; i++) {
+        char* name = assignment_name(assigns[i]);
+        if (old[i] != NULL) set_variable(name, old[i]);
+        else unset_variable(name);
+    }
+}
+
+// The builtin a stage runs, or NULL; functions take precedence
+static Builtin* stage_builtin(Stage* stage) {
+    return stage->compound == NULL && stage->function == NULL ? find_builtin(stage->argv[0]) : NULL;
+}
+
+// Does what a stage the shell carries out itself does: a builtin, a
+// function call or a compound command
+static int run_in_shell(Builtin* builtin, Stage* stage) {
+    if (stage->function != NULL) return call_function(stage->function, stage->argv);
+    if (stage->compound != NULL) return run_node(stage->compound);
+    return builtin->fn(stage->argv);
+}
+
+// Runs a builtin, function call or compound command inside the shell.
+// Its redirections and prefix assignments are applied for its duration
+// only.
+int run_builtin(Builtin* builtin, Stage* stage) {
+    int nsaved = 0, status = 1;
+    SavedFd* saved = saved_fds(stage->redirs);
+
+    fflush(stdout);
+    if (apply_redirects(stage->redirs, saved, &nsaved) == 0) {
+        char** old = apply_assignments(stage->assigns);
+        status = run_in_shell(builtin, stage);
+        restore_assignments(stage->assigns, old);
+    }
+    fflush(stdout);
+    restore_redirects(saved, nsaved);
+    return status;
+}
+
+// Runs a builtin, function or compound pipeline stage or background job
+// in a child of its own, since it has to run alongside the other stages,
+// or a command that has to join a cgroup before it execs.
+// close_fd is the parent's read end of this stage's output pipe. The child
+// goes into process group pgid as spawn_stage() would put a command.
+pid_t fork_builtin(Builtin* builtin, Stage* stage, int in_fd, int out_fd, int close_fd, pid_t pgid) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid > 0) {
+        if (pgid != PGID_SHELL) setpgid(pid, pgid > 0 ? pgid : pid);
+        return pid;
+    }
+
+    if (pgid != PGID_SHELL) setpgid(0, pgid > 0 ? pgid : 0);
+    if (pgid == PGID_NEW_FG) tcsetpgrp(tty_fd, getpid());
+    // Under "run", into the pipeline's cgroup before anything runs
+    if (launch_cgroup != -1 && join_cgroup(launch_cgroup) == -1) {
+        perror("run: cannot join cgroup");
+        _exit(126);
+    }
+    forked_child();
+    if (close_fd != -1) close(close_fd);
+    if (in_fd != -1) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    if (apply_redirects(stage->redirs, NULL, NULL) == -1) _exit(1);
+    if (builtin == NULL && stage->compound == NULL && stage->function == NULL) exec_stage(stage);
+    apply_assignments(stage->assigns);
+    int status = run_in_shell(builtin, stage);
+    fflush(stdout);
+    _exit(status);
+}
+int builtin_cd(char** argv) {
+    if (argv[1] == NULL || chdir(argv[1]) != 0) {
+        perror("cd failed");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_exit(char** argv) {
+    fflush(stdout);
+    exit(argv[1] != NULL ? atoi(argv[1]) : last_status);
+}
+
+// Decodes the escape sequence whose backslash is just before p into *c;
+// returns how many characters after the backslash it used. Octal is
+// \0nnn as in echo, or with format, \ddd as in a printf format.
+static int decode_escape(const char* p, char* c, int format) {
+    const char* from = "abfnrtv\\";
+    const char* to = "\a\b\f\n\r\t\v\\";
+    const char* hit = *p != '\0' ? strchr(from, *p) : NULL;
+
+    if (hit != NULL) {
+        *c = to[hit - from];
+        return 1;
+    }
+    if (format && *p >= '0' && *p <= '7') {
+        // \ddd: one to three octal digits
+        int value = 0, used = 0;
+        while (used < 3 && p[used] >= '0' && p[used] <= '7') value = value * 8 + p[used++] - '0';
+        *c = value;
+        return used;
+    }
+    if (*p == '0') {
+        // \0nnn: up to three octal digits
+        int value = 0, used = 1;
+        while (used < 4 && p[used] >= '0' && p[used] <= '7') value = value * 8 + p[used++] - '0';
+        *c = value;
+        return used;
+    }
+    *c = '\\';
+    return 0;
+}
+
+// Prints the escape sequence whose backslash is just before p; returns
+// how many characters after the backslash it used
+static int print_escape(const char* p, int format) {
+    char c;
+    int used = decode_escape(p, &c, format);
+    putchar(c);
+    return used;
+}
+
+int builtin_echo(char** argv) {
+    int newline = 1, escapes = 0, i = 1;
+
+    // Leading words made only of n, e and E are options
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' &&
+           strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1); i++) {
+        for (char* opt = argv[i] + 1; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else escapes = *opt == 'e';
+        }
+    }
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) {
+            fputs(argv[i], stdout);
+            continue;
+        }
+        for (char* p = argv[i]; *p; p++) {
+            if (*p == '\\' && p[1] == 'c') return 0;
+            if (*p == '\\') p += print_escape(p + 1, 0);
+            else putchar(*p);
+        }
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// Converts a printf argument for a numeric conversion, reporting junk
+static long printf_number(const char* arg, int* status) {
+    char* end;
+    if (arg == NULL) return 0;
+    long value = strtol(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0') {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// The format is reused until the arguments run out, as in POSIX printf
+int builtin_printf(char** argv) {
+    char spec[64];
+    int status = 0;
+
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    char** args = argv + 2;
+    char** pass_start;
+    do {
+        pass_start = args;
+        for (const char* p = argv[1]; *p; p++) {
+            if (*p == '\\') {
+                p += print_escape(p + 1, 1);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+            // Flags, width and precision are passed through to printf(3)
+            size_t n = strspn(p + 1, "-+ #0123456789.");
+            char conv = p[n + 1];
+            if (conv == '\0' || strchr("sbcdiouxX", conv) == NULL || n + 4 > sizeof(spec)) {
+                fprintf(stderr, "printf: %.*s: invalid conversion\n", (int)n + 2, p);
+                return 1;
+            }
+            char* arg = *args != NULL ? *args++ : NULL;
+            memcpy(spec, p, n + 1);
+            p += n + 1;
+            if (conv == 'b') {
+                // The argument's escapes are expanded as by echo -e; \c
+                // ends all output
+                const char* from = arg != NULL ? arg : "";
+                char* text = (char*)arena_alloc(&cmd_arena, strlen(from) + 1);
+                size_t len = 0;
+                int stop = 0;
+                for (; *from != '\0'; from++) {
+                    if (*from == '\\' && from[1] == 'c') {
+                        stop = 1;
+                        break;
+                    }
+                    if (*from == '\\') from += decode_escape(from + 1, &text[len++], 0);
+                    else text[len++] = *from;
+                }
+                text[len] = '\0';
+                // Without a width or precision, a \0 in the text is written too
+                if (n == 0) {
+                    fwrite(text, 1, len, stdout);
+                } else {
+                    strcpy(spec + n + 1, "s");
+                    printf(spec, text);
+                }
+                if (stop) return status;
+            } else if (conv == 's') {
+                strcpy(spec + n + 1, "s");
+                printf(spec, arg != NULL ? arg : "");
+            } else if (conv == 'c') {
+                strcpy(spec + n + 1, "c");
+                if (arg != NULL && *arg != '\0') printf(spec, *arg);
+            } else {
+                sprintf(spec + n + 1, "l%c", conv);
+                printf(spec, printf_number(arg, &status));
+            }
+        }
+    } while (*args != NULL && args != pass_start);
+    return status;
+}
+
+int builtin_true(char** argv) {
+    return 0;
+}
+
+int builtin_false(char** argv) {
+    return 1;
+}
+
+// Evaluates a unary test; 0 for true, 1 for false, 2 for a bad operator
+static int test_unary(const char* op, const char* arg) {
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    switch (op[1]) {
+        case 'z': return *arg != '\0';
+        case 'n': return *arg == '\0';
+        case 'r': return access(arg, R_OK) != 0;
+        case 'w': return access(arg, W_OK) != 0;
+        case 'x': return access(arg, X_OK) != 0;
+        case 't': return !isatty(atoi(arg));
+        case 'L':
+        case 'h': return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+    }
+    if (strchr("efdspSbc", op[1]) == NULL) {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    if (stat(arg, &st) != 0) return 1;
+    switch (op[1]) {
+        case 'f': return !S_ISREG(st.st_mode);
+        case 'd': return !S_ISDIR(st.st_mode);
+        case 's': return st.st_size == 0;
+        case 'p': return !S_ISFIFO(st.st_mode);
+        case 'S': return !S_ISSOCK(st.st_mode);
+        case 'b': return !S_ISBLK(st.st_mode);
+        case 'c': return !S_ISCHR(st.st_mode);
+    }
+    return 0;
+}
+
+static int is_binary_test(const char* op) {
+    const char* ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    for (int i = 0; ops[i] != NULL; i++)
+        if (strcmp(op, ops[i]) == 0) return 1;
+    return 0;
+}
+
+// Evaluates a binary test the same way as test_unary()
+static int test_binary(const char* left, const char* op, const char* right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) != 0;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) == 0;
+
+    char *left_end, *right_end;
+    long a = strtol(left, &left_end, 10);
+    long b = strtol(right, &right_end, 10);
+    if (*left == '\0' || *left_end != '\0' || *right == '\0' || *right_end != '\0') {
+        fprintf(stderr, "test: integer expression expected\n");
+        return 2;
+    }
+    switch (op[1] << 8 | op[2]) {
+        case 'e' << 8 | 'q': return !(a == b);
+        case 'n' << 8 | 'e': return !(a != b);
+        case 'l' << 8 | 't': return !(a < b);
+        case 'l' << 8 | 'e': return !(a <= b);
+        case 'g' << 8 | 't': return !(a > b);
+    }
+    return !(a >= b);
+}
+
+// Evaluates argc test arguments by the POSIX rules for up to four of them
+static int test_expr(int argc, char** argv) {
+    int result;
+    switch (argc) {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == '\0';
+        case 2:
+            if (strcmp(argv[0], "!") == 0) return !test_expr(1, argv + 1);
+            return test_unary(argv[0], argv[1]);
+        case 3:
+            if (is_binary_test(argv[1])) return test_binary(argv[0], argv[1], argv[2]);
+            if (strcmp(argv[0], "!") == 0) {
+                result = test_expr(2, argv + 1);
+                return result == 2 ? 2 : !result;
+            }
+            if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) return test_expr(1, argv + 1);
+            fprintf(stderr, "test: %s: binary operator expected\n", argv[1]);
+            return 2;
+        case 4:
+            if (strcmp(argv[0], "!") == 0) {
+                result = test_expr(3, argv + 1);
+                return result == 2 ? 2 : !result;
+            }
+            if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) return test_expr(2, argv + 1);
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+int builtin_test(char** argv) {
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expr(argc - 1, argv + 1);
+}
+
+// Reads one line a byte at a time, so nothing past the newline is taken
+// from a shared input, and splits it on blanks over the named variables;
+// the last one gets the rest of the line. Without -r, a backslash escapes
+// the next character and backslash-newline continues the line.
+int builtin_read(char** argv) {
+    char* reply[] = {"REPLY", NULL};
+    int raw = argv[1] != NULL && strcmp(argv[1], "-r") == 0;
+    char** names = argv[1 + raw] != NULL ? argv + 1 + raw : reply;
+    size_t len = 0, keep = 0, cap = 128;
+    char* field = malloc(cap);
+    char c;
+    int got_line = 0;
+
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        int escaped = 0;
+        if (c == '\n') {
+            got_line = 1;
+            break;
+        }
+        if (!raw && c == '\\') {
+            if (read(STDIN_FILENO, &c, 1) != 1) break;
+            if (c == '\n') continue;
+            escaped = 1;
+        }
+        if (!escaped && (c == ' ' || c == '\t')) {
+            if (len == 0) continue;
+            if (names[1] != NULL) {
+                field[keep] = '\0';
+                set_variable(*names++, field);
+                len = keep = 0;
+                continue;
+            }
+        }
+        if (len + 1 >= cap) field = realloc(field, cap *= 2);
+        field[len++] = c;
+        // Trailing blanks are dropped from the last variable
+        if (escaped || (c != ' ' && c != '\t')) keep = len;
+    }
+    field[keep] = '\0';
+    set_variable(*names++, field);
+    while (*names != NULL) set_variable(*names++, "");
+    free(field);
+    return got_line ? 0 : 1;
+}
+
+int builtin_jobs(char** argv) {
+    reap_jobs();
+    list_jobs();
+    notify_jobs();
+    return 0;
+}
+
+// Returns the job a job spec names: %n or just n, or %%, %+ or no spec at
+// all for the current job. Complains and returns NULL if there is none.
+static Job* job_from_spec(const char* builtin, const char* spec) {
+    Job* job = NULL;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        job = find_job(current_job != 0 ? current_job : max_job_id);
+    } else {
+        const char* digits = spec[0] == '%' ? spec + 1 : spec;
+        char* end;
+        long id = strtol(digits, &end, 10);
+        if (*digits != '\0' && *end == '\0' && id > 0 && id <= INT_MAX) job = find_job((int)id);
+    }
+    if (job == NULL) fprintf(stderr, "%s: %s: no such job\n", builtin, spec != NULL ? spec : "current");
+    return job;
+}
+
+// Signal names kill accepts, without their SIG prefix
+static const struct {
+    const char* name;
+    int sig;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+    {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+    {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+
+// Signal number for a name like TERM or SIGTERM, or a number; -1 if none
+static int signal_number(const char* name) {
+    if (isdigit((unsigned char)*name)) {
+        char* end;
+        long sig = strtol(name, &end, 10);
+        return *end == '\0' && sig < NSIG ? (int)sig : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcasecmp(signal_names[i].name, name) == 0) return signal_names[i].sig;
+    }
+    return -1;
+}
+
+// kill [-SIGNAL] job...: signals jobs, with SIGTERM unless told otherwise,
+// so they can clean up. A stopped job is continued too, to act on it.
+int builtin_kill(char** argv) {
+    int sig = SIGTERM, i = 1, status = 0;
+    if (argv[1] != NULL && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if ((sig = signal_number(argv[1] + 1)) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal\n", argv[1] + 1);
+            return 1;
+        }
+        i++;
+    }
+    if (argv[i] == NULL) {
+        printf("Usage: kill [-SIGNAL] job...\n");
+        return 1;
+    }
+    reap_jobs();
+    for (; argv[i] != NULL; i++) {
+        Job* job = job_from_spec("kill", argv[i]);
+        if (job == NULL || job->state == JOB_DONE) {
+            if (job != NULL) fprintf(stderr, "kill: %s: job has finished\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (signal_job(job, sig) == -1) {
+            perror("kill failed");
+            status = 1;
+            continue;
+        }
+        if (job->state == JOB_STOPPED && sig != SIGSTOP && sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU)
+            continue_job(job);
+    }
+    return status;
+}
+
+// fg [job]: continues a job in the foreground, with the terminal, and
+// waits for it to finish or stop again
+int builtin_fg(char** argv) {
+    reap_jobs();
+    Job* job = job_from_spec("fg", argv[1]);
+    if (job == NULL) return 1;
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (job_control && job->pgid > 0) {
+        if (job->has_tmodes) tcsetattr(tty_fd, TCSADRAIN, &job->tmodes);
+        tcsetpgrp(tty_fd, job->pgid);
+    }
+    if (job->state == JOB_STOPPED) continue_job(job);
+    current_job = job->id;
+    return last_status = wait_job(job, job_control && job->pgid > 0);
+}
+
+// bg [job]: lets a stopped job carry on in the background
+int builtin_bg(char** argv) {
+    reap_jobs();
+    Job* job = job_from_spec("bg", argv[1]);
+    if (job == NULL) return 1;
+    if (job->state == JOB_DONE) {
+        fprintf(stderr, "bg: job %d has finished\n", job->id);
+        return 1;
+    }
+    if (job->state == JOB_STOPPED) continue_job(job);
+    printf("[%d] %s &\n", job->id, job->command);
+    return 0;
+}
+
+// wait [job...]: waits for the given jobs, or every job, to finish, and
+// returns the status of the last one named. Under job control a job that
+// stops is not waited for further.
+int builtin_wait(char** argv) {
+    int status = 0;
+    reap_jobs();
+    if (argv[1] == NULL) {
+        for (int id = 1; id <= max_job_id; id++) {
+            Job* job = find_job(id);
+            if (job != NULL) wait_job(job, 0);
+        }
+        notify_jobs();
+        return 0;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        Job* job = job_from_spec("wait", argv[i]);
+        status = job != NULL ? wait_job(job, 0) : 127;
+    }
+    return status;
+}
+
+// disown [job]: forgets a job without signalling it
+int builtin_disown(char** argv) {
+    reap_jobs();
+    Job* job = job_from_spec("disown", argv[1]);
+    if (job == NULL) return 1;
+    disown_job(job);
+    return 0;
+}
+
+int builtin_hash(char** argv) {
+    int status = 0;
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        clear_command_cache();
+    } else if (argv[1] != NULL) {
+        for (int i = 1; argv[i] != NULL; i++) {
+            if (find_command(argv[i]) == NULL) {
+                printf("hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+    } else {
+        list_command_cache();
+    }
+    return status;
+}
+
+int builtin_arena(char** argv) {
+    arena_stats(&cmd_arena);
+    return 0;
+}
+
+int builtin_history(char** argv) {
+    init_history();
+    if (argv[1] != NULL && strcmp(argv[1], "-s") == 0 && argv[2] != NULL) {
+        search_history(argv[2], argv[3] != NULL ? atoi(argv[3]) : HISTORY_SIZE);
+    } else {
+        list_history(argv[1] != NULL ? atoi(argv[1]) : HISTORY_SIZE);
+    }
+    return 0;
+}
+
+int builtin_parallel(char** argv) {
+    return run_parallel(argv);
+}
+
+int builtin_export(char** argv) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        char* eq = strchr(argv[i], '=');
+        char* name = eq != NULL ? assignment_name(argv[i]) : argv[i];
+        if (eq != NULL) set_variable(name, eq + 1);
+        char* value = get_variable(name);
+        setenv(name, value ? value : "", 1);
+    }
+    return 0;
+}
+
+int builtin_unset(char** argv) {
+    int functions_only = argv[1] != NULL && strcmp(argv[1], "-f") == 0;
+    for (int i = 1 + functions_only; argv[i] != NULL; i++) {
+        if (functions_only) unset_function(argv[i]);
+        else unset_variable(argv[i]);
+    }
+    return 0;
+}
+
+int builtin_set(char** argv) {
+    list_variables();
+    return 0;
+}
+
+int builtin_help(char** argv) {
+    printf("Built-in commands:\n");
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        if (builtins[i].help != NULL) printf("%s\n", builtins[i].help);
+    printf("NAME=value - Set a variable; $NAME or ${NAME} expands it\n");
+    printf("!n, !-n, !!, !prefix - Repeat a command from the history\n");
+    printf("if, while, until, for, case, { list; }, ( list ) - Compound commands, as in sh\n");
+    printf("name() compound-command - Define a function; $1.., $#, $@ and $* are its arguments\n");
+    return 0;
+}
+
+int builtin_colon(char** argv) {
+    return 0;
+}
+
+int builtin_acct(char** argv) {
+    if (argv[1] == NULL) {
+        printf("Accounting is %s; %lu stage(s) recorded\n", acct_enabled ? "on" : "off", acct_total);
+        acct_dump(stdout, ACCT_TABLE);
+    } else if (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0) {
+        acct_enabled = argv[1][1] == 'n';
+    } else if (strcmp(argv[1], "-c") == 0) {
+        acct_total = 0;
+    } else if (strcmp(argv[1], "csv") == 0 || strcmp(argv[1], "json") == 0) {
+        FILE* fp = argv[2] != NULL ? fopen(argv[2], "w") : stdout;
+        if (fp == NULL) {
+            fprintf(stderr, "acct: %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        acct_dump(fp, argv[1][0] == 'c' ? ACCT_CSV : ACCT_JSON);
+        if (fp != stdout) fclose(fp);
+    } else {
+        fprintf(stderr, "usage: acct [on|off|-c|csv [file]|json [file]]\n");
+        return 2;
+    }
+    return 0;
+}
+
+int builtin_shellstat(char** argv) {
+    if (argv[1] == NULL) {
+        print_shellstat();
+    } else if (strcmp(argv[1], "-c") == 0) {
+        memset(phase_stats, 0, sizeof(phase_stats));
+    } else if (strcmp(argv[1], "trace") == 0 && argv[2] != NULL) {
+        if (strcmp(argv[2], "off") == 0) return write_trace();
+        start_trace(argv[2]);
+    } else {
+        fprintf(stderr, "usage: shellstat [-c|trace file|trace off]\n");
+        return 2;
+    }
+    return 0;
+}
+
+int builtin_zygote(char** argv) {
+    if (argv[1] == NULL) {
+        if (zygote_fd == -1) printf("Zygote: off\n");
+        else printf("Zygote: on (pid %d), %lu command(s) launched\n", zygote_pid, zygote_spawns);
+    } else if (strcmp(argv[1], "on") == 0) {
+        return start_zygote() == 0 ? 0 : 1;
+    } else if (strcmp(argv[1], "off") == 0) {
+        stop_zygote();
+    } else {
+        fprintf(stderr, "usage: zygote [on|off]\n");
+        return 2;
+    }
+    return 0;
+}
+
+// Resources ulimit shows and sets, and the units their values are in
+static const struct {
+    char option;
+    int resource;
+    int unit;
+    const char* name;
+} ulimit_resources[] = {
+    {'c', RLIMIT_CORE, 512, "core file size (blocks)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 512, "file size (blocks)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+
+static void print_limit(rlim_t value, int unit) {
+    if (value == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%llu\n", (unsigned long long)(value / unit));
+}
+
+// Shows or sets a resource limit of the shell, which every command it
+// launches from then on inherits. A new limit is both the soft and hard
+// one unless -S or -H picks one; -H shows hard limits. The zygote is
+// restarted, since the commands it launches inherit its limits instead.
+int builtin_ulimit(char** argv) {
+    int nresources = sizeof(ulimit_resources) / sizeof(ulimit_resources[0]);
+    int hard = 0, soft = 0, all = 0, which = 2;
+    int i = 1;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (char* opt = argv[i] + 1; *opt != '\0'; opt++) {
+            int r = 0;
+            while (r < nresources && ulimit_resources[r].option != *opt) r++;
+            if (*opt == 'H') hard = 1;
+            else if (*opt == 'S') soft = 1;
+            else if (*opt == 'a') all = 1;
+            else if (r < nresources) which = r;
+            else {
+                fprintf(stderr, "usage: ulimit [-H|-S] [-a|-c|-d|-f|-l|-n|-s|-t|-u|-v] [limit|unlimited]\n");
+                return 2;
+            }
+        }
+    }
+
+    struct rlimit rl;
+    if (all) {
+        for (int r = 0; r < nresources; r++) {
+            getrlimit(ulimit_resources[r].resource, &rl);
+            printf("%-28s (-%c) ", ulimit_resources[r].name, ulimit_resources[r].option);
+            print_limit(hard ? rl.rlim_max : rl.rlim_cur, ulimit_resources[r].unit);
+        }
+        return 0;
+    }
+    getrlimit(ulimit_resources[which].resource, &rl);
+    if (argv[i] == NULL) {
+        print_limit(hard ? rl.rlim_max : rl.rlim_cur, ulimit_resources[which].unit);
+        return 0;
+    }
+
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(argv[i], "unlimited") != 0) {
+        char* end;
+        unsigned long long n = strtoull(argv[i], &end, 10);
+        if (!isdigit((unsigned char)argv[i][0]) || *end != '\0' || n > RLIM_INFINITY / ulimit_resources[which].unit) {
+            fprintf(stderr, "ulimit: %s: invalid limit\n", argv[i]);
+            return 1;
+        }
+        value = n * ulimit_resources[which].unit;
+    }
+    if (hard || !soft) rl.rlim_max = value;
+    if (soft || !hard) rl.rlim_cur = value;
+    if (setrlimit(ulimit_resources[which].resource, &rl) == -1) {
+        fprintf(stderr, "ulimit: %s: %s\n", argv[i], strerror(errno));
+        return 1;
+    }
+    if (zygote_fd != -1) {
+        stop_zygote();
+        start_zygote();
+    }
+    return 0;
+}
+
+// Shows or sets where background jobs and parallel workers run: off
+// leaves them on the shell's CPUs, rr pins each process to the next CPU
+// in turn, and numa puts each job or worker on the next NUMA node's CPUs.
+// The CPUs and nodes are read again each time placement is turned on.
+int builtin_affinity(char** argv) {
+    static const char* modes[] = {"off", "rr", "numa"};
+    if (argv[1] == NULL) {
+        printf("Affinity: %s", modes[affinity_mode]);
+        if (affinity_mode != AFFINITY_OFF) printf(", %d CPU(s) on %d node(s)", affinity_ncpus, affinity_nnodes);
+        printf("\n");
+        return 0;
+    }
+    for (int mode = 0; mode < 3; mode++) {
+        if (strcmp(argv[1], modes[mode]) == 0 && argv[2] == NULL) {
+            if (mode != AFFINITY_OFF) init_affinity();
+            affinity_mode = mode;
+            return 0;
+        }
+    }
+    fprintf(stderr, "usage: affinity [off|rr|numa]\n");
+    return 2;
+}
+
+// Runs a pipeline in a cgroup of its own. execute() takes run's options
+// when it leads a pipeline; this handles one anywhere else, like a later
+// stage or a coprocess, by running its command as a pipeline of its own.
+int builtin_run(char** argv) {
+    static char* no_assigns[] = {NULL};
+    Stage stage = {argv, no_assigns, NULL, NULL, NULL};
+    return execute(&stage, 1, 0, 0);
+}
+
+// Formats a byte count from a cgroup file as K, M or G, or "-" if missing
+static char* cgroup_size(double bytes, char* buf, size_t size) {
+    const char* units = "KMG";
+    int unit = -1;
+    if (bytes < 0) return strcpy(buf, "-");
+    while (bytes >= 1024 && unit < 2) {
+        bytes /= 1024;
+        unit++;
+    }
+    if (unit < 0) snprintf(buf, size, "%.0fB", bytes);
+    else snprintf(buf, size, "%.1f%c", bytes, units[unit]);
+    return buf;
+}
+
+// Prints one line of cgstat for the cgroup at path
+static void print_cgstat(const char* label, const char* path) {
+    char text[1024], current[16], peak[16], oom[16], cpu_psi[16], mem_psi[16];
+    double usage = -1, throttled = -1, value;
+
+    if (read_cgroup_file(path, "cpu.stat", text, sizeof(text)) == 0) {
+        usage = cgroup_field(text, "usage_usec");
+        throttled = cgroup_field(text, "throttled_usec");
+    }
+    value = read_cgroup_file(path, "memory.current", text, sizeof(text)) == 0 ? strtod(text, NULL) : -1;
+    cgroup_size(value, current, sizeof(current));
+    value = read_cgroup_file(path, "memory.peak", text, sizeof(text)) == 0 ? strtod(text, NULL) : -1;
+    cgroup_size(value, peak, sizeof(peak));
+    value = read_cgroup_file(path, "memory.events", text, sizeof(text)) == 0 ? cgroup_field(text, "oom_kill") : -1;
+    if (value < 0) strcpy(oom, "-");
+    else snprintf(oom, sizeof(oom), "%.0f", value);
+    value = read_cgroup_file(path, "cpu.pressure", text, sizeof(text)) == 0 ? cgroup_field(text, "avg10") : -1;
+    if (value < 0) strcpy(cpu_psi, "-");
+    else snprintf(cpu_psi, sizeof(cpu_psi), "%.2f%%", value);
+    value = read_cgroup_file(path, "memory.pressure", text, sizeof(text)) == 0 ? cgroup_field(text, "avg10") : -1;
+    if (value < 0) strcpy(mem_psi, "-");
+    else snprintf(mem_psi, sizeof(mem_psi), "%.2f%%", value);
+
+    const char* name = strrchr(path, '/');
+    printf("%-6s %-20s", label, name != NULL ? name + 1 : path);
+    if (usage < 0) printf(" %9s", "-");
+    else printf(" %8.2fs", usage / 1e6);
+    if (throttled < 0) printf(" %9s", "-");
+    else printf(" %8.2fs", throttled / 1e6);
+    printf(" %8s %8s %4s %8s %8s\n", current, peak, oom, cpu_psi, mem_psi);
+}
+
+// Shows how the pipelines started with "run" fare: CPU used and time held
+// back by cpu.max, memory now and at its peak, OOM kills, and the share
+// of the last 10 seconds some of their tasks stalled waiting for CPU or
+// memory (the "some avg10" pressure figure). The last foreground run is
+// listed as "last" until the next one finishes.
+int builtin_cgstat(char** argv) {
+    char label[16];
+    reap_jobs();
+    printf("%-6s %-20s %9s %9s %8s %8s %4s %8s %8s\n", "JOB", "CGROUP", "CPU", "THROTTLED", "MEM", "PEAK", "OOM",
+           "CPU PSI", "MEM PSI");
+    for (int i = 0; i < max_job_id; i++) {
+        if (jobs[i].id == 0 || jobs[i].cgroup == NULL) continue;
+        snprintf(label, sizeof(label), "[%d]", jobs[i].id);
+        print_cgstat(label, jobs[i].cgroup);
+    }
+    if (last_run_cgroup != NULL) print_cgstat("last", last_run_cgroup);
+    return 0;
+}
+
+// Sets NAME_suffix to a number, for a coprocess's variables
+static void set_coproc_variable(const char* name, const char* suffix, long value) {
+    char var[128], num[32];
+    snprintf(var, sizeof(var), "%s_%s", name, suffix);
+    snprintf(num, sizeof(num), "%ld", value);
+    if (value < 0) unset_variable(var);
+    else set_variable(var, num);
+}
+
+// Closes the shell's ends of a coprocess's pipes and drops its variables
+static void close_coproc(Coproc* co) {
+    close(co->read_fd);
+    close(co->write_fd);
+    set_coproc_variable(co->name, "READ", -1);
+    set_coproc_variable(co->name, "WRITE", -1);
+    set_coproc_variable(co->name, "PID", -1);
+    free(co->name);
+    *co = coprocs[--ncoprocs];
+}
+
+static Coproc* find_coproc(const char* name) {
+    for (int i = 0; i < ncoprocs; i++)
+        if (strcmp(coprocs[i].name, name) == 0) return &coprocs[i];
+    return NULL;
+}
+
+// Starts a command as a background job with a pipe to its stdin and one
+// from its stdout. The shell keeps the other ends, close-on-exec so no
+// other command holds them, and names them in NAME_READ and NAME_WRITE
+// for use as "<&$NAME_READ" and ">&$NAME_WRITE".
+int builtin_coproc(char** argv) {
+    static char* no_assigns[] = {NULL};
+    char* name = "COPROC";
+    int first = 1;
+
+    if (argv[1] == NULL) {
+        for (int i = 0; i < ncoprocs; i++)
+            printf("%s: pid %d, read fd %d, write fd %d\n", coprocs[i].name, coprocs[i].pid,
+                   coprocs[i].read_fd, coprocs[i].write_fd);
+        return 0;
+    }
+    if (strcmp(argv[1], "-c") == 0) {
+        Coproc* co = find_coproc(argv[2] != NULL ? argv[2] : name);
+        if (co == NULL) {
+            fprintf(stderr, "coproc: no coprocess %s\n", argv[2] != NULL ? argv[2] : name);
+            return 1;
+        }
+        close_coproc(co);
+        return 0;
+    }
+    if (strcmp(argv[1], "-n") == 0 && argv[2] != NULL) {
+        name = argv[2];
+        first = 3;
+    }
+    // NAME must be a variable name, which is what "NAME=" accepts
+    char check[104];
+    snprintf(check, sizeof(check), "%s=", name);
+    if (argv[first] == NULL || strlen(name) > 100 || !is_assignment(check)) {
+        fprintf(stderr, "usage: coproc [-n NAME] command [args], coproc -c [NAME]\n");
+        return 2;
+    }
+    Coproc* co = find_coproc(name);
+    if (co != NULL) close_coproc(co);
+    if (ncoprocs == COPROC_MAX) {
+        fprintf(stderr, "coproc: too many coprocesses\n");
+        return 1;
+    }
+
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) == -1) {
+        perror("Pipe failed");
+        return 1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) == -1) {
+        perror("Pipe failed");
+        close(to_child[0]);
+        close(to_child[1]);
+        return 1;
+    }
+    // Functions first, then builtins, then PATH, as execute() resolves a stage
+    Stage stage = {argv + first, no_assigns, NULL, NULL, find_function(argv[first])};
+    Builtin* builtin = stage_builtin(&stage);
+    pid_t pgid = job_control ? PGID_NEW : PGID_SHELL;
+    pid_t pid = builtin != NULL || stage.function != NULL
+                    ? fork_builtin(builtin, &stage, to_child[0], from_child[1], to_child[1], pgid)
+                    : spawn_stage(&stage, to_child[0], from_child[1], pgid);
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid <= 0) {
+        close(to_child[1]);
+        close(from_child[0]);
+        return 1;
+    }
+
+    char* text = describe_pipeline(&stage, 1);
+    int id = add_job(&pid, 1, text, job_control ? pid : 0);
+    free(text);
+    co = &coprocs[ncoprocs++];
+    co->name = strdup(name);
+    co->pid = pid;
+    co->read_fd = from_child[0];
+    co->write_fd = to_child[1];
+    set_coproc_variable(name, "READ", co->read_fd);
+    set_coproc_variable(name, "WRITE", co->write_fd);
+    set_coproc_variable(name, "PID", pid);
+    if (interactive) printf("[Job %d] %d\n", id, pid);
+    return 0;
+}
+
+// Reads the optional count argument of break, continue, return and shift.
+// Returns -1 after reporting one that is not a number.
+static long count_arg(char** argv, long fallback) {
+    if (argv[1] == NULL) return fallback;
+    char* end;
+    long n = strtol(argv[1], &end, 10);
+    if (*argv[1] == '\0' || *end != '\0' || n < 0) {
+        fprintf(stderr, "%s: %s: numeric argument required\n", argv[0], argv[1]);
+        return -1;
+    }
+    return n;
+}
+
+// break [n] and continue [n] act on the nth enclosing loop, or the
+// outermost one in the current function if there are fewer
+static int loop_control(char** argv, int* levels) {
+    long n = count_arg(argv, 1);
+    if (n == -1) return 2;
+    if (n == 0) {
+        fprintf(stderr, "%s: loop count out of range\n", argv[0]);
+        return 1;
+    }
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+        return 1;
+    }
+    *levels = n < loop_depth ? n : loop_depth;
+    return 0;
+}
+
+int builtin_break(char** argv) {
+    return loop_control(argv, &break_levels);
+}
+
+int builtin_continue(char** argv) {
+    return loop_control(argv, &continue_levels);
+}
+
+int builtin_return(char** argv) {
+    long n = count_arg(argv, last_status);
+    if (n == -1) return 2;
+    if (func_depth == 0) {
+        fprintf(stderr, "return: can only return from a function\n");
+        return 1;
+    }
+    returning = 1;
+    return_status = n & 255;
+    return return_status;
+}
+
+int builtin_shift(char** argv) {
+    long n = count_arg(argv, 1);
+    if (n == -1) return 2;
+    if (n > pos_count) {
+        fprintf(stderr, "shift: shift count out of range\n");
+        return 1;
+    }
+    pos_args += n;
+    pos_count -= n;
+    return 0;
+}
+
+int builtin_parsecache(char** argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-c") == 0) clear_parse_cache();
+    else parse_cache_stats();
+    return 0;
+}
+
+// Returns the pid index slot for pid: its entry, or where it would go
+static PidSlot* pid_slot(pid_t pid) {
+    size_t i = ((size_t)pid * 2654435761u) & (job_pids_cap - 1);
+    PidSlot* tomb = NULL;
+    while (job_pids[i].pid != 0 && job_pids[i].pid != pid) {
+        if (job_pids[i].pid == -1 && tomb == NULL) tomb = &job_pids[i];
+        i = (i + 1) & (job_pids_cap - 1);
+    }
+    if (job_pids[i].pid == 0 && tomb != NULL) return tomb;
+    return &job_pids[i];
+}
+
+// Rebuilds the pid index at twice the live size, dropping deleted slots
+static void pid_index_grow(size_t live) {
+    PidSlot* old = job_pids;
+    size_t old_cap = job_pids_cap;
+    job_pids_cap = JOB_TABLE_INITIAL * 2;
+    while (job_pids_cap < (live + 1) * 4) job_pids_cap *= 2;
+    job_pids = (PidSlot*)calloc(job_pids_cap, sizeof(PidSlot));
+    if (job_pids == NULL) {
+        perror("Job table allocation failed");
+        exit(1);
+    }
+    job_pids_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].pid > 0) {
+            *pid_slot(old[i].pid) = old[i];
+            job_pids_used++;
+        }
+    }
+    free(old);
+}
+
+// Adds a background or stopped pipeline to the job table, with its process
+// group if it has one, and returns its job id. It becomes the current job.
+int add_job(pid_t* pids, int nprocs, char* cmd, pid_t pgid) {
+    int id = max_job_id + 1;
+    if (id > jobs_cap) {
+        int cap = jobs_cap ? jobs_cap * 2 : JOB_TABLE_INITIAL;
+        Job* bigger = (Job*)realloc(jobs, sizeof(Job) * cap);
+        if (bigger == NULL) {
+            perror("Job table allocation failed");
+            return 0;
+        }
+        memset(bigger + jobs_cap, 0, sizeof(Job) * (cap - jobs_cap));
+        jobs = bigger;
+        jobs_cap = cap;
+    }
+
+    Job* job = &jobs[id - 1];
+    job->id = id;
+    job->state = job->reported = JOB_RUNNING;
+    job->pgid = pgid;
+    job->pids = (pid_t*)malloc(sizeof(pid_t) * nprocs);
+    job->nprocs = nprocs;
+    job->live = 0;
+    job->nstopped = 0;
+    job->has_tmodes = 0;
+    job->status = 0;
+    job->command = strdup(cmd);
+    job->cgroup = NULL;
+    job->seq = acct_enabled ? ++acct_seq : 0;
+    job->start = clock_seconds(CLOCK_REALTIME);
+    job->launched = clock_seconds(CLOCK_MONOTONIC);
+    max_job_id = id;
+    current_job = id;
+
+    if ((job_pids_used + nprocs + 1) * 2 > job_pids_cap) pid_index_grow(job_pids_used + nprocs);
+    for (int i = 0; i < nprocs; i++) {
+        job->pids[i] = pids[i];
+        if (pids[i] <= 0) continue;
+        PidSlot* slot = pid_slot(pids[i]);
+        if (slot->pid == 0) job_pids_used++;
+        slot->pid = pids[i];
+        slot->job_id = id;
+        slot->pidfd = use_pidfds ? watch_pid(pids[i], pids[i]) : -1;
+        slot->stopped = 0;
+        job->live++;
+    }
+    if (job->live == 0) {
+        job->state = JOB_DONE;
+        jobs_done++;
+    }
+    return id;
+}
+
+// Lets the reaper collect a child that belongs to no job, such as a
+// process substitution, without ever reporting it
+void adopt_child(pid_t pid) {
+    if ((job_pids_used + 2) * 2 > job_pids_cap) pid_index_grow(job_pids_used + 1);
+    PidSlot* slot = pid_slot(pid);
+    if (slot->pid == 0) job_pids_used++;
+    slot->pid = pid;
+    slot->job_id = 0;
+    slot->pidfd = use_pidfds ? watch_pid(pid, pid) : -1;
+    slot->stopped = 0;
+}
+
+// Returns the job with the given id, or NULL
+Job* find_job(int id) {
+    if (id < 1 || id > max_job_id || jobs[id - 1].id == 0) return NULL;
+    return &jobs[id - 1];
+}
+
+// Lists all jobs with their state, the current one marked with a +
+void list_jobs() {
+    for (int id = 1; id <= max_job_id; id++) {
+        Job* job = find_job(id);
+        if (job == NULL) continue;
+        char mark = id == current_job ? '+' : ' ';
+        if (job->state == JOB_RUNNING)
+            printf("[%d]%c Running   %d %s\n", id, mark, job->pids[job->nprocs - 1], job->command);
+        else if (job->state == JOB_STOPPED)
+            printf("[%d]%c Stopped   %d %s\n", id, mark, job->pids[job->nprocs - 1], job->command);
+        else
+            printf("[%d]%c Done (%d) %d %s\n", id, mark, job->status, job->pids[job->nprocs - 1], job->command);
+        if (job->state != JOB_DONE) job->reported = job->state;
+    }
+}
+
+// Sends sig to a job: to its process group under job control, otherwise
+// to each of its processes not yet reaped. Returns -1 if that failed.
+int signal_job(Job* job, int sig) {
+    if (job->pgid > 0) return killpg(job->pgid, sig) == -1 && errno != ESRCH ? -1 : 0;
+    for (int i = 0; i < job->nprocs; i++) {
+        PidSlot* slot = job->pids[i] > 0 ? pid_slot(job->pids[i]) : NULL;
+        if (slot == NULL || slot->pid != job->pids[i] || slot->job_id != job->id) continue;
+        if (kill(job->pids[i], sig) == -1 && errno != ESRCH) return -1;
+    }
+    return 0;
+}
+
+// Marks every live process of a job stopped, as ^Z leaves a pipeline;
+// a process that was not will report continuing when it does
+void stop_job(Job* job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->pids[i] > 0) job_changed(job->pids[i], 1);
+    }
+    if (job->state != JOB_DONE) job->reported = job->state;
+}
+
+// Resumes a stopped job. Its processes count as running from now on,
+// without waiting for each one's continue to be reported.
+void continue_job(Job* job) {
+    signal_job(job, SIGCONT);
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->pids[i] > 0) job_changed(job->pids[i], 0);
+    }
+    if (job->state != JOB_DONE) job->reported = job->state;
+}
+
+// Waits for a job to finish or, under job control, to stop, and returns
+// its status. One in the foreground gets the terminal back afterwards. A
+// finished job leaves the table without being announced.
+int wait_job(Job* job, int foreground) {
+    while (job->state == JOB_RUNNING) {
+        child_events(-1, NULL);
+        reap_jobs();
+    }
+    if (foreground) reclaim_terminal(job->state == JOB_STOPPED ? job : NULL);
+    if (job->state == JOB_STOPPED) {
+        if (foreground) printf("\n[%d] Stopped   %s\n", job->id, job->command);
+        job->reported = JOB_STOPPED;
+        return 128 + SIGTSTP;
+    }
+    int status = job->status;
+    remove_job(job);
+    jobs_done--;
+    return status;
+}
+
+// Frees a finished job's slot and its pid index entries
+void remove_job(Job* job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->pids[i] <= 0) continue;
+        PidSlot* slot = pid_slot(job->pids[i]);
+        if (slot->pid == job->pids[i] && slot->job_id == job->id) {
+            if (slot->pidfd != -1) close(slot->pidfd);
+            slot->pid = -1;
+        }
+    }
+    free(job->pids);
+    free(job->command);
+    if (job->cgroup != NULL) {
+        rmdir(job->cgroup);
+        free(job->cgroup);
+        job->cgroup = NULL;
+    }
+    if (current_job == job->id) current_job = 0;
+    job->id = 0;
+    while (max_job_id > 0 && jobs[max_job_id - 1].id == 0) max_job_id--;
+}
+
+// Drops a job from the table without touching its processes, which are
+// still reaped, silently, like a process substitution's
+void disown_job(Job* job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        PidSlot* slot = job->pids[i] > 0 ? pid_slot(job->pids[i]) : NULL;
+        if (slot != NULL && slot->pid == job->pids[i] && slot->job_id == job->id) slot->job_id = 0;
+    }
+    if (job->state == JOB_DONE) jobs_done--;
+    remove_job(job);
+}
+
+// Turns job control on in an interactive shell whose input is a terminal:
+// the shell gets a process group of its own and makes it the terminal's
+// foreground group, and ignores the keyboard's signals, which reach the
+// foreground job instead
+void init_job_control() {
+    if (!interactive || !isatty(STDIN_FILENO)) return;
+    // Wait while started in the background, as "version7 &" would be
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    // A session leader, like a login shell, already leads its group
+    if (shell_pgid != getpid() && setpgid(0, 0) == 0) shell_pgid = getpid();
+    // A copy of the terminal, so redirecting stdin cannot take it away
+    tty_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    tcsetpgrp(tty_fd, shell_pgid);
+    tcgetattr(tty_fd, &shell_tmodes);
+    job_control = 1;
+}
+
+// Takes the terminal back from a foreground job that finished or, given
+// as stopped, stopped; the modes it left are kept for fg to restore
+void reclaim_terminal(Job* stopped) {
+    if (!job_control) return;
+    tcsetpgrp(tty_fd, shell_pgid);
+    if (stopped != NULL) stopped->has_tmodes = tcgetattr(tty_fd, &stopped->tmodes) == 0;
+    tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+}
+
+// Blocks SIGCHLD and routes it to a signalfd, so child exits become an
+// event the main loop can check without a signal handler
+void init_reaper() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 ||
+        (sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd failed");
+    }
+    pid_index_grow(0);
+}
+
+// Creates the event loop's epoll sets, probing for pidfd support. A
+// forked child calls this again so it never edits the parent's sets,
+// which it would otherwise share.
+void init_event_loop(int input_fd) {
+    struct epoll_event ev;
+
+    if (loop_epoll != -1) close(loop_epoll);
+    if (child_epoll != -1) close(child_epoll);
+    polled_fd = -1;
+    use_pidfds = 0;
+    loop_epoll = epoll_create1(EPOLL_CLOEXEC);
+    child_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_epoll == -1 || child_epoll == -1) {
+        perror("epoll_create1 failed");
+        return;
+    }
+
+    int probe = watch_pid(getpid(), 0);
+    if (probe != -1) {
+        close(probe);
+        use_pidfds = 1;
+    }
+    if (sigchld_fd != -1 && (!use_pidfds || job_control)) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_SIGCHLD;
+        epoll_ctl(child_epoll, EPOLL_CTL_ADD, sigchld_fd, &ev);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_CHILDREN;
+    epoll_ctl(loop_epoll, EPOLL_CTL_ADD, child_epoll, &ev);
+    ev.data.u64 = EV_INPUT;
+    if (input_fd != -1 && epoll_ctl(loop_epoll, EPOLL_CTL_ADD, input_fd, &ev) == 0) polled_fd = input_fd;
+}
+
+// Opens a pidfd for pid and adds it to child_epoll under tag, returning
+// it, or -1 if pidfds are unavailable. The pid 0 probe adds nothing.
+int watch_pid(pid_t pid, uint64_t tag) {
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd == -1 || tag == 0) return fd;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if (epoll_ctl(child_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)pid;
+    (void)tag;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Collects the stops and continues of children, which pidfds do not
+// report, after SIGCHLD. A foreground stage that stopped ends its wait;
+// a job's process is looked up by pid like an exit.
+static void scan_stops(ForegroundWait* fg) {
+    struct signalfd_siginfo sig;
+    siginfo_t info;
+
+    while (read(sigchld_fd, &sig, sizeof(sig)) == sizeof(sig)) {}
+    for (;;) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0) return;
+        int stopped = info.si_code != CLD_CONTINUED;
+        PidSlot* slot = pid_slot(info.si_pid);
+        if (slot->pid == info.si_pid) job_changed(info.si_pid, stopped);
+        else if (fg != NULL && stopped) fg->stopped = 1;
+    }
+}
+
+// Waits up to timeout milliseconds (-1 for ever) for children to exit
+// and reaps each one that has, by its own pid. Foreground stages go into
+// fg; background ones go to the job table. Returns the number of events.
+int child_events(int timeout, ForegroundWait* fg) {
+    struct epoll_event events[16];
+    int n = epoll_wait(child_epoll, events, 16, timeout);
+
+    for (int e = 0; e < n; e++) {
+        uint64_t tag = events[e].data.u64;
+        struct rusage ru;
+        int status = 0;
+        memset(&ru, 0, sizeof(ru));
+
+        if (tag == EV_SIGCHLD) {
+            // With pidfds, SIGCHLD is only watched for stops and continues
+            if (use_pidfds) scan_stops(fg);
+            else reap_pending = 1;
+        } else if (tag & EV_FOREGROUND) {
+            int i = (int)(tag & ~EV_FOREGROUND);
+            if (wait4(fg->pids[i], &status, WNOHANG, &ru) == 0) continue;
+            close(fg->pidfds[i]);
+            fg->pidfds[i] = -1;
+            fg->pids[i] = -fg->pids[i];
+            fg->statuses[i] = status;
+            fg->left--;
+            if (fg->usage != NULL) {
+                usage_from_child(&fg->usage[i], &ru);
+                fg->usage[i].real = clock_seconds(CLOCK_MONOTONIC) - fg->launched[i];
+                fg->usage[i].status = exit_status(status);
+            }
+        } else {
+            pid_t pid = (pid_t)tag;
+            if (wait4(pid, &status, WNOHANG, &ru) == 0) continue;
+            job_exited(pid, status, &ru);
+        }
+    }
+    return n;
+}
+
+// Collects background children that have exited, without blocking. With
+// pidfds each is reaped by its own pid; otherwise SIGCHLD having arrived
+// triggers a sweep with wait4(-1), which is safe because no foreground
+// stage is running whenever this is called.
+void reap_jobs() {
+    if (use_pidfds) {
+        while (child_events(0, NULL) == 16) {}
+        return;
+    }
+
+    struct signalfd_siginfo info;
+    int signalled = sigchld_fd == -1 || reap_pending;
+
+    while (sigchld_fd != -1 && read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) signalled = 1;
+    if (!signalled) return;
+    reap_pending = 0;
+
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    int flags = WNOHANG | (job_control ? WUNTRACED | WCONTINUED : 0);
+    while ((pid = wait4(-1, &status, flags, &ru)) > 0) {
+        if (WIFSTOPPED(status) || WIFCONTINUED(status)) job_changed(pid, WIFSTOPPED(status));
+        else job_exited(pid, status, &ru);
+    }
+}
+
+// Resets what a forked copy of the shell must not share with its parent.
+// The copy does no job control of its own: its commands share its group.
+void forked_child() {
+    signal(SIGPIPE, SIG_DFL);
+    if (job_control) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        job_control = 0;
+    }
+    interactive = 0;
+    more_input = NULL;
+    forked_copy = 1;
+    if (launch_cgroup != -1) close(launch_cgroup);
+    launch_cgroup = -1;
+    close_zygote_socket();
+    init_event_loop(-1);
+}
+
+// Sets a job with processes left running or stopped from them, noting a
+// change for notify_jobs() to announce
+static void update_job_state(Job* job) {
+    job->state = job->nstopped == job->live ? JOB_STOPPED : JOB_RUNNING;
+    if (job->state != job->reported) job_news++;
+}
+
+// Records the exit of a background child in its job, and its resource
+// usage if the job is accounted
+void job_exited(pid_t pid, int status, struct rusage* ru) {
+    PidSlot* slot = pid_slot(pid);
+    if (slot->pid != pid) return;
+    Job* job = find_job(slot->job_id);
+    if (slot->pidfd != -1) close(slot->pidfd);
+    slot->pid = -1;
+    if (job == NULL) return;
+    if (slot->stopped) job->nstopped--;
+    if (pid == job->pids[job->nprocs - 1]) job->status = exit_status(status);
+    if (job->seq != 0) {
+        AcctRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.seq = job->seq;
+        while (rec.stage < job->nprocs - 1 && job->pids[rec.stage] != pid) rec.stage++;
+        rec.status = exit_status(status);
+        rec.start = job->start;
+        rec.real = clock_seconds(CLOCK_MONOTONIC) - job->launched;
+        usage_from_child(&rec, ru);
+        snprintf(rec.command, ACCT_CMD_LEN, "%s", job->command);
+        acct_add(&rec);
+    }
+    if (--job->live == 0) {
+        job->state = JOB_DONE;
+        jobs_done++;
+    } else {
+        update_job_state(job);
+    }
+}
+
+// Records that a job's process stopped, or continued
+void job_changed(pid_t pid, int stopped) {
+    PidSlot* slot = pid_slot(pid);
+    Job* job = slot->pid == pid ? find_job(slot->job_id) : NULL;
+    if (job == NULL || slot->stopped == stopped) return;
+    slot->stopped = stopped;
+    job->nstopped += stopped ? 1 : -1;
+    update_job_state(job);
+}
+
+// Reports finished and newly stopped jobs (interactive only), and frees
+// the finished ones' slots
+void notify_jobs() {
+    for (int id = 1; (jobs_done > 0 || job_news > 0) && id <= max_job_id; id++) {
+        Job* job = find_job(id);
+        if (job == NULL || job->state == job->reported) continue;
+        if (job->state == JOB_STOPPED && interactive) printf("[%d] Stopped   %s\n", id, job->command);
+        job->reported = job->state;
+        if (job->state != JOB_DONE) continue;
+        if (interactive) printf("[%d] Done (%d) %s\n", id, job->status, job->command);
+        remove_job(job);
+        jobs_done--;
+    }
+    job_news = 0;
+}
+
+// Writes a buffer completely to fd
+static void write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += w;
+        len -= w;
+    }
+}
+
+// Builds the argv for one item: every {} in the template is replaced by
+// the item, and the item is appended if the template has no {}
+static char** parallel_argv(char** templ, int nt, char* item) {
+    char** argv = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (nt + 2));
+    int used = 0;
+    size_t item_len = strlen(item);
+
+    for (int i = 0; i < nt; i++) {
+        char* t = templ[i];
+        char* mark = strstr(t, "{}");
+        if (mark == NULL) {
+            argv[i] = t;
+            continue;
+        }
+        used = 1;
+        size_t count = 0;
+        for (char* m = mark; m != NULL; m = strstr(m + 2, "{}")) count++;
+        char* out = (char*)arena_alloc(&cmd_arena, strlen(t) + count * item_len + 1);
+        argv[i] = out;
+        for (char* m = mark; m != NULL; m = strstr(t, "{}")) {
+            memcpy(out, t, m - t);
+            out += m - t;
+            memcpy(out, item, item_len);
+            out += item_len;
+            t = m + 2;
+        }
+        strcpy(out, t);
+    }
+    if (!used) argv[nt++] = item;
+    argv[nt] = NULL;
+    return argv;
+}
+
+// The parallel builtin: runs the command template once per input item,
+// keeping up to N workers busy. A worker's slot is refilled as soon as
+// the reaper has collected it and its output pipe has closed. Output is collected per
+// item and printed whole, in completion order or with -k in input order.
+// Items come after ":::" or, one per line, from the file after "::::".
+// Returns the number of failed items.
+int run_parallel(char** arglist) {
+    static char* no_assigns[] = {NULL};
+    int njobs = PARALLEL_DEFAULT_JOBS, keep_order = 0;
+    int i = 1;
+
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        if (strcmp(arglist[i], "-k") == 0) {
+            keep_order = 1;
+        } else if (strcmp(arglist[i], "-j") == 0 && arglist[i + 1] != NULL) {
+            njobs = atoi(arglist[++i]);
+        } else if (strncmp(arglist[i], "-j", 2) == 0 && arglist[i][2] != '\0') {
+            njobs = atoi(arglist[i] + 2);
+        } else {
+            break;
+        }
+    }
+    if (njobs < 1) njobs = 1;
+
+    char** templ = &arglist[i];
+    int nt = 0;
+    while (templ[nt] != NULL && strcmp(templ[nt], ":::") != 0 && strcmp(templ[nt], "::::") != 0) nt++;
+    if (nt == 0 || templ[nt] == NULL || (strcmp(templ[nt], "::::") == 0 && templ[nt + 1] == NULL)) {
+        fprintf(stderr, "Usage: parallel [-j N] [-k] command [args] ::: items | :::: file\n");
+        return 1;
+    }
+
+    char** items = &templ[nt + 1];
+    int nitems = 0;
+    if (strcmp(templ[nt], "::::") == 0) {
+        int fd = open(templ[nt + 1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "parallel: %s: %s\n", templ[nt + 1], strerror(errno));
+            return 1;
+        }
+        LineReader reader;
+        size_t len, cap = 64;
+        char* line;
+        lr_init(&reader, fd);
+        items = (char**)arena_alloc(&cmd_arena, sizeof(char*) * cap);
+        while ((line = lr_next_line(&reader, &len)) != NULL) {
+            if (nitems == (int)cap) {
+                char** bigger = (char**)arena_alloc(&cmd_arena, sizeof(char*) * cap * 2);
+                memcpy(bigger, items, sizeof(char*) * cap);
+                items = bigger;
+                cap *= 2;
+            }
+            items[nitems++] = arena_strdup(&cmd_arena, line);
+        }
+        free(reader.buf);
+        close(fd);
+    } else {
+        while (items[nitems] != NULL) nitems++;
+    }
+    templ[nt] = NULL;
+
+    // Finished output waiting for its turn under -k. Items only start
+    // within this window of the next one to print, bounding the queue.
+    int window = njobs * 2;
+    char** pending = (char**)arena_alloc(&cmd_arena, sizeof(char*) * window);
+    size_t* pending_len = (size_t*)arena_alloc(&cmd_arena, sizeof(size_t) * window);
+    int* pending_done = (int*)arena_alloc(&cmd_arena, sizeof(int) * window);
+    memset(pending_done, 0, sizeof(int) * window);
+
+    ParallelSlot* slots = (ParallelSlot*)arena_alloc(&cmd_arena, sizeof(ParallelSlot) * njobs);
+    memset(slots, 0, sizeof(ParallelSlot) * njobs);
+    struct pollfd* fds = (struct pollfd*)arena_alloc(&cmd_arena, sizeof(struct pollfd) * (njobs + 1));
+    int* fd_slot = (int*)arena_alloc(&cmd_arena, sizeof(int) * njobs);
+
+    // Workers are watched like foreground stages, slot s under
+    // EV_FOREGROUND | s, so child_events() reaps them along with any
+    // background job that finishes meanwhile
+    ForegroundWait fg = {NULL, NULL, NULL, NULL, NULL, 0, 0};
+    fg.pids = (pid_t*)arena_alloc(&cmd_arena, sizeof(pid_t) * njobs);
+    fg.pidfds = (int*)arena_alloc(&cmd_arena, sizeof(int) * njobs);
+    fg.statuses = (int*)arena_alloc(&cmd_arena, sizeof(int) * njobs);
+    for (int s = 0; s < njobs; s++) {
+        fg.pids[s] = 0;
+        fg.pidfds[s] = -1;
+    }
+
+    int next_item = 0, next_print = 0, running = 0, failed = 0;
+    fflush(stdout);
+
+    // Under -k, one more pass flushes output queued by the last workers
+    while (next_item < nitems || running > 0 || (keep_order && next_print < next_item)) {
+        // Fill idle slots from the queue
+        for (int s = 0; s < njobs && next_item < nitems; s++) {
+            if (slots[s].pid != 0) continue;
+            if (keep_order && next_item >= next_print + window) break;
+
+            int pipe_fd[2];
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+                perror("Pipe failed");
+                break;
+            }
+            // Functions first, then builtins, then PATH, as execute() resolves a stage
+            char** argv = parallel_argv(templ, nt, items[next_item]);
+            Stage stage = {argv, no_assigns, NULL, NULL, find_function(argv[0])};
+            Builtin* builtin = stage_builtin(&stage);
+            pid_t pid = builtin != NULL || stage.function != NULL
+                            ? fork_builtin(builtin, &stage, -1, pipe_fd[1], pipe_fd[0], PGID_SHELL)
+                            : spawn_stage(&stage, -1, pipe_fd[1], PGID_SHELL);
+            close(pipe_fd[1]);
+            if (pid == -1) {
+                close(pipe_fd[0]);
+                failed++;
+                if (keep_order) {
+                    pending[next_item % window] = NULL;
+                    pending_len[next_item % window] = 0;
+                    pending_done[next_item % window] = 1;
+                }
+                next_item++;
+                s--;
+                continue;
+            }
+            place_process(pid, next_affinity_node());
+            slots[s].pid = pid;
+            slots[s].item = next_item++;
+            slots[s].out_fd = pipe_fd[0];
+            slots[s].reaped = 0;
+            slots[s].out = NULL;
+            slots[s].out_len = slots[s].out_cap = 0;
+            fg.pids[s] = pid;
+            fg.pidfds[s] = use_pidfds ? watch_pid(pid, EV_FOREGROUND | s) : -1;
+            running++;
+        }
+
+        // Flush ordered output that is ready
+        while (keep_order && next_print < next_item && pending_done[next_print % window]) {
+            int k = next_print % window;
+            write_all(STDOUT_FILENO, pending[k], pending_len[k]);
+            free(pending[k]);
+            pending_done[k] = 0;
+            next_print++;
+        }
+        if (running == 0) continue;
+
+        // Wait for output or a child exit. A worker no pidfd or SIGCHLD
+        // will announce is checked for every 10ms.
+        int nfds = 0, timeout = -1;
+        for (int s = 0; s < njobs; s++) {
+            if (slots[s].pid == 0) continue;
+            if (slots[s].out_fd != -1) {
+                fds[nfds].fd = slots[s].out_fd;
+                fds[nfds].events = POLLIN;
+                fd_slot[nfds++] = s;
+            }
+            if (!slots[s].reaped && fg.pidfds[s] == -1 && (use_pidfds || sigchld_fd == -1)) timeout = 10;
+        }
+        fds[nfds].fd = child_epoll;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        if (poll(fds, nfds + 1, child_epoll == -1 ? 10 : timeout) == -1) {
+            if (errno != EINTR) {
+                perror("poll failed");
+                break;
+            }
+            continue;
+        }
+
+        if (fds[nfds].revents & POLLIN) child_events(0, &fg);
+        // Workers share the shell's group, so a stop is not a job to make
+        fg.stopped = 0;
+        // Without pidfds SIGCHLD only says some child changed: the sweep
+        // below finds the workers, and reap_jobs() the background jobs
+        if (!use_pidfds) {
+            struct signalfd_siginfo info;
+            while (sigchld_fd != -1 && read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) reap_pending = 1;
+        }
+
+        // Read from the pipes poll() reported, which cannot block
+        for (int f = 0; f < nfds; f++) {
+            if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ParallelSlot* slot = &slots[fd_slot[f]];
+            if (slot->out_len + 4096 > slot->out_cap) {
+                slot->out_cap = slot->out_cap ? slot->out_cap * 2 : 8192;
+                char* bigger = (char*)realloc(slot->out, slot->out_cap);
+                if (bigger == NULL) {
+                    perror("parallel output allocation failed");
+                    exit(1);
+                }
+                slot->out = bigger;
+            }
+            ssize_t n = read(slot->out_fd, slot->out + slot->out_len, slot->out_cap - slot->out_len);
+            if (n > 0) {
+                slot->out_len += n;
+            } else if (n == 0 || errno != EINTR) {
+                close(slot->out_fd);
+                slot->out_fd = -1;
+            }
+        }
+
+        for (int s = 0; s < njobs; s++) {
+            ParallelSlot* slot = &slots[s];
+            if (slot->pid == 0) continue;
+
+            // child_events() marks a worker it reaped by negating its pid
+            int status;
+            if (!slot->reaped && fg.pids[s] < 0) {
+                slot->reaped = 1;
+                slot->status = exit_status(fg.statuses[s]);
+            } else if (!slot->reaped && fg.pidfds[s] == -1 && waitpid(slot->pid, &status, WNOHANG) == slot->pid) {
+                slot->reaped = 1;
+                slot->status = exit_status(status);
+            }
+            if (!slot->reaped || slot->out_fd != -1) continue;
+
+            // Both exited and drained: hand off the output and free the slot
+            if (slot->status != 0) failed++;
+            if (keep_order) {
+                int k = slot->item % window;
+                pending[k] = slot->out;
+                pending_len[k] = slot->out_len;
+                pending_done[k] = 1;
+            } else {
+                write_all(STDOUT_FILENO, slot->out, slot->out_len);
+                free(slot->out);
+            }
+            slot->pid = 0;
+            fg.pids[s] = 0;
+            running--;
+        }
+    }
+    for (int s = 0; s < njobs; s++) {
+        if (fg.pidfds[s] != -1) close(fg.pidfds[s]);
+    }
+    return failed > 100 ? 101 : failed;
+}
+
+// Returns the slot holding the name of len bytes, or the empty slot where
+// it belongs
+static Variable* var_slot(const char* name, size_t len, unsigned long hash) {
+    size_t i = hash & (var_cap - 1);
+    while (var_table[i].name != NULL) {
+        if (var_table[i].hash == hash && strncmp(var_table[i].name, name, len) == 0 &&
+            var_table[i].name[len] == '\0')
+            break;
+        i = (i + 1) & (var_cap - 1);
+    }
+    return &var_table[i];
+}
+
+// Rebuilds the variable table with the variables that are set, doubling
+// it unless dropping the unset slots makes enough room
+static void var_grow() {
+    Variable* old = var_table;
+    size_t old_cap = var_cap;
+    var_cap = old_cap ? old_cap : VAR_TABLE_INITIAL;
+    if ((var_count + 1) * 20 > var_cap * 7) var_cap *= 2;
+    var_table = (Variable*)calloc(var_cap, sizeof(Variable));
+    if (var_table == NULL) {
+        perror("Variable table allocation failed");
+        exit(1);
+    }
+    var_used = var_count;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].value == NULL) continue;
+        size_t j = old[i].hash & (var_cap - 1);
+        while (var_table[j].name != NULL) j = (j + 1) & (var_cap - 1);
+        var_table[j] = old[i];
+    }
+    free(old);
+}
+
+// Looks up a variable by a name that need not be NUL-terminated
+static char* lookup_variable(const char* name, size_t len) {
+    if (var_cap > 0) {
+        Variable* var = var_slot(name, len, hash_bytes(name, len));
+        if (var->value != NULL) return var->value;
+    }
+    // Fall back to the environment, so $HOME and $PATH work
+    char small[256];
+    char* key = len < sizeof(small) ? small : (char*)arena_alloc(&cmd_arena, len + 1);
+    memcpy(key, name, len);
+    key[len] = '\0';
+    return getenv(key);
+}
+
+// Sets a variable to a value of any length. A variable that is also in
+// the environment is updated there too, so PATH changes reach commands.
+void set_variable(const char* name, const char* value) {
+    size_t len = strlen(name), value_len = strlen(value);
+    unsigned long hash = hash_bytes(name, len);
+
+    if (var_cap == 0 || (var_used + 1) * 10 > var_cap * 7) var_grow();
+    Variable* var = var_slot(name, len, hash);
+    if (var->name == NULL) {
+        var->name = arena_strdup(&var_names, name);
+        var->hash = hash;
+        var->value = NULL;
+        var->cap = 0;
+        var_used++;
+    }
+    if (var->value == NULL) var_count++;
+    if (value_len + 1 > var->cap) {
+        var->cap = value_len + 1 > 16 ? value_len + 1 : 16;
+        free(var->value);
+        var->value = (char*)malloc(var->cap);
+        if (var->value == NULL) {
+            perror("Variable allocation failed");
+            exit(1);
+        }
+    }
+    memcpy(var->value, value, value_len + 1);
+
+    if (getenv(name) != NULL) setenv(name, value, 1);
+}
+
+// Returns a variable's value, or NULL if it is not set
+char* get_variable(const char* name) {
+    return lookup_variable(name, strlen(name));
+}
+
+// Removes a variable. Its slot stays as a tombstone holding the name,
+// which set_variable() revives if the name is assigned again.
+void unset_variable(const char* name) {
+    if (var_cap == 0) return;
+    Variable* var = var_slot(name, strlen(name), hash_string(name));
+    if (var->value == NULL) return;
+    free(var->value);
+    var->value = NULL;
+    var->cap = 0;
+    var_count--;
+    unsetenv(name);
+}
+
+// Prints every shell variable
+void list_variables() {
+    printf("Variables:\n");
+    for (size_t i = 0; i < var_cap; i++) {
+        if (var_table[i].value != NULL) printf("%s=%s\n", var_table[i].name, var_table[i].value);
+    }
+}
+
+// Returns 1 if word has the form NAME=value
+int is_assignment(const char* word) {
+    if (!(*word == '_' || (*word >= 'A' && *word <= 'Z') || (*word >= 'a' && *word <= 'z'))) return 0;
+    for (word++; *word != '=' ; word++) {
+        if (!(*word == '_' || (*word >= 'A' && *word <= 'Z') || (*word >= 'a' && *word <= 'z') ||
+              (*word >= '0' && *word <= '9')))
+            return 0;
+    }
+    return 1;
+}
+
+// Returns 1 if word is a valid variable name
+int is_name(const char* word) {
+    size_t len = strspn(word, "_ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
+    return len > 0 && word[len] == '\0' && !(*word >= '0' && *word <= '9');
+}
+
+// Returns the NAME of a NAME=value word as a string in the command arena;
+// the word itself is left alone, since it may belong to a cached parse
+char* assignment_name(const char* word) {
+    size_t len = strchr(word, '=') - word;
+    char* name = (char*)arena_alloc(&cmd_arena, len + 1);
+    memcpy(name, word, len);
+    name[len] = '\0';
+    return name;
+}
+
+// The nth positional parameter, $0 being the shell or script name
+static const char* positional(long n) {
+    if (n == 0) return shell_name;
+    return n <= pos_count ? pos_args[n - 1] : "";
+}
+
+// $1 and on joined by spaces, for $* and a $@ that is not a word of its own
+static char* joined_args() {
+    size_t len = 1;
+    for (int i = 0; i < pos_count; i++) len += strlen(pos_args[i]) + 1;
+    char* joined = (char*)arena_alloc(&cmd_arena, len);
+    char* cp = joined;
+    for (int i = 0; i < pos_count; i++) {
+        if (i > 0) *cp++ = ' ';
+        cp = stpcpy(cp, pos_args[i]);
+    }
+    *cp = '\0';
+    return joined;
+}
+
+// Replaces each marked $NAME, ${NAME}, $? or $$, and the positional
+// parameters $0..$9, ${N}, $#, $@ and $*, in word with its value. Words
+// without a mark are returned untouched. drop is set when the word was
+// nothing but unquoted expansions that came out empty.
+char* expand_word(char* word, int* drop) {
+    if (*word == PROCSUB_IN || *word == PROCSUB_OUT) return process_substitution(word);
+    char* mark = word;
+    while (*mark != '\0' && *mark != VAR_MARK && *mark != VAR_MARK_QUOTED) mark++;
+    if (*mark == '\0') return word;
+
+    size_t cap = strlen(word) * 2 + 64, len = mark - word;
+    char* out = (char*)arena_alloc(&cmd_arena, cap);
+    int quoted = 0, literal = len > 0;
+    memcpy(out, word, len);
+
+    for (char* cp = mark; *cp != '\0'; ) {
+        char numbuf[32];
+        const char* value = NULL;
+        size_t value_len;
+        int escape = 0;
+
+        if (*cp != VAR_MARK && *cp != VAR_MARK_QUOTED) {
+            value = cp++;
+            value_len = 1;
+            literal = 1;
+        } else {
+            if (*cp == VAR_MARK_QUOTED) {
+                quoted = 1;
+                escape = expand_pattern;
+            }
+            cp++;
+            const char* name = cp;
+            size_t name_len = 0;
+            if (*cp == '{') {
+                char* close = strchr(cp, '}');
+                if (close != NULL) {
+                    name = cp + 1;
+                    name_len = close - name;
+                    cp = close + 1;
+                }
+            } else if (*cp == '?' || *cp == '$' || *cp == '#') {
+                sprintf(numbuf, "%d", *cp == '?' ? last_status : *cp == '#' ? pos_count : (int)getpid());
+                value = numbuf;
+                cp++;
+            } else if (*cp >= '0' && *cp <= '9') {
+                value = positional(*cp++ - '0');
+            } else if (*cp == '@' || *cp == '*') {
+                value = joined_args();
+                cp++;
+            } else {
+                while (*cp == '_' || (*cp >= 'A' && *cp <= 'Z') || (*cp >= 'a' && *cp <= 'z') ||
+                       (name_len > 0 && *cp >= '0' && *cp <= '9')) {
+                    cp++;
+                    name_len++;
+                }
+            }
+            if (value == NULL && name_len == 0 && name == cp) {
+                value = "$";    // A lone $ stays literal
+                literal = 1;
+            } else if (value == NULL && *name >= '0' && *name <= '9') {
+                value = positional(strtol(name, NULL, 10));
+            } else if (value == NULL) {
+                value = lookup_variable(name, name_len);
+                if (value == NULL) value = "";
+            }
+            value_len = strlen(value);
+        }
+
+        if (len + value_len * 2 + 1 > cap) {
+            cap = (len + value_len * 2 + 1) * 2;
+            char* bigger = (char*)arena_alloc(&cmd_arena, cap);
+            memcpy(bigger, out, len);
+            out = bigger;
+        }
+        if (escape) {
+            // A quoted value in a case pattern matches itself
+            for (size_t i = 0; i < value_len; i++) {
+                if (strchr(GLOB_CHARS, value[i]) != NULL) out[len++] = '\\';
+                out[len++] = value[i];
+            }
+        } else {
+            memcpy(out + len, value, value_len);
+            len += value_len;
+        }
+    }
+    out[len] = '\0';
+    *drop = len == 0 && !quoted && !literal;
+    return out;
+}
+
+// Maps size bytes of fd, moving an existing mapping if it must grow;
+// keeps the old mapping if the new one fails
+static char* hist_map(int fd, char* old, size_t* mapped, size_t size, int prot) {
+    char* p = old != NULL ? mremap(old, *mapped, size, MREMAP_MAYMOVE)
+                          : mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("history mmap failed");
+        return old;
+    }
+    *mapped = size;
+    return p;
+}
+
+// Returns the index segment holding entry n, remapping the index if another
+// shell has grown it since it was mapped; NULL if the file is too short
+static HistSegment* hist_segment(uint32_t n) {
+    size_t seg = (n - 1) / HIST_SEG_ENTRIES;
+    size_t end = sizeof(HistHeader) + (seg + 1) * sizeof(HistSegment);
+    if (end > hist_index_map) {
+        struct stat st;
+        if (fstat(hist_index_fd, &st) == -1 || (size_t)st.st_size < end) return NULL;
+        hist_index = hist_map(hist_index_fd, hist_index, &hist_index_map, st.st_size,
+                              PROT_READ | PROT_WRITE);
+        if (end > hist_index_map) return NULL;
+    }
+    return (HistSegment*)(hist_index + sizeof(HistHeader)) + seg;
+}
+
+static HistRecord* hist_record(uint32_t n) {
+    HistSegment* seg = hist_segment(n);
+    return seg != NULL ? &seg->rec[(n - 1) % HIST_SEG_ENTRIES] : NULL;
+}
+
+// Returns the text of entry n (not NUL-terminated) and its length
+static char* hist_text(uint32_t n, size_t* len) {
+    HistRecord* rec = hist_record(n);
+    if (rec == NULL) return NULL;
+    size_t end = rec->offset + rec->len;
+    if (end > hist_data_map) {
+        // Map past the end of the file so appends rarely need a remap;
+        // only bytes below the file size are ever touched
+        hist_data = hist_map(hist_fd, hist_data, &hist_data_map, end + end / 2 + (1 << 20), PROT_READ);
+        if (end > hist_data_map) return NULL;
+    }
+    *len = rec->len;
+    return hist_data + rec->offset;
+}
+
+// Filter row for the three bytes at p
+static unsigned hist_trigram(const unsigned char* p) {
+    return ((uint32_t)((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 16) % HIST_FILTER_ROWS;
+}
+
+// Empties the index so it is rebuilt from the data file
+static int hist_reset_index() {
+    size_t size = sizeof(HistHeader) + sizeof(HistSegment);
+    if (hist_index != NULL) munmap(hist_index, hist_index_map);
+    hist_index = NULL;
+    hist_index_map = 0;
+    if (ftruncate(hist_index_fd, 0) == -1 || ftruncate(hist_index_fd, size) == -1) {
+        perror("history index reset failed");
+        return -1;
+    }
+    if ((hist_index = hist_map(hist_index_fd, NULL, &hist_index_map, size, PROT_READ | PROT_WRITE)) == NULL)
+        return -1;
+    ((HistHeader*)hist_index)->magic = HIST_MAGIC;
+    return 0;
+}
+
+// Adds the data file line at offset to the index as the next entry
+static int hist_index_line(uint64_t offset, uint32_t len) {
+    uint32_t n = ((HistHeader*)hist_index)->count + 1;
+    HistSegment* seg = hist_segment(n);
+    if (seg == NULL) {
+        // Out of room: add a segment
+        size_t size = sizeof(HistHeader) + ((n - 1) / HIST_SEG_ENTRIES + 1) * sizeof(HistSegment);
+        if (ftruncate(hist_index_fd, size) == -1 || (seg = hist_segment(n)) == NULL) {
+            perror("history index grow failed");
+            return -1;
+        }
+    }
+    HistHeader* header = (HistHeader*)hist_index;
+    HistRecord* rec = &seg->rec[(n - 1) % HIST_SEG_ENTRIES];
+    unsigned block = (n - 1) % HIST_SEG_ENTRIES / HIST_BLOCK;
+    const unsigned char* text = (const unsigned char*)hist_data + offset;
+    unsigned first = text[0];
+    unsigned pair = first << 8 | (len > 1 ? text[1] : 0);
+
+    rec->offset = offset;
+    rec->len = len;
+    rec->prev_first = header->first[first];
+    header->first[first] = n;
+    rec->prev_pair = header->pair[pair];
+    header->pair[pair] = n;
+    for (uint32_t i = 0; i + 2 < len; i++) {
+        seg->filter[hist_trigram(text + i)][block / 64] |= 1ULL << (block % 64);
+    }
+    header->count = n;
+    return 0;
+}
+
+// Indexes the data file past the end of the index: all of it for a new or
+// rebuilt index, otherwise whatever was appended since. Called with the
+// index locked.
+static void hist_catch_up() {
+    struct stat st;
+    if (fstat(hist_fd, &st) == -1) return;
+    size_t size = st.st_size;
+    if (((HistHeader*)hist_index)->data_size == size) return;
+    // The data file shrank, so it was truncated or replaced
+    if (((HistHeader*)hist_index)->data_size > size && hist_reset_index() == -1) return;
+    if (size > hist_data_map) {
+        hist_data = hist_map(hist_fd, hist_data, &hist_data_map, size + size / 2 + (1 << 20), PROT_READ);
+        if (size > hist_data_map) return;
+    }
+
+    size_t pos = ((HistHeader*)hist_index)->data_size;
+    while (pos < size) {
+        char* nl = memchr(hist_data + pos, '\n', size - pos);
+        if (nl == NULL) break;  // A line still being written
+        size_t len = nl - (hist_data + pos);
+        if (len > 0 && hist_index_line(pos, len) == -1) break;
+        pos += len + 1;
+        ((HistHeader*)hist_index)->data_size = pos;
+    }
+}
+
+// Opens the history named by HISTFILE, or ~/.pucit_history, creating it if
+// needed. Only the index header and any unindexed tail of the data file are
+// read, so startup does not slow down as the history grows.
+void init_history() {
+    char path[PATH_MAX], index_path[PATH_MAX + 8];
+    char* file = getenv("HISTFILE");
+    char* home = getenv("HOME");
+
+    if (hist_index != NULL) return;
+    if (file != NULL && *file != '\0') {
+        snprintf(path, sizeof(path), "%s", file);
+    } else if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/.pucit_history", home);
+    } else {
+        return;
+    }
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    hist_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    hist_index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_fd == -1 || hist_index_fd == -1) {
+        perror("history unavailable");
+        close_history();
+        return;
+    }
+
+    flock(hist_index_fd, LOCK_EX);
+    struct stat st;
+    if (fstat(hist_index_fd, &st) == 0 && (size_t)st.st_size >= sizeof(HistHeader) + sizeof(HistSegment))
+        hist_index = hist_map(hist_index_fd, NULL, &hist_index_map, st.st_size, PROT_READ | PROT_WRITE);
+    // A missing, foreign or cut-off index is rebuilt from the data file
+    HistHeader* header = (HistHeader*)hist_index;
+    if (header == NULL || header->magic != HIST_MAGIC ||
+        (header->count > 0 && hist_segment(header->count) == NULL))
+        hist_reset_index();
+    if (hist_index != NULL) hist_catch_up();
+    flock(hist_index_fd, LOCK_UN);
+    if (hist_index == NULL) close_history();
+}
+
+// Unmaps and closes the history files
+void close_history() {
+    if (hist_data != NULL) munmap(hist_data, hist_data_map);
+    if (hist_index != NULL) munmap(hist_index, hist_index_map);
+    if (hist_fd != -1) close(hist_fd);
+    if (hist_index_fd != -1) close(hist_index_fd);
+    hist_data = hist_index = NULL;
+    hist_data_map = hist_index_map = 0;
+    hist_fd = hist_index_fd = -1;
+}
+
+// Appends a command to the history file and indexes it. The line goes out
+// in one O_APPEND write under the index lock, so shells sharing a history
+// interleave whole lines and each indexes the others' on its next append.
+// A multi-line command stays one line, its newlines stored as HIST_NEWLINE.
+void add_to_history(char* cmd) {
+    size_t len = strlen(cmd);
+
+    if (hist_index == NULL || len == 0) return;
+    if (memchr(cmd, '\n', len) != NULL) {
+        cmd = arena_strdup(&cmd_arena, cmd);
+        for (char* nl = cmd; (nl = strchr(nl, '\n')) != NULL; ) *nl = HIST_NEWLINE;
+    }
+    struct iovec line[2] = {{cmd, len}, {"\n", 1}};
+    flock(hist_index_fd, LOCK_EX);
+    if (writev(hist_fd, line, 2) != (ssize_t)(len + 1)) perror("history write failed");
+    hist_catch_up();
+    flock(hist_index_fd, LOCK_UN);
+}
+
+// Returns the number of commands in the history
+unsigned history_length() {
+    return hist_index != NULL ? ((HistHeader*)hist_index)->count : 0;
+}
+
+// Returns a copy of history entry n (counting from 1), or NULL
+char* get_history_command(unsigned n) {
+    size_t len;
+    char* text;
+
+    if (n < 1 || n > history_length() || (text = hist_text(n, &len)) == NULL) return NULL;
+    char* cmd = arena_alloc(&cmd_arena, len + 1);
+    for (size_t i = 0; i < len; i++) cmd[i] = text[i] == HIST_NEWLINE ? '\n' : text[i];
+    cmd[len] = '\0';
+    return cmd;
+}
+
+// Returns the newest entry starting with prefix, or 0. Only the entries in
+// the bucket for the prefix's first one or two bytes are compared.
+unsigned find_history_prefix(const char* prefix) {
+    size_t plen = strlen(prefix);
+    const unsigned char* p = (const unsigned char*)prefix;
+
+    if (hist_index == NULL || plen == 0) return 0;
+    HistHeader* header = (HistHeader*)hist_index;
+    uint32_t n = plen == 1 ? header->first[p[0]] : header->pair[p[0] << 8 | p[1]];
+    while (n != 0) {
+        size_t len;
+        char* text = hist_text(n, &len);
+        if (text == NULL) return 0;
+        if (len >= plen && memcmp(text, prefix, plen) == 0) return n;
+        HistRecord* rec = hist_record(n);
+        n = plen == 1 ? rec->prev_first : rec->prev_pair;
+    }
+    return 0;
+}
+
+// Resolves a ! reference to a copy of the command it repeats: !! or !- for
+// the last command, !n for entry n, !-n for the nth most recent and !prefix
+// for the newest one starting with prefix. Returns NULL if there is none.
+char* expand_history(char* cmdline) {
+    char* ref = cmdline + 1;
+    long count = history_length();
+    long n;
+
+    if (strcmp(ref, "!") == 0 || strcmp(ref, "-") == 0) {
+        n = count;
+    } else if (ref[0] == '-' && isdigit((unsigned char)ref[1])) {
+        n = count + 1 - atol(ref + 1);
+    } else if (isdigit((unsigned char)ref[0])) {
+        n = atol(ref);
+    } else {
+        n = find_history_prefix(ref);
+    }
+    return n >= 1 && n <= count ? get_history_command(n) : NULL;
+}
+
+static void print_history_entry(uint32_t n) {
+    size_t len;
+    char* text = hist_text(n, &len);
+    if (text == NULL) return;
+    printf("%5u  ", n);
+    for (size_t i = 0; i < len; i++) putchar(text[i] == HIST_NEWLINE ? '\n' : text[i]);
+    putchar('\n');
+}
+
+// Prints the last max history entries
+void list_history(int max) {
+    unsigned count = history_length();
+    unsigned first = max > 0 && (unsigned)max < count ? count - max + 1 : 1;
+    for (unsigned n = first; n <= count; n++) print_history_entry(n);
+}
+
+// Adds the entries of the block starting at entry first that contain
+// pattern to found, newest first; returns the new number found
+static int hist_search_block(uint32_t first, const char* pattern, size_t plen,
+                             uint32_t* found, int nfound, int max) {
+    uint32_t count = history_length();
+    uint32_t last = first + HIST_BLOCK - 1 < count ? first + HIST_BLOCK - 1 : count;
+    size_t first_len, last_len;
+    char* from = hist_text(first, &first_len);
+    char* to = hist_text(last, &last_len);
+
+    // The block's lines are contiguous in the data file, so one scan over
+    // them rules out a block the filter could not
+    if (from == NULL || to == NULL || memmem(from, to + last_len - from, pattern, plen) == NULL)
+        return nfound;
+    for (uint32_t n = last; n >= first && nfound < max; n--) {
+        size_t len;
+        char* text = hist_text(n, &len);
+        if (text != NULL && memmem(text, len, pattern, plen) != NULL) found[nfound++] = n;
+    }
+    return nfound;
+}
+
+// Prints the newest max entries containing pattern, oldest first. Only
+// blocks whose filter has every trigram of the pattern are read.
+void search_history(const char* pattern, int max) {
+    size_t plen = strlen(pattern);
+    uint32_t count = history_length();
+    int nfound = 0, nrows = 0;
+
+    if (count == 0 || plen == 0 || max <= 0) return;
+    if ((uint32_t)max > count) max = count;
+    uint32_t* found = arena_alloc(&cmd_arena, sizeof(uint32_t) * max);
+    unsigned* rows = arena_alloc(&cmd_arena, sizeof(unsigned) * plen);
+    for (size_t i = 0; i + 2 < plen; i++) rows[nrows++] = hist_trigram((const unsigned char*)pattern + i);
+
+    for (uint32_t s = (count - 1) / HIST_SEG_ENTRIES + 1; s-- > 0 && nfound < max; ) {
+        HistSegment* seg = hist_segment(s * HIST_SEG_ENTRIES + 1);
+        if (seg == NULL) break;
+        for (int w = HIST_SEGMENT / 64 - 1; w >= 0 && nfound < max; w--) {
+            uint64_t blocks = ~0ULL;
+            for (int r = 0; r < nrows && blocks != 0; r++) blocks &= seg->filter[rows[r]][w];
+            while (blocks != 0 && nfound < max) {
+                int bit = 63 - __builtin_clzll(blocks);
+                uint32_t first = s * HIST_SEG_ENTRIES + (w * 64 + bit) * HIST_BLOCK + 1;
+                blocks &= ~(1ULL << bit);
+                if (first <= count) nfound = hist_search_block(first, pattern, plen, found, nfound, max);
+            }
+        }
+    }
+    for (int i = nfound - 1; i >= 0; i--) print_history_entry(found[i]);
+}
+
+// How each token type reads in a syntax error
+static const char* token_names[] = {
+    "", "word", "number", "|", "&&", "||", ";", "&", "<", ">", ">>", "<&", ">&", "<<", "<<-", "<<<",
+    "newline", "(", ")", ";;", "end of input",
+};
+
+// Returns the type of the operator starting at cp and sets *len to its
+// length, or returns 0 if cp does not start an operator
+static int operator_at(const char* cp, int* len) {
+    *len = 2;
+    switch (cp[0]) {
+        case '|':
+            if (cp[1] == '|') return TOK_OR;
+            *len = 1;
+            return TOK_PIPE;
+        case '&':
+            if (cp[1] == '&') return TOK_AND;
+            *len = 1;
+            return TOK_AMP;
+        case '>':
+            if (cp[1] == '>') return TOK_DGREAT;
+            if (cp[1] == '&') return TOK_GREATAND;
+            *len = 1;
+            return TOK_GREAT;
+        case '<':
+            if (cp[1] == '<') {
+                if (cp[2] != '<' && cp[2] != '-') return TOK_DLESS;
+                *len = 3;
+                return cp[2] == '<' ? TOK_TLESS : TOK_DLESSDASH;
+            }
+            if (cp[1] == '&') return TOK_LESSAND;
+            *len = 1;
+            return TOK_LESS;
+        case ';':
+            if (cp[1] == ';') return TOK_DSEMI;
+            *len = 1;
+            return TOK_SEMI;
+        case '\n':
+            *len = 1;
+            return TOK_NEWLINE;
+        case '(':
+            *len = 1;
+            return TOK_LPAREN;
+        case ')':
+            *len = 1;
+            return TOK_RPAREN;
+    }
+    return 0;
+}
+
+// Returns the ) that closes a process substitution whose list starts at
+// cp, skipping nested parentheses and quoted text, or NULL
+static char* procsub_end(char* cp) {
+    int depth = 1;
+    char quote = 0;
+    for (; *cp != '\0'; cp++) {
+        if (quote) {
+            if (*cp == quote) quote = 0;
+            else if (quote == '"' && *cp == '\\' && cp[1] != '\0') cp++;
+        } else if (*cp == '\'' || *cp == '"') {
+            quote = *cp;
+        } else if (*cp == '\\' && cp[1] != '\0') {
+            cp++;
+        } else if (*cp == '(') {
+            depth++;
+        } else if (*cp == ')' && --depth == 0) {
+            return cp;
+        }
+    }
+    return NULL;
+}
+
+static int is_redirect_token(int type) {
+    return type >= TOK_LESS && type <= TOK_TLESS;
+}
+
+// Whether lex() or parse() should print a message. While a script is
+// compiled nothing is printed: the script then runs line by line after
+// all, and the message comes out when its line is reached.
+static int parse_report() {
+    if (!script_compiling) return 1;
+    script_compile_failed = 1;
+    return 0;
+}
+
+// Reads the body of a here-document from the lines starting at *cpp, up
+// to one that is just the delimiter, squeezing it in place like a word.
+// <<- strips leading tabs. Unless the delimiter was quoted, $ is marked
+// for expansion and \$, \` and \\ are escapes. The delimiter token's text
+// becomes the body and *cpp moves past the delimiter line. Returns -1 if
+// the text ends first and more lines may follow.
+static int heredoc_body(char** cpp, Token* delim, int strip_tabs) {
+    char* cp = *cpp;
+    char* out = cp;
+    char* body = cp;
+    size_t delim_len = strlen(delim->text);
+    int expand = !delim->quoted;
+
+    for (;;) {
+        if (strip_tabs) {
+            while (*cp == '\t') cp++;
+        }
+        char* end = strchrnul(cp, '\n');
+        if ((size_t)(end - cp) == delim_len && memcmp(cp, delim->text, delim_len) == 0) {
+            cp = *end != '\0' ? end + 1 : end;
+            break;
+        }
+        if (*end == '\0' && lex_partial) {
+            lex_heredoc = delim;
+            return -1;
+        }
+        if (*end == '\0' && parse_report())
+            fprintf(stderr, "warning: here-document ended by end of input (wanted '%s')\n", delim->text);
+        for (; cp < end; cp++) {
+            char c = *cp;
+            if (expand && c == '\\' && (cp[1] == '$' || cp[1] == '`' || cp[1] == '\\'))
+                c = *++cp;
+            else if (expand && c == '$')
+                c = VAR_MARK_QUOTED;
+            *out++ = c;
+        }
+        if (*end == '\0') break;
+        *out++ = '\n';
+        cp = end + 1;
+    }
+    // out never passes the delimiter line, which has been read by now
+    *out = '\0';
+    delim->text = body;
+    *cpp = cp;
+    return 0;
+}
+
+// Notes that c, about to be written at offset off of the word being
+// lexed, came from quotes or a backslash
+static void lex_quoted(char c, int off) {
+    if (c == '\0' || strchr(GLOB_CHARS, c) == NULL) return;
+    if (lex_nglobs == lex_globs_cap) {
+        lex_globs_cap = lex_globs_cap == 0 ? 16 : lex_globs_cap * 2;
+        int* bigger = (int*)arena_alloc(&cmd_arena, sizeof(int) * lex_globs_cap);
+        if (lex_nglobs > 0) memcpy(bigger, lex_globs, sizeof(int) * lex_nglobs);
+        lex_globs = bigger;
+    }
+    lex_globs[lex_nglobs++] = off;
+}
+
+// Returns a copy of the len byte word with a backslash before each quoted
+// glob character lex_quoted() noted, for use as a case pattern
+static char* lex_pattern(const char* word, size_t len) {
+    char* pattern = (char*)arena_alloc(&cmd_arena, len + lex_nglobs + 1);
+    char* out = pattern;
+    for (int i = 0, off = 0; (size_t)off <= len; off++) {
+        if (i < lex_nglobs && lex_globs[i] == off) {
+            *out++ = '\\';
+            i++;
+        }
+        *out++ = word[off];
+    }
+    return pattern;
+}
+
+// Reads the bodies of the here-documents among a line's count tokens, in
+// order, from the text at *cpp
+static int line_heredocs(char** cpp, Token* line, size_t count) {
+    for (size_t i = 0; i + 1 < count; i++) {
+        if ((line[i].type == TOK_DLESS || line[i].type == TOK_DLESSDASH) && line[i + 1].type == TOK_WORD &&
+            heredoc_body(cpp, &line[i + 1], line[i].type == TOK_DLESSDASH) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Splits command line input into tokens in a single pass. A $ that should
+// expand is left as VAR_MARK (or VAR_MARK_QUOTED) for expand_word(). Words
+// are sliced out of cmdline in place: quotes and backslashes are squeezed
+// out by copying each byte at most once towards the word start, and every
+// word is terminated where its delimiter was. Operators need no spaces
+// around them, and unquoted digits directly before < or > become a
+// TOK_IO_NUMBER. Newlines are tokens, and the bodies of the line's
+// here-documents are read from the lines after each one. The token array
+// grows in the arena and ends with TOK_END; the words of each line are
+// checked against ARG_MAX. With lex_partial set, text that ends inside a
+// quote, a <(list) or a here-document, or after a trailing backslash, sets
+// *ntokens to -1 and returns NULL without a message, so more can be read.
+Token* lex(char* cmdline, int* ntokens) {
+    size_t cap = ARGV_INITIAL, n = 0, total = 0;
+    size_t line_start = 0;  // First token of the current line
+    Token* tokens = (Token*)arena_alloc(&cmd_arena, sizeof(Token) * cap);
+    char* cp = cmdline;     // Next byte to read
+    char* out;              // Next byte to write in the current word
+    int op, oplen;
+    static long arg_max = 0;
+
+    if (arg_max == 0) arg_max = sysconf(_SC_ARG_MAX);
+    *ntokens = 0;
+    lex_heredoc = NULL;
+    // The offsets live in cmd_arena, which is reset between commands
+    lex_globs = NULL;
+    lex_globs_cap = 0;
+
+    for (;;) {
+        // The here-documents of a line start after its newline
+        if (n > line_start && tokens[n - 1].type == TOK_NEWLINE) {
+            if (line_heredocs(&cp, tokens + line_start, n - line_start) == -1) {
+                *ntokens = -1;
+                return NULL;
+            }
+            line_start = n;
+            total = 0;
+        }
+
+        while (*cp == ' ' || *cp == '\t' || (*cp == '\\' && cp[1] == '\n')) cp += *cp == '\\' ? 2 : 1;
+        // A word starting with # comments out the rest of the line
+        if (*cp == '#') cp = strchrnul(cp, '\n');
+        if (*cp == '\0') break;
+
+        // Room for a word, the operator after it and TOK_END
+        if (n + 3 > cap) {
+            Token* bigger = (Token*)arena_alloc(&cmd_arena, sizeof(Token) * cap * 2);
+            memcpy(bigger, tokens, sizeof(Token) * n);
+            tokens = bigger;
+            cap *= 2;
+        }
+
+        // <(list) and >(list) become one word: a PROCSUB mark, then the list
+        if ((*cp == '<' || *cp == '>') && cp[1] == '(') {
+            char* end = procsub_end(cp + 2);
+            if (end == NULL && lex_partial) {
+                *ntokens = -1;
+                return NULL;
+            }
+            if (end == NULL) {
+                if (parse_report()) printf("Syntax error: unterminated %c(\n", *cp);
+                return NULL;
+            }
+            size_t list_len = end - (cp + 2);
+            *cp = *cp == '<' ? PROCSUB_IN : PROCSUB_OUT;
+            memmove(cp + 1, cp + 2, list_len);
+            cp[1 + list_len] = '\0';
+            tokens[n].type = TOK_WORD;
+            tokens[n].quoted = 1;
+            tokens[n].pattern = NULL;
+            tokens[n++].text = cp;
+            total += list_len + 2 + sizeof(char*);
+            cp = end + 1;
+            continue;
+        }
+
+        if ((op = operator_at(cp, &oplen)) != 0) {
+            tokens[n].type = op;
+            tokens[n].quoted = 0;
+            tokens[n++].text = NULL;
+            cp += oplen;
+            continue;
+        }
+
+        char* start = out = cp;
+        char quote = 0;
+        int quoted = 0;
+        lex_nglobs = 0;
+        for (;;) {
+            char c = *cp;
+            if (c == '\0') {
+                if (quote && lex_partial) {
+                    *ntokens = -1;
+                    return NULL;
+                }
+                if (quote) {
+                    if (parse_report()) printf("Syntax error: unterminated %c quote\n", quote);
+                    return NULL;
+                }
+                break;
+            }
+            if (quote == '\'') {
+                cp++;
+                if (c == '\'') {
+                    quote = 0;
+                } else {
+                    lex_quoted(c, out - start);
+                    *out++ = c;
+                }
+            } else if (quote == '"') {
+                cp++;
+                if (c == '"') {
+                    quote = 0;
+                } else if (c == '\\' && *cp == '\n') {
+                    cp++;
+                } else if (c == '\\' && (*cp == '"' || *cp == '\\' || *cp == '$' || *cp == '`')) {
+                    lex_quoted(*cp, out - start);
+                    *out++ = *cp++;
+                } else {
+                    lex_quoted(c, out - start);
+                    *out++ = c == '$' ? VAR_MARK_QUOTED : c;
+                }
+            } else if (c == ' ' || c == '\t' || operator_at(cp, &oplen) != 0) {
+                break;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+                quoted = 1;
+                cp++;
+            } else if (c == '\\' && cp[1] == '\n') {
+                // A backslash-newline joins the lines
+                cp += 2;
+            } else if (c == '\\' && cp[1] == '\0' && lex_partial) {
+                *ntokens = -1;
+                return NULL;
+            } else if (c == '\\' && cp[1] != '\0') {
+                lex_quoted(cp[1], out - start);
+                *out++ = cp[1];
+                quoted = 1;
+                cp += 2;
+            } else {
+                *out++ = c == '$' ? VAR_MARK : c;
+                cp++;
+            }
+        }
+
+        // The delimiter is consumed before the terminator is written, since
+        // out may point at it when nothing was squeezed out of the word. A
+        // <( or >( right after the word is left to start the next one.
+        op = operator_at(cp, &oplen);
+        if ((*cp == '<' || *cp == '>') && cp[1] == '(') op = 0;
+        else cp += op != 0 ? oplen : *cp != '\0';
+        *out = '\0';
+        tokens[n].type = TOK_WORD;
+        tokens[n].quoted = quoted;
+        tokens[n].pattern = lex_nglobs > 0 ? lex_pattern(start, out - start) : NULL;
+        if (!quoted && is_redirect_token(op) && strspn(start, "0123456789") == (size_t)(out - start))
+            tokens[n].type = TOK_IO_NUMBER;
+        tokens[n++].text = start;
+        if (op != 0) {
+            tokens[n].type = op;
+            tokens[n].quoted = 0;
+            tokens[n++].text = NULL;
+        }
+        total += (out - start) + 1 + sizeof(char*);
+        if (arg_max > 0 && total > (size_t)arg_max) {
+            if (parse_report()) printf("Argument list too long (ARG_MAX is %ld bytes)\n", arg_max);
+            return NULL;
+        }
+    }
+    if (line_heredocs(&cp, tokens + line_start, n - line_start) == -1) {
+        *ntokens = -1;
+        return NULL;
+    }
+    tokens[n].type = TOK_END;
+    tokens[n].text = NULL;
+    *ntokens = n;
+    return tokens;
+}
+
+static Node* new_node(Parser* p, int type) {
+    Node* node = (Node*)arena_alloc(p->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    return node;
+}
+
+// Reports the token the parser stopped at, once. Running out of tokens
+// while partial input is allowed only marks the command as incomplete.
+static Node* syntax_error(Parser* p) {
+    if (p->error) return NULL;
+    p->error = 1;
+    if (p->tok->type == TOK_END && p->partial_ok) p->incomplete = 1;
+    else if (!parse_report()) return NULL;
+    else if (p->tok->type == TOK_WORD) printf("Syntax error: unexpected '%s'\n", p->tok->text);
+    else printf("Syntax error: unexpected %s\n", token_names[p->tok->type]);
+    return NULL;
+}
+
+// Whether the next token is the reserved word keyword. Reserved words are
+// only recognised unquoted, and only where a command could start.
+static int at_keyword(Parser* p, const char* keyword) {
+    return p->tok->type == TOK_WORD && !p->tok->quoted && p->tok->text[0] == keyword[0] &&
+           strcmp(p->tok->text, keyword) == 0;
+}
+
+// Consumes the reserved word keyword, or reports a syntax error
+static int expect_keyword(Parser* p, const char* keyword) {
+    if (!at_keyword(p, keyword)) return syntax_error(p) != NULL;
+    p->tok++;
+    return 1;
+}
+
+static void skip_newlines(Parser* p) {
+    while (p->tok->type == TOK_NEWLINE) p->tok++;
+}
+
+// Whether the next token ends a list: the end of input, a closing
+// parenthesis or ;;, or a reserved word that closes or continues a
+// compound command
+static int at_list_end(Parser* p) {
+    static const char* enders[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+    int type = p->tok->type;
+    if (type == TOK_END || type == TOK_RPAREN || type == TOK_DSEMI) return 1;
+    for (int i = 0; type == TOK_WORD && enders[i] != NULL; i++)
+        if (at_keyword(p, enders[i])) return 1;
+    return 0;
+}
+
+// redirect: [n] ('<' | '>' | '>>' | '<&' | '>&' | '<<' | '<<-' | '<<<') word
+// Appends the redirection at p->tok to the list ending at *tail.
+static int parse_redirect(Parser* p, Redirect*** tail) {
+    Token* t = p->tok;
+    Redirect* r = (Redirect*)arena_alloc(p->arena, sizeof(Redirect));
+    int fd = t->type == TOK_IO_NUMBER ? atoi((t++)->text) : -1;
+    int op = t->type;
+    if (t[1].type != TOK_WORD) {
+        p->tok = t + 1;
+        syntax_error(p);
+        return -1;
+    }
+    r->type = op == TOK_LESS ? REDIR_IN : op == TOK_GREAT ? REDIR_OUT :
+              op == TOK_DGREAT ? REDIR_APPEND : op == TOK_TLESS ? REDIR_HERESTRING :
+              op == TOK_DLESS || op == TOK_DLESSDASH ? REDIR_HEREDOC : REDIR_DUP;
+    r->fd = fd != -1 ? fd : op == TOK_GREAT || op == TOK_DGREAT || op == TOK_GREATAND ?
+            STDOUT_FILENO : STDIN_FILENO;
+    // A here-document's word already holds the body the lexer read
+    r->target = arena_strdup(p->arena, t[1].text);
+    r->next = NULL;
+    **tail = r;
+    *tail = &r->next;
+    p->tok = t + 2;
+    return 0;
+}
+
+// Parses the redirections after a compound command into node
+static Node* parse_redirects(Parser* p, Node* node) {
+    Redirect** tail = &node->redirs;
+    while (p->tok->type == TOK_IO_NUMBER || is_redirect_token(p->tok->type))
+        if (parse_redirect(p, &tail) == -1) return NULL;
+    return node;
+}
+
+// Copies count word tokens into a NULL-terminated array in the arena
+static char** parse_words(Parser* p, Token* t, int count) {
+    char** words = (char**)arena_alloc(p->arena, sizeof(char*) * (count + 1));
+    for (int i = 0; i < count; i++) words[i] = arena_strdup(p->arena, t[i].text);
+    words[count] = NULL;
+    return words;
+}
+
+// command : (NAME=value | redirect)* [word (word | redirect)*]
+static Node* parse_simple_command(Parser* p) {
+    Node* node = new_node(p, NODE_COMMAND);
+    Redirect** tail = &node->redirs;
+    int max = 0, nwords = 0, nassigns = 0;
+
+    while (p->tok[max].type == TOK_WORD || p->tok[max].type == TOK_IO_NUMBER ||
+           is_redirect_token(p->tok[max].type))
+        max++;
+    node->argv = (char**)arena_alloc(p->arena, sizeof(char*) * (max + 1));
+    node->assigns = (char**)arena_alloc(p->arena, sizeof(char*) * (max + 1));
+
+    for (;;) {
+        Token* t = p->tok;
+        if (t->type == TOK_WORD) {
+            char* word = arena_strdup(p->arena, t->text);
+            if (nwords == 0 && is_assignment(word)) node->assigns[nassigns++] = word;
+            else node->argv[nwords++] = word;
+            p->tok++;
+            continue;
+        }
+        if (t->type != TOK_IO_NUMBER && !is_redirect_token(t->type)) break;
+        if (parse_redirect(p, &tail) == -1) return NULL;
+    }
+    node->argv[nwords] = NULL;
+    node->assigns[nassigns] = NULL;
+    if (nwords == 0 && nassigns == 0 && node->redirs == NULL) return syntax_error(p);
+    return node;
+}
+
+static Node* parse_list(Parser* p);
+static Node* parse_compound(Parser* p);
+
+// A list that must not be empty, like the parts of a compound command
+static Node* parse_body(Parser* p) {
+    Node* list = parse_list(p);
+    if (list == NULL && !p->error) syntax_error(p);
+    return list;
+}
+
+// do_group: 'do' list 'done'
+static Node* parse_do_group(Parser* p) {
+    if (!expect_keyword(p, "do")) return NULL;
+    Node* body = parse_body(p);
+    return body != NULL && expect_keyword(p, "done") ? body : NULL;
+}
+
+// if: ('if' | 'elif') list 'then' list [('elif' ... | 'else' list) ] 'fi'
+// An elif becomes a nested if in the else branch, and reads the 'fi'.
+static Node* parse_if(Parser* p) {
+    Node* node = new_node(p, NODE_IF);
+    p->tok++;
+    if ((node->left = parse_body(p)) == NULL || !expect_keyword(p, "then") ||
+        (node->right = parse_body(p)) == NULL)
+        return NULL;
+    if (at_keyword(p, "elif")) return (node->next = parse_if(p)) != NULL ? node : NULL;
+    if (at_keyword(p, "else")) {
+        p->tok++;
+        if ((node->next = parse_body(p)) == NULL) return NULL;
+    }
+    return expect_keyword(p, "fi") ? node : NULL;
+}
+
+// while: ('while' | 'until') list do_group
+static Node* parse_while(Parser* p) {
+    Node* node = new_node(p, at_keyword(p, "while") ? NODE_WHILE : NODE_UNTIL);
+    p->tok++;
+    if ((node->left = parse_body(p)) == NULL) return NULL;
+    return (node->right = parse_do_group(p)) != NULL ? node : NULL;
+}
+
+// for: 'for' NAME [newlines 'in' word* (';' | newline)] newlines do_group
+// Without "in", the loop runs over the positional parameters.
+static Node* parse_for(Parser* p) {
+    Node* node = new_node(p, NODE_FOR);
+    p->tok++;
+    if (p->tok->type != TOK_WORD || !is_name(p->tok->text)) return syntax_error(p);
+    node->name = arena_strdup(p->arena, (p->tok++)->text);
+    skip_newlines(p);
+    if (at_keyword(p, "in")) {
+        int count = 0;
+        p->tok++;
+        while (p->tok[count].type == TOK_WORD) count++;
+        node->argv = parse_words(p, p->tok, count);
+        p->tok += count;
+        if (p->tok->type != TOK_SEMI && p->tok->type != TOK_NEWLINE) return syntax_error(p);
+        p->tok++;
+    } else if (p->tok->type == TOK_SEMI) {
+        p->tok++;
+    }
+    skip_newlines(p);
+    return (node->right = parse_do_group(p)) != NULL ? node : NULL;
+}
+
+// case: 'case' word newlines 'in' newlines item* 'esac'
+// item: ['('] pattern ('|' pattern)* ')' list [';;' newlines]
+static Node* parse_case(Parser* p) {
+    Node* node = new_node(p, NODE_CASE);
+    Node** tail = &node->next;
+    p->tok++;
+    if (p->tok->type != TOK_WORD) return syntax_error(p);
+    node->argv = parse_words(p, p->tok++, 1);
+    skip_newlines(p);
+    if (!expect_keyword(p, "in")) return NULL;
+    skip_newlines(p);
+
+    while (!at_keyword(p, "esac")) {
+        Node* item = new_node(p, NODE_CASE_ITEM);
+        int count = 1;
+        if (p->tok->type == TOK_LPAREN) p->tok++;
+        for (Token* t = p->tok; t->type == TOK_WORD && t[1].type == TOK_PIPE; t += 2) count++;
+        item->argv = (char**)arena_alloc(p->arena, sizeof(char*) * (count + 1));
+        for (int i = 0; i < count; i++) {
+            if (p->tok->type != TOK_WORD) return syntax_error(p);
+            Token* t = p->tok;
+            item->argv[i] = arena_strdup(p->arena, t->pattern != NULL ? t->pattern : t->text);
+            p->tok += i < count - 1 ? 2 : 1;
+        }
+        item->argv[count] = NULL;
+        if (p->tok->type != TOK_RPAREN) return syntax_error(p);
+        p->tok++;
+        // An item's list may be empty
+        item->left = parse_list(p);
+        if (p->error) return NULL;
+        *tail = item;
+        tail = &item->next;
+        if (p->tok->type == TOK_DSEMI) {
+            p->tok++;
+            skip_newlines(p);
+        } else if (!at_keyword(p, "esac")) {
+            return syntax_error(p);
+        }
+    }
+    p->tok++;
+    return node;
+}
+
+// compound: if | while | until | for | case | '{' list '}' | '(' list ')'
+static Node* parse_compound(Parser* p) {
+    if (at_keyword(p, "if")) return parse_if(p);
+    if (at_keyword(p, "while") || at_keyword(p, "until")) return parse_while(p);
+    if (at_keyword(p, "for")) return parse_for(p);
+    if (at_keyword(p, "case")) return parse_case(p);
+    int group = at_keyword(p, "{");
+    if (!group && p->tok->type != TOK_LPAREN) return syntax_error(p);
+    Node* node = new_node(p, group ? NODE_GROUP : NODE_SUBSHELL);
+    p->tok++;
+    if ((node->left = parse_body(p)) == NULL) return NULL;
+    if (group) return expect_keyword(p, "}") ? node : NULL;
+    if (p->tok->type != TOK_RPAREN) return syntax_error(p);
+    p->tok++;
+    return node;
+}
+
+// Whether the next token starts a compound command
+static int at_compound(Parser* p) {
+    return p->tok->type == TOK_LPAREN || at_keyword(p, "if") || at_keyword(p, "while") ||
+           at_keyword(p, "until") || at_keyword(p, "for") || at_keyword(p, "case") || at_keyword(p, "{");
+}
+
+// A one-stage pipeline around stage
+static Node* single_stage(Parser* p, Node* stage, int timed) {
+    Node* node = new_node(p, NODE_PIPELINE);
+    node->timed = timed;
+    node->stages = (Node**)arena_alloc(p->arena, sizeof(Node*));
+    node->stages[0] = stage;
+    node->nstages = 1;
+    return node;
+}
+
+// command: compound redirect* | NAME '(' ')' newlines compound redirect*
+//        | simple_command
+// A function's body keeps its redirections, to apply on every call, so
+// the body is a pipeline whenever it has some or is a subshell.
+static Node* parse_command_node(Parser* p) {
+    Token* t = p->tok;
+    if (t->type == TOK_WORD && !t->quoted && t[1].type == TOK_LPAREN) {
+        p->tok = t + 2;
+        if (!is_name(t->text) || p->tok->type != TOK_RPAREN) return syntax_error(p);
+        Node* node = new_node(p, NODE_FUNCTION);
+        node->name = arena_strdup(p->arena, t->text);
+        p->tok++;
+        skip_newlines(p);
+        Node* body = parse_compound(p);
+        if (body == NULL || parse_redirects(p, body) == NULL) return NULL;
+        node->left = body->redirs != NULL || body->type == NODE_SUBSHELL ? single_stage(p, body, 0) : body;
+        return node;
+    }
+    if (!at_compound(p)) return parse_simple_command(p);
+    Node* node = parse_compound(p);
+    return node != NULL ? parse_redirects(p, node) : NULL;
+}
+
+// pipeline: ['time'] command ('|' newlines command)*
+// A lone compound command without redirections is run as it is, not as a
+// pipeline, so loops and conditionals do not go through execute().
+static Node* parse_pipeline(Parser* p) {
+    int cap = 4, timed = 0;
+    // "time" is a keyword only unquoted, and only with a command after it
+    if (at_keyword(p, "time") && (p->tok[1].type == TOK_WORD || p->tok[1].type == TOK_IO_NUMBER ||
+                                  p->tok[1].type == TOK_LPAREN || is_redirect_token(p->tok[1].type))) {
+        timed = 1;
+        p->tok++;
+    }
+
+    Node* node = new_node(p, NODE_PIPELINE);
+    node->timed = timed;
+    node->stages = (Node**)arena_alloc(p->arena, sizeof(Node*) * cap);
+    for (;;) {
+        Node* stage = parse_command_node(p);
+        if (stage == NULL) return NULL;
+        if (node->nstages == cap) {
+            Node** bigger = (Node**)arena_alloc(p->arena, sizeof(Node*) * cap * 2);
+            memcpy(bigger, node->stages, sizeof(Node*) * cap);
+            node->stages = bigger;
+            cap *= 2;
+        }
+        node->stages[node->nstages++] = stage;
+        if (p->tok->type != TOK_PIPE) break;
+        p->tok++;
+        skip_newlines(p);
+    }
+    Node* only = node->stages[0];
+    if (node->nstages == 1 && !timed && only->type != NODE_COMMAND && only->type != NODE_SUBSHELL &&
+        only->redirs == NULL)
+        return only;
+    return node;
+}
+
+// and_or: pipeline (('&&' | '||') newlines pipeline)*
+static Node* parse_and_or(Parser* p) {
+    Node* left = parse_pipeline(p);
+    while (left != NULL && (p->tok->type == TOK_AND || p->tok->type == TOK_OR)) {
+        Node* node = new_node(p, p->tok->type == TOK_AND ? NODE_AND : NODE_OR);
+        p->tok++;
+        skip_newlines(p);
+        node->left = left;
+        if ((node->right = parse_pipeline(p)) == NULL) return NULL;
+        left = node;
+    }
+    return left;
+}
+
+// list: newlines and_or ((';' | '&' | newline) newlines and_or)* [';' | '&']
+// A list runs up to the end of input or a token that closes it, like
+// "fi" or ")"; the caller checks that the token is the one it expects.
+static Node* parse_list(Parser* p) {
+    Node* list = NULL;
+    skip_newlines(p);
+    while (!at_list_end(p)) {
+        Node* item = parse_and_or(p);
+        if (item == NULL) return NULL;
+        if (p->tok->type == TOK_AMP) {
+            Node* job = new_node(p, NODE_BACKGROUND);
+            job->left = item;
+            item = job;
+            p->tok++;
+        } else if (p->tok->type == TOK_SEMI || p->tok->type == TOK_NEWLINE) {
+            p->tok++;
+        } else if (!at_list_end(p)) {
+            return syntax_error(p);
+        }
+        skip_newlines(p);
+        if (list == NULL) {
+            list = item;
+        } else {
+            Node* node = new_node(p, NODE_LIST);
+            node->left = list;
+            node->right = item;
+            list = node;
+        }
+    }
+    return list;
+}
+
+// Builds the AST for a token array in arena. Returns NULL for an empty
+// line, or with *error set after reporting a syntax error. With
+// lex_partial set, input that stops before the command is complete sets
+// *error to -1 instead, without a message.
+Node* parse(Token* tokens, Arena* arena, int* error) {
+    Parser p = {tokens, arena, 0, lex_partial, 0};
+    Node* ast = parse_list(&p);
+    if (!p.error && p.tok->type != TOK_END) syntax_error(&p);
+    *error = p.incomplete ? -1 : p.error;
+    return p.error ? NULL : ast;
+}
+
+// Moves a cache entry to the front of the LRU list
+static void lru_unlink(CacheEntry* entry) {
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else lru_head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else lru_tail = entry->prev;
+}
+
+static void lru_push(CacheEntry* entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) lru_head->prev = entry;
+    else lru_tail = entry;
+    lru_head = entry;
+}
+
+// Drops an entry from its bucket and the LRU list and frees its memory
+static void cache_remove(CacheEntry* entry) {
+    CacheEntry** link = &parse_buckets[entry->hash & (PARSE_CACHE_BUCKETS - 1)];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    lru_unlink(entry);
+    arena_free(&entry->arena);
+    entry->next = cache_free;
+    cache_free = entry;
+    parse_cache_count--;
+}
+
+// Returns an unused entry, evicting the least recently used one if the
+// cache is full
+static CacheEntry* cache_take() {
+    if (cache_free == NULL && parse_cache_next < PARSE_CACHE_SIZE) return &parse_cache[parse_cache_next++];
+    if (cache_free == NULL) {
+        cache_remove(lru_tail);
+        parse_evictions++;
+    }
+    CacheEntry* entry = cache_free;
+    cache_free = entry->next;
+    return entry;
+}
+
+// Reads lines from more_input onto a command that first is only the start
+// of, like an open "if", quote or here-document, until the whole parses
+// or the input ends, when the error is reported. The text is lexed afresh
+// from a copy each time, since lexing squeezes words in place, and the
+// tree is built in the command arena: multi-line commands are not cached.
+// Inside a here-document only its delimiter line can change the outcome,
+// so the lines before it are just collected.
+static Node* parse_continued(const char* first, int* error) {
+    size_t len = strlen(first), cap = len + 256;
+    char* text = (char*)malloc(cap);
+    ArenaMark mark = arena_mark(&cmd_arena);
+    Node* ast = NULL;
+    // Delimiter of the unfinished here-document, from the last lex() call
+    char* wanted = lex_heredoc != NULL ? strdup(lex_heredoc->text) : NULL;
+    int strip_tabs = lex_heredoc != NULL && lex_heredoc[-1].type == TOK_DLESSDASH;
+
+    if (text == NULL) {
+        perror("Command buffer allocation failed");
+        exit(1);
+    }
+    memcpy(text, first, len + 1);
+    for (;;) {
+        size_t line_len;
+        char* line;
+        if (interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
+        if ((line = lr_next_line(more_input, &line_len)) != NULL) {
+            if (len + line_len + 2 > cap) {
+                while (len + line_len + 2 > cap) cap *= 2;
+                if ((text = (char*)realloc(text, cap)) == NULL) {
+                    perror("Command buffer allocation failed");
+                    exit(1);
+                }
+            }
+            text[len++] = '\n';
+            memcpy(text + len, line, line_len + 1);
+            len += line_len;
+            if (strip_tabs) line += strspn(line, "\t");
+            if (wanted != NULL && strcmp(line, wanted) != 0) continue;
+        }
+        // At end of input the last attempt reports what is missing
+        lex_partial = line != NULL;
+        arena_release(&cmd_arena, mark);
+        int ntokens;
+        Token* tokens = lex(arena_strdup(&cmd_arena, text), &ntokens);
+        ast = tokens != NULL ? parse(tokens, &cmd_arena, error) : NULL;
+        if (tokens == NULL) *error = ntokens == -1 ? -1 : 1;
+        if (*error != -1 || line == NULL) break;
+        free(wanted);
+        wanted = lex_heredoc != NULL ? strdup(lex_heredoc->text) : NULL;
+        strip_tabs = lex_heredoc != NULL && lex_heredoc[-1].type == TOK_DLESSDASH;
+    }
+    lex_partial = 0;
+    free(wanted);
+    continued_text = arena_strdup(&cmd_arena, text);
+    free(text);
+    return ast;
+}
+
+// Returns the AST for a command line, from the cache when the same text
+// was parsed before. On a miss the line is lexed in place and parsed into
+// a new entry's arena; lines that fail to parse are not kept, and a line
+// that leaves its command unfinished is completed by parse_continued().
+// Returns NULL for an empty line, or with *error set after a syntax error.
+Node* parse_command(char* cmdline, int* error) {
+    size_t len = strlen(cmdline);
+    unsigned long hash = hash_bytes(cmdline, len);
+    CacheEntry** bucket = &parse_buckets[hash & (PARSE_CACHE_BUCKETS - 1)];
+
+    *error = 0;
+    for (CacheEntry* entry = *bucket; entry != NULL; entry = entry->chain) {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->text, cmdline, len) == 0) {
+            parse_hits++;
+            lru_unlink(entry);
+            lru_push(entry);
+            return entry->ast;
+        }
+    }
+
+    parse_misses++;
+    CacheEntry* entry = cache_take();
+    entry->arena.min_block = PARSE_ARENA_BLOCK;
+    entry->hash = hash;
+    entry->len = len;
+    entry->text = (char*)arena_alloc(&entry->arena, len + 1);
+    memcpy(entry->text, cmdline, len + 1);
+
+    int ntokens;
+    lex_partial = more_input != NULL;
+    Token* tokens = lex(cmdline, &ntokens);
+    entry->ast = tokens != NULL ? parse(tokens, &entry->arena, error) : NULL;
+    lex_partial = 0;
+    if (tokens == NULL) *error = ntokens == -1 ? -1 : 1;
+    if (entry->ast == NULL) {
+        Node* ast = *error == -1 ? parse_continued(entry->text, error) : NULL;
+        arena_free(&entry->arena);
+        entry->next = cache_free;
+        cache_free = entry;
+        return ast;
+    }
+    entry->chain = *bucket;
+    *bucket = entry;
+    lru_push(entry);
+    parse_cache_count++;
+    return entry->ast;
+}
+
+// Copies size bytes into a script image, 8-byte aligned, and returns the
+// offset they went to
+static uint64_t image_put(ScriptImage* img, const void* src, size_t size) {
+    size_t off = (img->len + 7) & ~(size_t)7;
+    if (off + size > img->cap) {
+        while (off + size > img->cap) img->cap = img->cap ? img->cap * 2 : 4096;
+        if ((img->data = (char*)realloc(img->data, img->cap)) == NULL) {
+            perror("Script image allocation failed");
+            exit(1);
+        }
+    }
+    memset(img->data + img->len, 0, off - img->len);
+    memcpy(img->data + off, src, size);
+    img->len = off + size;
+    return off;
+}
+
+static char* image_string(ScriptImage* img, const char* str) {
+    if (str == NULL) return NULL;
+    return (char*)(uintptr_t)image_put(img, str, strlen(str) + 1);
+}
+
+static char** image_words(ScriptImage* img, char** words) {
+    if (words == NULL) return NULL;
+    int n = 0;
+    while (words[n] != NULL) n++;
+    char** copy = (char**)arena_alloc(&cmd_arena, sizeof(char*) * (n + 1));
+    for (int i = 0; i < n; i++) copy[i] = image_string(img, words[i]);
+    copy[n] = NULL;
+    return (char**)(uintptr_t)image_put(img, copy, sizeof(char*) * (n + 1));
+}
+
+static Redirect* image_redirects(ScriptImage* img, Redirect* redir) {
+    if (redir == NULL) return NULL;
+    Redirect copy = *redir;
+    copy.target = image_string(img, redir->target);
+    copy.next = image_redirects(img, redir->next);
+    return (Redirect*)(uintptr_t)image_put(img, &copy, sizeof(Redirect));
+}
+
+// Lays a tree out in a script image, children first, and returns its offset
+static Node* image_node(ScriptImage* img, Node* node) {
+    if (node == NULL) return NULL;
+    Node copy = *node;
+    copy.left = image_node(img, node->left);
+    copy.right = image_node(img, node->right);
+    copy.next = image_node(img, node->next);
+    if (node->stages != NULL) {
+        Node** stages = (Node**)arena_alloc(&cmd_arena, sizeof(Node*) * node->nstages);
+        for (int i = 0; i < node->nstages; i++) stages[i] = image_node(img, node->stages[i]);
+        copy.stages = (Node**)(uintptr_t)image_put(img, stages, sizeof(Node*) * node->nstages);
+    }
+    copy.name = image_string(img, node->name);
+    copy.argv = image_words(img, node->argv);
+    copy.assigns = image_words(img, node->assigns);
+    copy.redirs = image_redirects(img, node->redirs);
+    return (Node*)(uintptr_t)image_put(img, &copy, sizeof(Node));
+}
+
+// Turns an offset in a loaded image back into a pointer
+static void* image_pointer(char* base, const void* offset) {
+    return offset != NULL ? base + (uintptr_t)offset : NULL;
+}
+
+static char** relocate_words(char* base, char** offset) {
+    char** words = (char**)image_pointer(base, offset);
+    for (int i = 0; words != NULL && words[i] != NULL; i++) words[i] = (char*)image_pointer(base, words[i]);
+    return words;
+}
+
+// Makes the tree at offset in a loaded image usable in place, by turning
+// each of its offsets into a pointer, and returns it
+static Node* relocate_node(char* base, Node* offset) {
+    Node* node = (Node*)image_pointer(base, offset);
+    if (node == NULL) return NULL;
+    node->left = relocate_node(base, node->left);
+    node->right = relocate_node(base, node->right);
+    node->next = relocate_node(base, node->next);
+    node->stages = (Node**)image_pointer(base, node->stages);
+    for (int i = 0; node->stages != NULL && i < node->nstages; i++)
+        node->stages[i] = relocate_node(base, node->stages[i]);
+    node->name = (char*)image_pointer(base, node->name);
+    node->argv = relocate_words(base, node->argv);
+    node->assigns = relocate_words(base, node->assigns);
+    node->redirs = (Redirect*)image_pointer(base, node->redirs);
+    for (Redirect* r = node->redirs; r != NULL; r = r->next) {
+        r->target = (char*)image_pointer(base, r->target);
+        r->next = (Redirect*)image_pointer(base, r->next);
+    }
+    return node;
+}
+
+// Parses a whole script, a command at a time as run_command() would, into
+// an image holding one tree per top-level command, and fills in the image
+// fields of header. Returns 0 with nothing printed if any command fails to
+// parse, since the commands before it must still run first.
+static int compile_script(const char* text, ScriptImage* img, ScriptHeader* header) {
+    LineReader reader;
+    LineReader* saved_input = more_input;
+    Node** roots = NULL;
+    size_t nroots = 0, cap = 0;
+    uint64_t none = 0;
+    size_t len;
+    char* line;
+
+    lr_init_string(&reader, text);
+    more_input = &reader;
+    script_compiling = 1;
+    script_compile_failed = 0;
+    image_put(img, &none, sizeof(none));
+    while (!script_compile_failed && (line = lr_next_line(&reader, &len)) != NULL) {
+        arena_reset(&cmd_arena);
+        char* first = arena_strdup(&cmd_arena, line);
+        int error, ntokens;
+        lex_partial = 1;
+        Token* tokens = lex(line, &ntokens);
+        Node* ast = tokens != NULL ? parse(tokens, &cmd_arena, &error) : NULL;
+        lex_partial = 0;
+        if (tokens == NULL) error = ntokens == -1 ? -1 : 1;
+        if (error == -1) ast = parse_continued(first, &error);
+        if (error) script_compile_failed = 1;
+        if (ast == NULL) continue;
+        if (nroots == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((roots = (Node**)realloc(roots, sizeof(Node*) * cap)) == NULL) {
+                perror("Script image allocation failed");
+                exit(1);
+            }
+        }
+        roots[nroots++] = image_node(img, ast);
+    }
+    arena_reset(&cmd_arena);
+    script_compiling = 0;
+    more_input = saved_input;
+    free(reader.buf);
+
+    int ok = !script_compile_failed;
+    if (ok) {
+        header->roots = image_put(img, roots, sizeof(Node*) * nroots);
+        header->nroots = nroots;
+        header->image_size = img->len;
+        header->image_hash = hash_bytes(img->data, img->len);
+    }
+    free(roots);
+    return ok;
+}
+
+// Reads exactly size bytes at offset; returns 0 on a short read
+static int read_at(int fd, void* buf, size_t size, off_t offset) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, (char*)buf + got, size - got, offset + got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        got += n;
+    }
+    return 1;
+}
+
+// Returns the image of a compiled script if the file at path was compiled
+// by this build from the source want describes and is intact, else NULL.
+// Only a file no one else could have written is trusted to hold commands.
+static char* load_compiled(const char* path, const ScriptHeader* want, ScriptHeader* header) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char* image = NULL;
+
+    if (fd == -1) return NULL;
+    if (fstat(fd, &st) == 0 && (st.st_uid == geteuid() || st.st_uid == 0) &&
+        (st.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+        read_at(fd, header, sizeof(*header), 0) &&
+        header->magic == want->magic && header->layout == want->layout &&
+        header->mtime_sec == want->mtime_sec && header->mtime_nsec == want->mtime_nsec &&
+        header->size == want->size && header->source_hash == want->source_hash &&
+        header->image_size == (uint64_t)st.st_size - sizeof(*header) &&
+        header->roots + sizeof(Node*) * header->nroots <= header->image_size &&
+        (image = (char*)malloc(header->image_size)) != NULL &&
+        read_at(fd, image, header->image_size, sizeof(*header)) &&
+        hash_bytes(image, header->image_size) == header->image_hash) {
+        close(fd);
+        return image;
+    }
+    free(image);
+    close(fd);
+    return NULL;
+}
+
+// Writes a compiled script through a temporary file renamed into place,
+// so a run starting meanwhile never reads half of one. A directory the
+// shell cannot write to only means the script is compiled on every run.
+static void save_compiled(const char* path, const ScriptHeader* header, const ScriptImage* img) {
+    char* tmp = (char*)malloc(strlen(path) + 8);
+    if (tmp == NULL) return;
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        free(tmp);
+        return;
+    }
+    struct iovec iov[2] = {{(void*)header, sizeof(*header)}, {img->data, img->len}};
+    ssize_t total = sizeof(*header) + img->len;
+    int ok = fchmod(fd, 0644) == 0 && writev(fd, iov, 2) == total;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) unlink(tmp);
+    free(tmp);
+}
+
+// Runs a script from its compiled form, path.v7c beside it, compiling it
+// and writing that file first when it is missing or the script changed.
+// Later runs skip lexing and parsing: loading is a read and one pass that
+// turns offsets into pointers. Returns -1, having run nothing, when the
+// script must run line by line instead: it is not a regular file, fails
+// to parse somewhere, or PUCIT_SCRIPT_CACHE is 0.
+int run_script(int fd, const char* path) {
+    const char* setting = getenv("PUCIT_SCRIPT_CACHE");
+    uint64_t started = stat_now();
+    struct stat st;
+
+    if (setting != NULL && strcmp(setting, "0") == 0) return -1;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+    char* text = (char*)malloc(st.st_size + 1);
+    if (text == NULL) return -1;
+    if (!read_at(fd, text, st.st_size, 0) || memchr(text, '\0', st.st_size) != NULL) {
+        free(text);
+        return -1;
+    }
+    text[st.st_size] = '\0';
+
+    ScriptHeader want = {SCRIPT_MAGIC, SCRIPT_LAYOUT, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (uint64_t)st.st_size,
+                         hash_bytes(text, st.st_size), 0, 0, 0, 0};
+    ScriptHeader header;
+    char* cache_path = (char*)malloc(strlen(path) + 5);
+    if (cache_path == NULL) {
+        free(text);
+        return -1;
+    }
+    sprintf(cache_path, "%s.v7c", path);
+    char* image = load_compiled(cache_path, &want, &header);
+    if (image == NULL) {
+        ScriptImage img = {NULL, 0, 0};
+        if (!compile_script(text, &img, &want)) {
+            free(img.data);
+            free(cache_path);
+            free(text);
+            return -1;
+        }
+        save_compiled(cache_path, &want, &img);
+        image = img.data;
+        header = want;
+    }
+    free(cache_path);
+    free(text);
+
+    Node** roots = (Node**)(image + header.roots);
+    for (uint64_t i = 0; i < header.nroots; i++) roots[i] = relocate_node(image, roots[i]);
+    stat_record(PHASE_PARSE, started, NULL);
+    for (uint64_t i = 0; i < header.nroots; i++) {
+        arena_reset(&cmd_arena);
+        interrupted = 0;
+        reap_jobs();
+        notify_jobs();
+        run_node(roots[i]);
+    }
+    free(image);
+    return 0;
+}
+
+
+// Empties the parse cache, except for the most recent entry: that is the
+// command running now, which may be a loop that called this
+void clear_parse_cache() {
+    while (lru_tail != lru_head) cache_remove(lru_tail);
+}
+
+// Prints parse cache statistics for the "parsecache" builtin
+void parse_cache_stats() {
+    unsigned long lookups = parse_hits + parse_misses;
+    printf("Parse cache entries:   %d of %d\n", parse_cache_count, PARSE_CACHE_SIZE);
+    printf("Parse cache hits:      %lu (%.1f%%)\n", parse_hits, lookups ? 100.0 * parse_hits / lookups : 0.0);
+    printf("Parse cache misses:    %lu\n", parse_misses);
+    printf("Parse cache evictions: %lu\n", parse_evictions);
+}
+
+// Prints the prompt and returns the next input line, or NULL at end of
+// input. The line lives in the reader's buffer and stays valid until the
+// next call. While waiting it also watches child exits, so a background
+// job that finishes is reported at once, not after the next command.
+char* read_cmd(char* prompt, LineReader* reader) {
+    size_t len;
+    char* line;
+
+    printf("%s", prompt);
+    fflush(stdout);
+    while ((line = lr_buffered_line(reader, &len)) == NULL && !reader->eof) {
+        struct epoll_event events[2];
+        int n = reader->fd == polled_fd ? epoll_wait(loop_epoll, events, 2, -1) : -1;
+        if (n == -1) {
+            if (reader->fd != polled_fd || errno != EINTR) lr_fill(reader);
+            continue;
+        }
+        int readable = 0;
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == EV_INPUT) {
+                readable = 1;
+                continue;
+            }
+            reap_jobs();
+            if (jobs_done > 0) {
+                printf("\n");
+                notify_jobs();
+                printf("%s", prompt);
+                fflush(stdout);
+            }
+        }
+        if (readable) lr_fill(reader);
+    }
+    return line;
+}
+
+// Prepares a line reader over an in-memory command string, as for -c
+void lr_init_string(LineReader* reader, const char* text) {
+    size_t len = strlen(text);
+    reader->fd = -1;
+    reader->cap = len + 1;
+    reader->buf = (char*)malloc(reader->cap);
+    if (reader->buf == NULL) {
+        perror("Line buffer allocation failed");
+        exit(1);
+    }
+    memcpy(reader->buf, text, len);
+    reader->start = 0;
+    reader->end = len;
+    reader->scanned = 0;
+    reader->eof = 1;
+}
+
+// Prepares a line reader on fd
+void lr_init(LineReader* reader, int fd) {
+    reader->fd = fd;
+    reader->cap = READ_CHUNK;
+    reader->buf = (char*)malloc(reader->cap);
+    if (reader->buf == NULL) {
+        perror("Line buffer allocation failed");
+        exit(1);
+    }
+    reader->start = reader->end = reader->scanned = 0;
+    reader->eof = 0;
+}
+
+// Returns the next line without its newline, NUL-terminated in place, and
+// stores its length in len. Returns NULL once the input is exhausted.
+char* lr_next_line(LineReader* reader, size_t* len) {
+    char* line;
+    while ((line = lr_buffered_line(reader, len)) == NULL && !reader->eof) lr_fill(reader);
+    return line;
+}
+
+// Returns the next line already in the buffer, or at end of input the
+// unterminated last one, without reading. NULL means more input is
+// needed, or with eof set that the input is exhausted.
+char* lr_buffered_line(LineReader* reader, size_t* len) {
+    char* line = reader->buf + reader->start;
+    size_t scanned = reader->scanned;
+    char* nl = (char*)memchr(line + scanned, '\n', reader->end - reader->start - scanned);
+    if (nl != NULL) {
+        *nl = '\0';
+        *len = nl - line;
+        reader->start = nl + 1 - reader->buf;
+        reader->scanned = 0;
+        return line;
+    }
+    reader->scanned = scanned = reader->end - reader->start;
+
+    if (!reader->eof || scanned == 0) return NULL;
+    // Last line without a newline; the spare byte holds the NUL
+    line[scanned] = '\0';
+    *len = scanned;
+    reader->start = reader->end;
+    reader->scanned = 0;
+    return line;
+}
+
+// Reads once from the reader's fd, first sliding the partial line to the
+// front, or growing the buffer if the line fills it
+void lr_fill(LineReader* reader) {
+    size_t pending = reader->end - reader->start;
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, pending);
+        reader->start = 0;
+        reader->end = pending;
+    }
+    if (reader->end + 1 >= reader->cap) {
+        char* bigger = (char*)realloc(reader->buf, reader->cap * 2);
+        if (bigger == NULL) {
+            perror("Line buffer allocation failed");
+            exit(1);
+        }
+        reader->buf = bigger;
+        reader->cap *= 2;
+    }
+
+    ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+    if (n == -1) {
+        if (errno == EINTR) return;
+        perror("read failed");
+        n = 0;
+    }
+    if (n == 0) reader->eof = 1;
+    reader->end += n;
+}
+
+// Hands out size bytes from the arena, chaining a new block when the
+// current one is full. Memory is only reclaimed by arena_reset() or
+// arena_release().
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = arena->current;
+
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        size_t base = arena->min_block != 0 ? arena->min_block : ARENA_BLOCK;
+        size_t want = arena->reserved > base ? arena->reserved : base;
+        if (want < size) want = size;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + want);
+        if (block == NULL) {
+            perror("Arena allocation failed");
+            exit(1);
+        }
+        block->size = want;
+        block->used = 0;
+        block->next = NULL;
+        if (arena->head == NULL) {
+            arena->head = block;
+        } else {
+            ArenaBlock* tail = arena->current;
+            while (tail->next != NULL) tail = tail->next;
+            tail->next = block;
+        }
+        arena->reserved += want;
+        arena->grows++;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    arena->current = block;
+    arena->in_use += size;
+    arena->allocs++;
+    return ptr;
+}
+
+// Copies a string into the arena
+char* arena_strdup(Arena* arena, const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = (char*)arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+// Releases everything allocated since the last reset. If the command
+// needed more than one block, they are merged into a single block big
+// enough for all of them, so a steady workload stops calling malloc.
+void arena_reset(Arena* arena) {
+    if (arena->in_use > arena->high_water) arena->high_water = arena->in_use;
+    arena->in_use = 0;
+    arena->allocs = 0;
+    arena->resets++;
+
+    if (arena->head != NULL && arena->head->next != NULL) {
+        ArenaBlock* block = arena->head;
+        while (block != NULL) {
+            ArenaBlock* next = block->next;
+            free(block);
+            block = next;
+        }
+        size_t want = arena->reserved;
+        arena->head = (ArenaBlock*)malloc(sizeof(ArenaBlock) + want);
+        if (arena->head == NULL) {
+            perror("Arena allocation failed");
+            exit(1);
+        }
+        arena->head->size = want;
+        arena->head->next = NULL;
+        arena->grows++;
+    }
+    if (arena->head != NULL) arena->head->used = 0;
+    arena->current = arena->head;
+}
+
+// Remembers the arena's current fill level for arena_release()
+ArenaMark arena_mark(Arena* arena) {
+    ArenaMark mark = {arena->current, arena->current != NULL ? arena->current->used : 0, arena->in_use};
+    return mark;
+}
+
+// Releases everything allocated since mark was taken, keeping the blocks
+// for reuse. Used where one command, like a loop, allocates repeatedly.
+void arena_release(Arena* arena, ArenaMark mark) {
+    ArenaBlock* block = mark.block != NULL ? mark.block : arena->head;
+    if (arena->in_use > arena->high_water) arena->high_water = arena->in_use;
+    if (block == NULL) return;
+    block->used = mark.block != NULL ? mark.used : 0;
+    for (ArenaBlock* later = block->next; later != NULL; later = later->next) later->used = 0;
+    arena->current = block;
+    arena->in_use = mark.in_use;
+}
+
+// Gives every block back to malloc, leaving an empty arena
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    size_t min_block = arena->min_block;
+    memset(arena, 0, sizeof(Arena));
+    arena->min_block = min_block;
+}
+
+// Prints arena usage for the "arena" builtin
+void arena_stats(Arena* arena) {
+    size_t blocks = 0;
+    for (ArenaBlock* b = arena->head; b != NULL; b = b->next) blocks++;
+    printf("Arena in use:        %zu bytes (%lu allocations)\n", arena->in_use, arena->allocs);
+    printf("Arena high water:    %zu bytes\n",
+           arena->in_use > arena->high_water ? arena->in_use : arena->high_water);
+    printf("Arena reserved:      %zu bytes in %zu block(s)\n", arena->reserved, blocks);
+    printf("Arena resets:        %lu\n", arena->resets);
+    printf("Arena block mallocs: %lu\n", arena->grows);
+}